@@ -16,6 +16,7 @@
 #include "../utils/transforms.hpp"              // transforms_Compose
 #include "../utils/datasets.hpp"                // datasets::ImageFolderClassesWithPaths
 #include "../utils/dataloader.hpp"              // DataLoader::ImageFolderClassesWithPaths
+#include "../utils/quantization.h"              // QuantizedSequential
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -294,6 +295,36 @@ int main() {
 		std::cout << "\nTest accuracy: " << accuracy << std::endl;
 	}
 
+	// ---------------------------------
+	// int8 post-training quantization
+	// ---------------------------------
+	if( test ) {
+		std::cout << "\n--------------- int8 PTQ --------------------\n";
+		net->to(torch::kCPU);
+		net->eval();
+		select_quantized_engine();
+
+		QuantizedSequential qnet(net);
+		int num_calib_batches = 0;
+		while (dataloader(mini_batch)) {
+			if( num_calib_batches++ < 4 )				// calibrate on a few training batches
+				qnet.calibrate(std::get<0>(mini_batch));
+		}
+		qnet.convert();
+
+		std::tuple<torch::Tensor, torch::Tensor, std::vector<std::string>> data;
+		auto report = compare_fp32_int8(
+				[&net](const torch::Tensor& x) { return net->forward(x); },
+				[&qnet](const torch::Tensor& x) { return qnet.forward(x); },
+				[&](torch::Tensor& X, torch::Tensor& y) {
+					if( ! test_dataloader(data) ) return false;
+					X = std::get<0>(data);
+					y = std::get<1>(data);
+					return true;
+				});
+		report.print(std::cout);
+	}
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
@@ -25,6 +25,7 @@
 #include "../utils/transforms.hpp"              // transforms_Compose
 #include "../utils/datasets.hpp"                // datasets::ImageFolderClassesWithPaths
 #include "../utils/dataloader.hpp"              // DataLoader::ImageFolderClassesWithPaths
+#include "../utils/pruning.h"                   // ChannelGroup
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -181,6 +182,48 @@ struct  ResNetImpl : public torch::nn::Module {
 
 TORCH_MODULE(ResNet);
 
+// Channel groups for structured pruning. The stem and the last convolution of every residual block
+// write into the same channels through the identity shortcuts; a 1x1 shortcut convolution starts a
+// new residual stream. The classifier sees every channel as 6x6 flattened features.
+std::vector<ChannelGroup> channel_groups(ResNet& net) {
+	std::vector<ChannelGroup> groups;
+
+	ChannelGroup stream;
+	stream.producers.push_back(torch::nn::Conv2d(std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(net->b1->ptr(0))));
+	stream.norms.push_back(torch::nn::BatchNorm2d(std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(net->b1->ptr(1))));
+
+	for(auto& blk : {net->b2, net->b3, net->b4, net->b5}) {
+		for(auto& module : blk->children()) {
+			auto R = std::dynamic_pointer_cast<ResidualImpl>(module);
+
+			ChannelGroup inner;
+			inner.producers.push_back(R->conv1);
+			inner.norms.push_back(R->bn1);
+			inner.consumers.push_back(R->conv2);
+			groups.push_back(inner);
+
+			stream.consumers.push_back(R->conv1);
+			if( ! R->conv3.is_empty() ) {
+				stream.consumers.push_back(R->conv3);
+				groups.push_back(stream);
+
+				stream = ChannelGroup();
+				stream.producers = {R->conv3, R->conv2};
+				stream.norms = {R->bn2};
+			} else {
+				stream.producers.push_back(R->conv2);
+				stream.norms.push_back(R->bn2);
+			}
+		}
+	}
+
+	stream.linear_consumers.push_back(
+			torch::nn::Linear(std::dynamic_pointer_cast<torch::nn::LinearImpl>(net->classifier->ptr(0))));
+	stream.features_per_channel = 6 * 6;
+	groups.push_back(stream);
+	return groups;
+}
+
 std::vector<std::string> Set_Class_Names(const std::string path, const size_t class_num) {
     // (1) Memory Allocation
     std::vector<std::string> class_names = std::vector<std::string>(class_num);
@@ -426,6 +469,64 @@ int main() {
 		std::cout << "\nTest accuracy: " << accuracy << std::endl;
 	}
 
+	// ---------------------------------
+	// structured channel pruning
+	// ---------------------------------
+	std::cout << "--------------- pruning --------------------\n";
+	auto sample = torch::randn({1, 3, (long)img_size, (long)img_size});
+	auto cpu_latency = [&]() {
+		net->eval();
+		net->to(torch::kCPU);
+		double ms = measure_latency_ms([&net](const torch::Tensor& x) { return net->forward(x); }, sample);
+		net->to(device);
+		return ms;
+	};
+
+	int64_t dense_params = count_parameters(*net);
+	double dense_ms = cpu_latency();
+
+	PruningSchedule schedule;
+	schedule.steps = 3;
+	schedule.ratio_per_step = 0.2;
+	schedule.score = ChannelScore::BNGamma;
+
+	iterative_prune([&net]() { return channel_groups(net); },
+		[&](int step) {
+			// the parameters changed shape: fine-tune with a fresh optimizer
+			torch::optim::Adam ft_optimizer(net->parameters(), torch::optim::AdamOptions(1e-4).betas({0.5, 0.999}));
+			net->train();
+			float loss_sum = 0.0;
+			while (dataloader(mini_batch)) {
+				image = std::get<0>(mini_batch).to(device);
+				label = std::get<1>(mini_batch).to(device);
+				loss = criterion(torch::nn::functional::log_softmax(net->forward(image), 1), label);
+
+				ft_optimizer.zero_grad();
+				loss.backward();
+				ft_optimizer.step();
+				loss_sum += loss.item<float>();
+			}
+			std::cout << "fine-tune " << (step + 1) << ", avg_loss: " << (loss_sum/total_iter) << std::endl;
+		}, schedule);
+
+	size_t pruned_match = 0, pruned_counter = 0;
+	{
+		torch::NoGradGuard no_grad;
+		net->eval();
+		while (valid_dataloader(mini_batch)) {
+			image = std::get<0>(mini_batch).to(device);
+			label = std::get<1>(mini_batch).to(device);
+			pruned_match += net->forward(image).argmax(1).eq(label).sum().item<int64_t>();
+			pruned_counter += image.size(0);
+		}
+	}
+
+	int64_t pruned_params = count_parameters(*net);
+	double pruned_ms = cpu_latency();
+	std::cout << "parameters: " << dense_params << " -> " << pruned_params
+			  << ", CPU latency: " << dense_ms << " ms -> " << pruned_ms << " ms"
+			  << ", pruned validation accuracy: " << ((float)pruned_match / (float)pruned_counter) << std::endl;
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
@@ -11,6 +11,7 @@
 #include "../utils/transforms.hpp"              // transforms_Compose
 #include "../utils/datasets.hpp"                // datasets::ImageFolderClassesWithPaths
 #include "../utils/dataloader.hpp"              // DataLoader::ImageFolderClassesWithPaths
+#include "../utils/pruning.h"                   // sequential_channel_groups
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -120,6 +121,11 @@ public:
 		this->apply(_initialize_weights);
 		return;
 	}
+
+	// the blocks and the classifier as one Sequential sharing the modules, for channel pruning
+	torch::nn::Sequential layers() {
+		return torch::nn::Sequential(vb1, vb2, vb3, vb4, vb5, classifier);
+	}
 };
 
 TORCH_MODULE(VGG);
@@ -365,6 +371,65 @@ int main() {
 		std::cout << "\nTest accuracy: " << accuracy << std::endl;
 	}
 
+	// ---------------------------------
+	// structured channel pruning
+	// ---------------------------------
+	std::cout << "--------------- pruning --------------------\n";
+	auto sample = torch::randn({1, 3, (long)img_size, (long)img_size});
+	auto cpu_latency = [&]() {
+		net->eval();
+		net->to(torch::kCPU);
+		double ms = measure_latency_ms([&net](const torch::Tensor& x) { return net->forward(x); }, sample);
+		net->to(device);
+		return ms;
+	};
+
+	int64_t dense_params = count_parameters(*net);
+	double dense_ms = cpu_latency();
+
+	// VGG has no BatchNorm, so channels are ranked by the L1 norm of their filters
+	PruningSchedule schedule;
+	schedule.steps = 2;
+	schedule.ratio_per_step = 0.25;
+	schedule.score = ChannelScore::L1Norm;
+
+	iterative_prune([&]() { return sequential_channel_groups(net->layers(), sample); },
+		[&](int step) {
+			// the parameters changed shape: fine-tune with a fresh optimizer
+			torch::optim::Adam ft_optimizer(net->parameters(), torch::optim::AdamOptions(1e-4).betas({0.5, 0.999}));
+			net->train();
+			float loss_sum = 0.0;
+			while (dataloader(mini_batch)) {
+				image = std::get<0>(mini_batch).to(device);
+				label = std::get<1>(mini_batch).to(device);
+				loss = criterion(torch::nn::functional::log_softmax(net->forward(image), 1), label);
+
+				ft_optimizer.zero_grad();
+				loss.backward();
+				ft_optimizer.step();
+				loss_sum += loss.item<float>();
+			}
+			std::cout << "fine-tune " << (step + 1) << ", avg_loss: " << (loss_sum/total_iter) << std::endl;
+		}, schedule);
+
+	size_t pruned_match = 0, pruned_counter = 0;
+	{
+		torch::NoGradGuard no_grad;
+		net->eval();
+		while (valid_dataloader(mini_batch)) {
+			image = std::get<0>(mini_batch).to(device);
+			label = std::get<1>(mini_batch).to(device);
+			pruned_match += net->forward(image).argmax(1).eq(label).sum().item<int64_t>();
+			pruned_counter += image.size(0);
+		}
+	}
+
+	int64_t pruned_params = count_parameters(*net);
+	double pruned_ms = cpu_latency();
+	std::cout << "parameters: " << dense_params << " -> " << pruned_params
+			  << ", CPU latency: " << dense_ms << " ms -> " << pruned_ms << " ms"
+			  << ", pruned validation accuracy: " << ((float)pruned_match / (float)pruned_counter) << std::endl;
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
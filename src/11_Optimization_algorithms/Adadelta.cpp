@@ -26,19 +26,18 @@ std::vector<std::pair<torch::Tensor, torch::Tensor>> init_adadelta_states(int64_
 
 
 void adadelta(std::vector<torch::Tensor>& params, std::vector<std::pair<torch::Tensor, torch::Tensor>>& states,
-			  std::map<std::string, float> hyperparams) {
-    auto rho = hyperparams["rho"];
-    float eps = 1e-5;
+			  const OptimHyperParams& hp) {
+    double rho = hp.rho, eps = hp.eps;
     for( int i = 0; i < params.size(); i++ ) { // p, (s, delta) in zip(params, states) {
     	auto p = params[i];
     	auto s = states[i].first;
     	auto delta = states[i].second;
     	torch::NoGradGuard no_grad;
-        // In-place updates via [:]
-        s = rho * s + (1 - rho) * torch::square(p.grad());
+        // In-place updates
+        s.mul_(rho).addcmul_(p.grad(), p.grad(), 1 - rho);
         auto g = (torch::sqrt(delta + eps) / torch::sqrt(s + eps)) * p.grad();
         p -= g;
-        delta = rho * delta + (1 - rho) * g * g;
+        delta.mul_(rho).addcmul_(g, g, 1 - rho);
         p.grad().data().zero_();
     }
 }
@@ -95,7 +94,9 @@ int main() {
 	auto t_data = torch::from_blob(datas.data(), {int(labels.size()), int(datas.size()/labels.size())}).clone();
 
 	int64_t num_epochs = 10;
-	std::map<std::string, float> hyperparams = {{"rho", 0.9}};
+	OptimHyperParams hyperparams;
+	hyperparams.rho = 0.9;
+	hyperparams.eps = 1e-5;
 
 	std::vector<std::pair<torch::Tensor, torch::Tensor>> states = init_adadelta_states(t_data.size(1));
 
@@ -109,9 +110,9 @@ int main() {
     auto start = high_resolution_clock::now();
     std::vector<float> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
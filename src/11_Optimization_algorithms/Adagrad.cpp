@@ -67,14 +67,14 @@ std::vector<torch::Tensor> init_adagrad_states(int64_t feature_dim) {
 }
 
 void adagrad(std::vector<torch::Tensor>& params, std::vector<torch::Tensor>& states,
-												 std::map<std::string, float> hyperparams) {
-    float eps = 1e-6;
+												 const OptimHyperParams& hp) {
+    double eps = hp.eps;
     for( int i = 0; i < states.size(); i++ ) {
     	auto s = states[i];
     	auto p = params[i];
     	torch::NoGradGuard no_grad;
         s += torch::square(p.grad());
-        p -= hyperparams["lr"] * p.grad() / torch::sqrt(s + eps);
+        p -= hp.lr * p.grad() / torch::sqrt(s + eps);
         p.grad().data().zero_();
     }
 }
@@ -142,7 +142,9 @@ int main() {
 
 
 	int64_t num_epochs = 5;
-	std::map<std::string, float> hyperparams = {{"lr", 0.1}};
+	OptimHyperParams hyperparams;
+	hyperparams.lr = 0.1;
+	hyperparams.eps = 1e-6;
 
 	std::vector<torch::Tensor> states = init_adagrad_states(t_data.size(1));
 
@@ -156,9 +158,9 @@ int main() {
     auto start = high_resolution_clock::now();
     std::vector<double> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -226,8 +228,6 @@ int main() {
 	start = high_resolution_clock::now();
 
 	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
-
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -27,9 +27,7 @@ std::vector<std::pair<torch::Tensor, torch::Tensor>>  init_adam_states( int64_t
 }
 
 void adam(std::vector<torch::Tensor>& params, std::vector<std::pair<torch::Tensor, torch::Tensor>>& states,
-		  std::map<std::string, float> hyperparams ) {
-
-    float beta1 = 0.9, beta2 = 0.999, eps = 1e-6;
+		  const OptimHyperParams& hp, int64_t& t) {
 
     for( int i = 0; i < params.size(); i++ ) { //p, (v, s) in zip(params, states):
     	auto p = params[i];
@@ -37,17 +35,29 @@ void adam(std::vector<torch::Tensor>& params, std::vector<std::pair<torch::Tenso
     	auto s = states[i].second;
 
     	torch::NoGradGuard no_grad;
-    		v = beta1 * v + (1 - beta1) * p.grad();
-            s = beta2 * s + (1 - beta2) * torch::square(p.grad());
+    		// in-place, so the state persists between steps
+    		v.mul_(hp.beta1).add_(p.grad(), 1 - hp.beta1);
+            s.mul_(hp.beta2).addcmul_(p.grad(), p.grad(), 1 - hp.beta2);
 
-            auto v_bias_corr = v / (1 - std::pow(beta1, hyperparams["t"]));
-            auto s_bias_corr = s / (1 - std::pow(beta2, hyperparams["t"]));
-            p -= hyperparams["lr"] * v_bias_corr / (torch::sqrt(s_bias_corr) + eps);
+            auto v_bias_corr = v / (1 - std::pow(hp.beta1, t));
+            auto s_bias_corr = s / (1 - std::pow(hp.beta2, t));
+            p -= hp.lr * v_bias_corr / (torch::sqrt(s_bias_corr) + hp.eps);
         p.grad().data().zero_();
     }
-    hyperparams["t"] += 1;
+    t += 1;
 }
 
+// many small tensors: the case where per-tensor optimizer overhead dominates
+torch::nn::Sequential small_tensor_mlp(int64_t layers, int64_t width) {
+	torch::nn::Sequential net;
+	for(int64_t i = 0; i < layers; i++) {
+		net->push_back(torch::nn::Linear(width, width));
+		net->push_back(torch::nn::LayerNorm(torch::nn::LayerNormOptions({width})));
+		net->push_back(torch::nn::ReLU());
+	}
+	net->push_back(torch::nn::Linear(width, 1));
+	return net;
+}
 
 int main() {
 
@@ -100,7 +110,10 @@ int main() {
 	auto t_data = torch::from_blob(datas.data(), {int(labels.size()), int(datas.size()/labels.size())}).clone();
 
 	int64_t num_epochs = 10;
-	std::map<std::string, float> hyperparams = {{"lr", 0.01}, {"t", 1}};
+	OptimHyperParams hyperparams;
+	hyperparams.lr = 0.01;
+	hyperparams.eps = 1e-6;
+	int64_t adam_t = 1;
 
 	std::vector<std::pair<torch::Tensor, torch::Tensor>> states = init_adam_states(t_data.size(1));
 
@@ -114,9 +127,9 @@ int main() {
     auto start = high_resolution_clock::now();
     std::vector<float> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -131,7 +144,7 @@ int main() {
 	        loss.backward();
 
 	        // Update parameters using their gradient
-	        adam(params, states, hyperparams);
+	        adam(params, states, hyperparams, adam_t);
 
 	        t_loss += loss.item<float>();
 	        b_cnt++;
@@ -179,8 +192,6 @@ int main() {
 	start = high_resolution_clock::now();
 
 	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
-
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -218,6 +229,52 @@ int main() {
     F->draw();
 	matplot::show();
 
+	// ------------------------------------------------------------------
+	// Fused Adam against torch::optim::Adam on a many-small-tensor model
+	// ------------------------------------------------------------------
+	torch::manual_seed(1000);
+	auto net_ref = small_tensor_mlp(64, 16);
+	auto net_fused = small_tensor_mlp(64, 16);
+	{
+		torch::NoGradGuard no_grad;
+		auto src = net_ref->parameters(), dst = net_fused->parameters();
+		for(size_t i = 0; i < src.size(); i++)
+			dst[i].copy_(src[i]);
+	}
+
+	OptimHyperParams adam_hp;
+	adam_hp.lr = 0.001;
+	auto ref_optimizer = torch::optim::Adam(net_ref->parameters(), torch::optim::AdamOptions(adam_hp.lr)
+								.betas(std::make_tuple(adam_hp.beta1, adam_hp.beta2)).eps(adam_hp.eps));
+	FusedOptimizer fused_optimizer(net_fused->parameters(), ScratchAlgorithm::Adam, adam_hp);
+	std::cout << "parameter tensors: " << net_ref->parameters().size() << '\n';
+
+	auto X = torch::randn({32, 16}), y = torch::randn({32, 1});
+	int64_t steps = 200;
+	double ref_ms = 0, fused_ms = 0;
+	for(int64_t i = 0; i < steps; i++) {
+		ref_optimizer.zero_grad();
+		torch::mse_loss(net_ref->forward(X), y).backward();
+		auto t0 = high_resolution_clock::now();
+		ref_optimizer.step();
+		ref_ms += duration_cast<microseconds>(high_resolution_clock::now() - t0).count() / 1e3;
+
+		fused_optimizer.zero_grad();
+		torch::mse_loss(net_fused->forward(X), y).backward();
+		t0 = high_resolution_clock::now();
+		fused_optimizer.step();
+		fused_ms += duration_cast<microseconds>(high_resolution_clock::now() - t0).count() / 1e3;
+	}
+
+	float max_diff = 0;
+	auto ref_params = net_ref->parameters(), fused_params = net_fused->parameters();
+	for(size_t i = 0; i < ref_params.size(); i++)
+		max_diff = std::max(max_diff, (ref_params[i] - fused_params[i]).abs().max().item<float>());
+
+	std::cout << "after " << steps << " steps, max |torch::optim - fused| = " << max_diff << '\n';
+	std::cout << "step time: torch::optim::Adam " << (ref_ms / steps) << " ms, fused Adam "
+			  << (fused_ms / steps) << " ms\n";
+
 	std::cout << "Done!\n";
 	return 0;
 }
@@ -20,6 +20,7 @@
 #include "../TempHelpFunctions.hpp" // range()
 #include "../fashion.h"
 #include "../utils.h"
+#include "../utils/lr_scheduler.h"
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -43,68 +44,13 @@ torch::nn::Sequential net_fn() {
     return net;
 }
 
-struct SquareRootScheduler {
-	float lr;
-	SquareRootScheduler(float l) {
-		lr = l;
-	}
-	SquareRootScheduler(){}
-
-	double get_lr(int64_t num_update) {
-		return lr * std::pow(num_update + 1.0, -0.5);
-	}
-};
-
-struct FactorScheduler {
-	float base_lr, stop_factor_lr, factor;
-	FactorScheduler(float f, float stop_factor_l, float base_l) {
-		factor = f;
-		stop_factor_lr = stop_factor_l;
-		base_lr = base_l;
-	}
-	FactorScheduler() {}
-
-	double get_lr(int64_t epoch) {
-		base_lr = std::max(stop_factor_lr, base_lr * factor);
-		return base_lr;
-	}
-};
-
-struct  CosineScheduler {
-	float base_lr, base_lr_orig, final_lr, warmup_begin_lr;
-	int64_t max_update, warmup_steps, max_steps;
-
-	CosineScheduler(int64_t max_upd, float base_l, float final_l,
-					int64_t warmup_stp=0, float warmup_begin_l=0.0) {
-		base_lr_orig = base_l;
-		base_lr = base_l;
-        max_update = max_upd;
-        final_lr = final_l;
-        warmup_steps = warmup_stp;
-        warmup_begin_lr = warmup_begin_l;
-        max_steps = max_upd - warmup_stp;
-	}
+using History = std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>>;
 
-    double get_warmup_lr(int64_t epoch) {
-        auto increase = (base_lr_orig - warmup_begin_lr)
-                       * static_cast<float>(max_steps - epoch) / static_cast<float>(warmup_steps);
-        return warmup_begin_lr + increase;
-    }
-
-    double get_lr( int64_t epoch ) {
-        if( epoch < warmup_steps )
-            return get_warmup_lr(epoch);
-        if( epoch <= max_update )
-            base_lr = final_lr + (base_lr_orig - final_lr) * (1 + std::cos(
-                M_PI * (epoch - warmup_steps) / max_steps)) / 2.0;
-        return base_lr;
-    }
-};
-
-
-template<typename Scheduler>
-std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>> train(
-		float lr, int64_t num_epochs, torch::Device device, bool lr_sh, Scheduler& SL) {
+// make_schedule(batches per epoch) returns the schedule, or nullptr for a constant learning rate.
+// per_batch: step the scheduler after every minibatch instead of once per epoch; epoch-level
+// schedules also get the epoch's training loss for metric-driven reduction.
+History train(float lr, int64_t num_epochs, torch::Device device,
+			  const std::function<LRSchedulePtr(int64_t)>& make_schedule, bool per_batch = false) {
 
 	auto net = net_fn();
 
@@ -118,6 +64,8 @@ std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::v
 	auto train_dataset = FASHION(data_path, FASHION::Mode::kTrain)
 			    			.map(torch::data::transforms::Stack<>());
 
+	int64_t batches_per_epoch = (train_dataset.size().value() + batch_size - 1) / batch_size;
+
 	auto train_loader = torch::data::make_data_loader<torch::data::samplers::RandomSampler>(
 									         std::move(train_dataset), batch_size);
 
@@ -127,6 +75,7 @@ std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::v
 	auto test_loader = torch::data::make_data_loader<torch::data::samplers::SequentialSampler>(
 						         std::move(test_dataset), batch_size);
 
+
 	// initialize_weights
 	for (auto& module : net->modules(false) ) { //modules(include_self=false))
 
@@ -141,6 +90,11 @@ std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::v
 	torch::optim::SGD optimizer = torch::optim::SGD(net->parameters(), lr);
 	auto loss = torch::nn::CrossEntropyLoss();
 
+	std::unique_ptr<LRScheduler> scheduler;
+	if( make_schedule )
+		scheduler = std::make_unique<LRScheduler>(optimizer, make_schedule(batches_per_epoch));
+
+	std::vector<double> lrs;
 	std::vector<double> train_loss;
 	std::vector<double> train_acc;
 	std::vector<double> test_acc;
@@ -168,6 +122,8 @@ std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::v
 	    	optimizer.zero_grad();
 	    	l.backward();
 	    	optimizer.step();
+	    	if( scheduler && per_batch )
+	    		scheduler->step();
 
 	    	num_train_samples += X.size(0);
 	    	num_batch++;
@@ -210,29 +166,25 @@ std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::v
 
 		std::cout << "Testset - Accuracy: " << test_accuracy << '\n';
 		xx.push_back((epoch + 1)*1.0);
+		// learning rate of this epoch (of its last batch for per-batch schedules)
+		lrs.push_back(scheduler ? scheduler->get_lr() : lr);
 
-		{
-			torch::AutoGradMode enable_grad(true);
-			if( lr_sh && epoch % 2 == 0 ) {
-				//Using custom defined scheduler
-				for(auto& param_group : optimizer.param_groups() ) {
-					param_group.options().set_lr(SL.get_lr(epoch));
-					std::cout << "New lr: " << param_group.options().get_lr() << "\n";
-				}
-			}
+		if( scheduler && ! per_batch ) {
+			scheduler->step(sample_mean_loss);
+			std::cout << "New lr: " << scheduler->get_lr() << "\n";
 		}
 	}
 
-	return std::make_tuple(train_loss, train_acc, test_acc, xx);
+	return std::make_tuple(train_loss, train_acc, test_acc, xx, lrs);
 }
 
-void plot_scheduler(std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>> dt,
-		int64_t num_epochs, std::vector<double> x, std::vector<double> y) {
+void plot_scheduler(History dt, int64_t num_epochs) {
 
 	std::vector<double> train_loss = std::get<0>(dt);
 	std::vector<double> train_acc = std::get<1>(dt);
 	std::vector<double> test_acc = std::get<2>(dt);
 	std::vector<double> xx = std::get<3>(dt);
+	std::vector<double> lrs = std::get<4>(dt);
 
 	double xL = 1.0;
 	if( num_epochs > 10 ) xL = 5.0;
@@ -244,7 +196,7 @@ void plot_scheduler(std::tuple<std::vector<double>, std::vector<double>, std::ve
 	F->position(0, 0);
 
 	subplot(1, 3, 0);
-	matplot::plot(x, y, "b")->line_width(2).display_name("scheduler");
+	matplot::plot(xx, lrs, "b")->line_width(2).display_name("scheduler");
 	matplot::xlabel("epoch");
 	matplot::ylabel("lr");
 	matplot::legend({});
@@ -284,56 +236,75 @@ int main() {
 	int64_t num_epochs = 50;
 	float lr = 0.9;
 
-	SquareRootScheduler nl;
-	std::tuple<std::vector<double>, std::vector<double>, std::vector<double>, std::vector<double>> dt =
-			train(lr, num_epochs, device, false, nl);
+	History dt = train(lr, num_epochs, device, nullptr);
 
 	// -------------------------------------
-	// SquareRootScheduler
-	SquareRootScheduler SL = SquareRootScheduler( lr );
-
-	std::vector<double> x, y;
-	for(auto& i : range(num_epochs)) {
-		x.push_back(i*1.0);
-		y.push_back(SL.get_lr(i)*1.0);
-	}
-
-	dt = train(lr, num_epochs, device, true, SL);
-	plot_scheduler(dt, num_epochs, x, y);
+	// Square root scheduler
+	dt = train(lr, num_epochs, device, [](int64_t) { return std::make_shared<InverseSqrtDecay>(); });
+	plot_scheduler(dt, num_epochs);
 
 	// -------------------------------------
-	// Factor Scheduler
+	// Factor scheduler: lr * 0.9^epoch, at least 0.01
 	lr = 0.3;
-	FactorScheduler FL = FactorScheduler(0.9, 1e-2, 2.0);
-	x.clear();
-	y.clear();
-	for(auto& i : range(num_epochs)) {
-		x.push_back(i*1.0);
-		y.push_back(FL.get_lr(i));
-	}
+	dt = train(lr, num_epochs, device, [lr](int64_t) { return std::make_shared<StepDecay>(1, 0.9, 1e-2 / lr); });
+	plot_scheduler(dt, num_epochs);
 
-	FL = FactorScheduler(0.9, 1e-2, 2.0);
-	dt = train(lr, num_epochs, device, true, FL);
+	// -------------------------------------
+	// Cosine scheduler with warmup: 5 warmup epochs, then cosine down to 0.01 over 15 epochs
+	lr = 0.9;
+	dt = train(lr, num_epochs, device, [lr](int64_t) {
+		return std::make_shared<SequentialSchedule>(std::vector<LRSchedulePtr>{
+					std::make_shared<LinearWarmup>(5), std::make_shared<CosineAnnealing>(15, 0.01 / lr)},
+					std::vector<int64_t>{5});
+	});
+	plot_scheduler(dt, num_epochs);
 
-	plot_scheduler(dt, num_epochs, x, y);
+	// -------------------------------------
+	// Cosine with restarts, reduced further when the training loss plateaus
+	dt = train(lr, num_epochs, device, [](int64_t) {
+		return std::make_shared<ChainedSchedule>(std::vector<LRSchedulePtr>{
+					std::make_shared<CosineWithRestarts>(10, 2, 0.01),
+					std::make_shared<ReduceOnPlateau>(ReduceOnPlateau::Mode::Min, 0.5, 3)});
+	});
+	plot_scheduler(dt, num_epochs);
 
 	// -------------------------------------
-	// Cosine Scheduler
+	// One-cycle, stepped per minibatch
+	dt = train(lr, num_epochs, device, [num_epochs](int64_t batches_per_epoch) {
+		return std::make_shared<OneCycle>(num_epochs * batches_per_epoch);
+	}, true);
+	plot_scheduler(dt, num_epochs);
 
-	lr = 0.9;
-	CosineScheduler CL = CosineScheduler(14, 0.9, 0.01, 5);
-	x.clear();
-	y.clear();
-	for(auto& i : range(num_epochs)) {
-		x.push_back(i*1.0);
-		y.push_back(CL.get_lr(i));
+	// -------------------------------------
+	// Checkpointing: a resumed scheduler continues with the same learning rates
+	{
+		std::vector<double> metrics = {1.0, 0.9, 0.9, 0.9, 0.9, 0.8, 0.8, 0.8, 0.8, 0.8};
+		auto make_schedule = []() -> LRSchedulePtr {
+			return std::make_shared<ChainedSchedule>(std::vector<LRSchedulePtr>{
+						std::make_shared<LinearWarmup>(3, 0.1),
+						std::make_shared<ReduceOnPlateau>(ReduceOnPlateau::Mode::Min, 0.5, 1)});
+		};
+		auto w = torch::zeros({1}, torch::requires_grad(true));
+
+		torch::optim::SGD opt_a(std::vector<torch::Tensor>{w}, 0.1);
+		LRScheduler sched_a(opt_a, make_schedule());
+		for(int64_t i = 0; i < 5; i++)
+			sched_a.step(metrics[i]);
+		torch::save(sched_a, "lr_scheduler.pt");
+
+		torch::optim::SGD opt_b(std::vector<torch::Tensor>{w}, 0.1);
+		LRScheduler sched_b(opt_b, make_schedule());
+		torch::load(sched_b, "lr_scheduler.pt");
+
+		bool same = true;
+		for(int64_t i = 5; i < static_cast<int64_t>(metrics.size()); i++) {
+			sched_a.step(metrics[i]);
+			sched_b.step(metrics[i]);
+			same = same && sched_a.get_lr() == sched_b.get_lr();
+		}
+		std::cout << "Resumed schedule matches: " << (same ? "true" : "false") << '\n';
 	}
 
-	CL = CosineScheduler(14, 0.9, 0.01, 5);
-	dt = train(lr, num_epochs, device, true, CL);
-
-	plot_scheduler(dt, num_epochs, x, y);
-
 	std::cout << "Done!\n";
 	return 0;
 }
@@ -31,9 +31,9 @@ std::pair<std::vector<float>, std::vector<float>> train_sgd(float lr, int64_t nu
     auto start = high_resolution_clock::now();
     std::vector<float> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -241,9 +241,9 @@ int main() {
 	start = high_resolution_clock::now();
 	std::vector<double> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
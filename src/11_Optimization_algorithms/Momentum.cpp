@@ -72,14 +72,14 @@ std::vector<torch::Tensor> init_momentum_states(int64_t feature_dim) {
 }
 
 void sgd_momentum(std::vector<torch::Tensor>& params, std::vector<torch::Tensor>& states,
-													 std::map<std::string, float> hyperparams) {
+													 const OptimHyperParams& hp) {
 
 	for( int i = 0; i < states.size(); i++ ) {
         auto p = params[i];
         auto v = states[i];
 		torch::NoGradGuard no_grad;
-            v = hyperparams["momentum"] * v + p.grad();
-            p -= hyperparams["lr"] * v;
+            v.mul_(hp.momentum).add_(p.grad());
+            p -= hp.lr * v;
         p.grad().data().zero_();
 	}
 }
@@ -87,7 +87,9 @@ void sgd_momentum(std::vector<torch::Tensor>& params, std::vector<torch::Tensor>
 void train_momentum_sgd(float lr, float momentum, int64_t num_epochs,
 									torch::Tensor t_data, torch::Tensor t_label, int64_t batch_size ) {
 
-	std::map<std::string, float> hyperparams = {{"momentum", momentum},{"lr", lr}};
+	OptimHyperParams hyperparams;
+	hyperparams.momentum = momentum;
+	hyperparams.lr = lr;
 
 	std::vector<torch::Tensor> states = init_momentum_states(t_data.size(1));
 
@@ -101,9 +103,9 @@ void train_momentum_sgd(float lr, float momentum, int64_t num_epochs,
 	auto start = high_resolution_clock::now();
 	std::vector<float> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -283,9 +285,9 @@ int main() {
 	auto start = high_resolution_clock::now();
 	std::vector<float> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -52,13 +52,13 @@ std::vector<torch::Tensor> init_rmsprop_states(int64_t feature_dim) {
 }
 
 void rmsprop(std::vector<torch::Tensor>& params, std::vector<torch::Tensor>& states,
-													 std::map<std::string, float> hyperparams) {
-	double gamma = hyperparams["gamma"], eps = 1e-6;
+													 const OptimHyperParams& hp) {
+	double gamma = hp.gamma, eps = hp.eps;
 
 	for( int i = 0; i < states.size(); i++ ) {
 		torch::NoGradGuard no_grad;
-		states[i] = gamma * states[i] + (1 - gamma) * torch::square(params[i].grad());
-        params[i] -= hyperparams["lr"] * params[i].grad() / torch::sqrt(states[i] + eps);
+		states[i].mul_(gamma).addcmul_(params[i].grad(), params[i].grad(), 1 - gamma);
+        params[i] -= hp.lr * params[i].grad() / torch::sqrt(states[i] + eps);
         params[i].grad().data().zero_();
 	}
 }
@@ -149,7 +149,10 @@ int main() {
 	auto t_data = torch::from_blob(datas.data(), {int(labels.size()), int(datas.size()/labels.size())}).clone();
 
 	int64_t num_epochs = 5;
-	std::map<std::string, float> hyperparams = {{"lr", 0.01}, {"gamma", 0.9}};
+	OptimHyperParams hyperparams;
+	hyperparams.lr = 0.01;
+	hyperparams.gamma = 0.9;
+	hyperparams.eps = 1e-6;
 
 	std::vector<torch::Tensor> states = init_rmsprop_states(t_data.size(1));
 
@@ -163,9 +166,9 @@ int main() {
     auto start = high_resolution_clock::now();
     std::vector<double> epochs, losses;
 
-	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
+	MinibatchLoader data_iter(t_data, t_label, batch_size);
 
+	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -229,8 +232,6 @@ int main() {
 	start = high_resolution_clock::now();
 
 	for( int64_t  epoch = 0; epoch < num_epochs; epoch++ ) {
-		std::list<std::pair<torch::Tensor, torch::Tensor>> data_iter = get_data_ch11(t_data, t_label, batch_size);
-
 		float t_loss = 0.0;
 		int64_t b_cnt = 0;
 		for (auto &batch : data_iter) {
@@ -16,6 +16,7 @@
 #include "../utils/transforms.hpp"              // transforms_Compose
 #include "../utils/datasets.hpp"                // datasets::ImageFolderClassesWithPaths
 #include "../utils/dataloader.hpp"              // DataLoader::ImageFolderClassesWithPaths
+#include "../utils/pruning.h"                   // iterative_prune
 
 
 #include <matplot/matplot.h>
@@ -264,6 +265,91 @@ int main() {
        	}
     }
 
+    // ---------------------------------
+    // int8 post-training quantization
+    // ---------------------------------
+    std::cout << "--------------- int8 PTQ --------------------\n";
+    net->to(torch::kCPU);
+    net->eval();
+    select_quantized_engine();
+
+    QuantizedResNet qnet(*net);
+    int num_calib_batches = 0;
+    while (dataloader(mini_batch)) {
+    	if( num_calib_batches++ < 4 )					// calibrate on a few training batches
+    		qnet.calibrate(std::get<0>(mini_batch));
+    }
+    qnet.convert();
+
+    auto report = compare_fp32_int8(
+    		[&net](const torch::Tensor& x) { return net->forward(x); },
+    		[&qnet](const torch::Tensor& x) { return qnet.forward(x); },
+    		[&](torch::Tensor& X, torch::Tensor& y) {
+    			if( ! valid_dataloader(mini_batch) ) return false;
+    			X = std::get<0>(mini_batch);
+    			y = std::get<1>(mini_batch);
+    			return true;
+    		});
+    report.print(std::cout);
+
+    // ---------------------------------
+    // structured channel pruning of the fp32 net
+    // ---------------------------------
+    std::cout << "--------------- pruning --------------------\n";
+    auto sample = torch::randn({1, 3, (long)img_size, (long)img_size});
+    auto cpu_latency = [&]() {
+    	net->eval();
+    	net->to(torch::kCPU);
+    	double ms = measure_latency_ms([&net](const torch::Tensor& x) { return net->forward(x); }, sample);
+    	net->to(device);
+    	return ms;
+    };
+
+    int64_t dense_params = count_parameters(*net);
+    double dense_ms = cpu_latency();
+
+    PruningSchedule schedule;
+    schedule.steps = 2;
+    schedule.ratio_per_step = 0.2;
+    schedule.score = ChannelScore::BNGamma;
+
+    iterative_prune([&net]() { return resnet_channel_groups(*net); },
+    	[&](int step) {
+    		// the parameters changed shape: fine-tune with a fresh optimizer
+    		torch::optim::SGD ft_optimizer(net->parameters(), torch::optim::SGDOptions(lr).weight_decay(0.001));
+    		net->train();
+    		float loss_sum = 0.0;
+    		while (dataloader(mini_batch)) {
+    			image = std::get<0>(mini_batch).to(device);
+    			label = std::get<1>(mini_batch).to(device);
+    			loss = criterion(torch::nn::functional::log_softmax(net->forward(image), 1), label);
+
+    			ft_optimizer.zero_grad();
+    			loss.backward();
+    			ft_optimizer.step();
+    			loss_sum += loss.item<float>();
+    		}
+    		std::cout << "fine-tune " << (step + 1) << ", avg_loss: " << (loss_sum/total_iter) << std::endl;
+    	}, schedule);
+
+    net->eval();
+    size_t pruned_match = 0, pruned_counter = 0;
+    {
+    	torch::NoGradGuard nograd;
+    	while (valid_dataloader(mini_batch)) {
+    		image = std::get<0>(mini_batch).to(device);
+    		label = std::get<1>(mini_batch).to(device);
+    		pruned_match += net->forward(image).argmax(1).eq(label).sum().item<int64_t>();
+    		pruned_counter += image.size(0);
+    	}
+    }
+
+    int64_t pruned_params = count_parameters(*net);
+    double pruned_ms = cpu_latency();
+    std::cout << "parameters: " << dense_params << " -> " << pruned_params
+    		  << ", CPU latency: " << dense_ms << " ms -> " << pruned_ms << " ms"
+    		  << ", pruned validation accuracy: " << ((float)pruned_match / (float)pruned_counter) << std::endl;
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
@@ -13,6 +13,7 @@
 #include <memory>
 #include <algorithm>
 #include <random>
+#include <chrono>
 
 #include "../utils/ch_13_util.h"
 
@@ -397,6 +398,29 @@ int main() {
 	}
 	matplot::show();
 
+	// -------------------------------------------
+	// Tiled prediction on a large image
+	// -------------------------------------------
+	// the image is cut into overlapping 320x480 tiles that are normalized in parallel, run in
+	// batches and blended back, so memory does not grow with the full image size
+	auto bigImg = CvMatToTensor("./data/catdog.jpg", {});
+	bigImg = torch::nn::functional::interpolate(bigImg.unsqueeze(0),
+				torch::nn::functional::InterpolateFuncOptions().scale_factor(std::vector<double>({4.0, 4.0}))
+				.mode(torch::kBilinear).align_corners(false)).squeeze(0);
+
+	TiledSegmentationOptions tile_opts;
+	tile_opts.tile_height = crop_size[1];
+	tile_opts.tile_width  = crop_size[0];
+	tile_opts.overlap     = 64;
+	tile_opts.batch_size  = 4;
+	tile_opts.num_threads = 4;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	auto seg = segment_tiled([&model, &device](const torch::Tensor& x) { return model->forward(x.to(device)); }, bigImg, tile_opts,
+						[&mean_, &std_](const torch::Tensor& t) { return NormalizeTensor(t.clone(), mean_, std_); });
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "tiled segmentation of " << bigImg.sizes() << " -> " << seg.sizes() << " in "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms\n";
 
 	std::cout << "Done!\n";
 	return 0;
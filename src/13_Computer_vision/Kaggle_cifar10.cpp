@@ -7,6 +7,7 @@
 #include "../utils/transforms.hpp"              // transforms_Compose
 #include "../utils/datasets.hpp"                // datasets::ImageFolderClassesWithPaths
 #include "../utils/dataloader.hpp"              // DataLoader::ImageFolderClassesWithPaths
+#include "../utils/ch_13_util.h"                // TestTimeAugmentation
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -342,6 +343,46 @@ int main() {
     	}
     }
 
+    // ---------------------------------
+    // test-time augmentation: accuracy / latency trade-off
+    // ---------------------------------
+    std::cout << "--------------- TTA benchmark --------------------\n";
+    net->eval();
+    std::vector<std::pair<std::string, TTAOptions>> tta_configs;
+    TTAOptions single;
+    single.hflip = false;
+    tta_configs.push_back({"single view", single});
+    TTAOptions flip;
+    tta_configs.push_back({"hflip", flip});
+    TTAOptions scales;
+    scales.scales = {0.9, 1.1};
+    tta_configs.push_back({"hflip + zoom 0.9/1.1", scales});
+    TTAOptions crops;
+    crops.crop_fraction = 0.875;
+    tta_configs.push_back({"hflip + five-crop", crops});
+
+    for(auto& cfg : tta_configs) {
+    	TestTimeAugmentation tta([&net](const torch::Tensor& x) { return net->forward(x); }, cfg.second);
+
+    	size_t total_match = 0, total_counter = 0;
+    	double elapsed_ms = 0.0;
+    	while (valid_dataloader(mini_batch)) {
+    		image = std::get<0>(mini_batch).to(device);
+    		label = std::get<1>(mini_batch).to(device);
+
+    		auto start = std::chrono::high_resolution_clock::now();
+    		output = tta.forward(image);
+    		auto end = std::chrono::high_resolution_clock::now();
+    		elapsed_ms += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+    		total_match += output.argmax(1).eq(label).sum().item<int64_t>();
+    		total_counter += image.size(0);
+    	}
+    	std::cout << cfg.first << " (" << tta.num_views() << " views): acc "
+    			  << ((float)total_match / (float)total_counter) << ", "
+    			  << (elapsed_ms / total_counter) << " ms/image\n";
+    }
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
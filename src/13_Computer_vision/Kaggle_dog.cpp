@@ -10,6 +10,7 @@
 #include <memory>
 #include <algorithm>
 #include <random>
+#include <fstream>
 
 #include "../utils/ch_13_util.h"
 
@@ -151,46 +152,89 @@ int main() {
 
     model->to(device);
 
+    // ---------------------------------
+    // frozen backbone feature cache
+    // ---------------------------------
+    // The backbone is frozen, so its features are computed once (the training images also mirrored)
+    // and written to an on-disk cache; the classifier head is then trained from the memory-mapped cache.
+    auto backbone = [&net](const torch::Tensor& x) {
+    	std::vector<torch::jit::IValue> input;
+    	input.push_back(x);
+    	return net.forward(input).toTensor();
+    };
+
+    std::string train_cache_path = "./data/kaggle_dog_tiny/train_features.bin";
+    std::string valid_cache_path = "./data/kaggle_dog_tiny/valid_features.bin";
+
+    // the caches are rebuilt when the backbone, the views, the image size or the datasets change
+    int64_t backbone_params = 0;
+    for(const auto& p : net.parameters())
+    	backbone_params += p.numel();
+    std::string cache_source = mdlf + ";params=" + std::to_string(backbone_params) + ";size=" + std::to_string(img_size);
+    uint64_t train_key = FeatureCache::make_key(cache_source + ";views=identity,hflip;samples=" + std::to_string(dataset.size()));
+    uint64_t valid_key = FeatureCache::make_key(cache_source + ";views=identity;samples=" + std::to_string(valid_dataset.size()));
+
+    if( FeatureCache::is_current(train_cache_path, train_key) && FeatureCache::is_current(valid_cache_path, valid_key) ) {
+    	std::cout << "using cached features " << train_cache_path << " and " << valid_cache_path << '\n';
+    } else {
+    	net.eval();
+    	auto start = std::chrono::high_resolution_clock::now();
+
+    	FeatureCache::build(train_cache_path, backbone,
+    			[&](torch::Tensor& X, torch::Tensor& y) {
+    				if( ! dataloader(mini_batch) ) return false;
+    				X = std::get<0>(mini_batch).to(device);
+    				y = std::get<1>(mini_batch);
+    				return true;
+    			},
+    			{[](const torch::Tensor& x) { return x; },
+    			 [](const torch::Tensor& x) { return torch::flip(x, {3}); }},
+    			train_key);
+
+    	FeatureCache::build(valid_cache_path, backbone,
+    			[&](torch::Tensor& X, torch::Tensor& y) {
+    				if( ! valid_dataloader(mini_batch) ) return false;
+    				X = std::get<0>(mini_batch).to(device);
+    				y = std::get<1>(mini_batch);
+    				return true;
+    			}, {}, valid_key);
+
+    	auto end = std::chrono::high_resolution_clock::now();
+    	std::cout << "feature cache built in "
+    			  << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << " s\n";
+    }
+
+    FeatureCache train_cache(train_cache_path), valid_cache(valid_cache_path);
+    std::cout << "cached features: " << train_cache.size() << " x " << train_cache.num_views()
+    		  << " views x " << train_cache.feature_dim() << '\n';
+
     size_t epoch;
     size_t total_iter;
     size_t start_epoch, total_epoch;
     start_epoch = 1;
-    total_iter = dataloader.get_count_max();
+    total_iter = (train_cache.size() + batch_size - 1) / batch_size;
     total_epoch = 30;
-    bool first = true;
     std::vector<float> train_loss_ave;
     std::vector<float> train_epochs;
     std::vector<float> valid_loss_ave;
 
     for (epoch = start_epoch; epoch <= total_epoch; epoch++) {
-       	model->train();
+       	output_new->train();
        	torch::AutoGradMode enable_grad(true);
 
        	std::cout << "--------------- Training --------------------\n";
-       	first = true;
        	float loss_sum = 0.0;
-       	size_t total_match = 0, total_counter = 0;
-       	torch::Tensor responses;
-       	while (dataloader(mini_batch)) {
-
-       		image = std::get<0>(mini_batch).to(device);
-       		label = std::get<1>(mini_batch).to(device);
-       		size_t mini_batch_size = image.size(0);
-
-       		if( first && vobose ) {
-       			for(size_t i = 0; i < label.size(0); i++)
-       				std::cout << label[i].item<int64_t>() << " ";
-       			std::cout << "\n";
-       			first = false;
-       		}
+       	auto perm = torch::randperm(train_cache.size(), torch::kLong);
 
-       		image = std::get<0>(mini_batch).to(device);
-       		label = std::get<1>(mini_batch).to(device);
-       		output = model->forward(image);
+       	for(int64_t i = 0; i < train_cache.size(); i += batch_size) {
+       		auto idx = perm.narrow(0, i, std::min<int64_t>(batch_size, train_cache.size() - i));
+       		auto data = train_cache.batch(idx);
+       		auto feats = data.first.to(device);
+       		label = data.second.to(device);
 
+       		output = output_new->forward(feats);
        		auto out = torch::nn::functional::log_softmax(output, 1);
-       		//std::cout << output.sizes() << "\n" << out.sizes() << std::endl;
-       		loss = criterion(out, label); //torch::mse_loss(out, label)
+       		loss = criterion(out, label);
 
        		optimizer.zero_grad();
        		loss.backward();
@@ -210,33 +254,22 @@ int main() {
        	if( valid ) {
        		std::cout << "--------------- validation --------------------\n";
 
-       		model->eval();
+       		output_new->eval();
        		torch::NoGradGuard nograd;
 
        		size_t iteration = 0;
        		float total_loss = 0.0;
-       		total_match = 0;
-       		total_counter = 0;
-       		torch::Tensor responses;
-       		first = true;
-       		while (valid_dataloader(mini_batch)){
-
-       			image = std::get<0>(mini_batch).to(device);
-       			label = std::get<1>(mini_batch).to(device);
-       			size_t mini_batch_size = image.size(0);
-
-       			if( first && vobose ) {
-       				for(size_t i = 0; i < label.size(0); i++)
-       					std::cout << label[i].item<int64_t>() << " ";
-       				std::cout << "\n";
-       				first = false;
-       			}
-
-       			// evaluate_loss
-       			output = model->forward(image);
+       		size_t total_match = 0;
+       		for(int64_t i = 0; i < valid_cache.size(); i += batch_size) {
+       			auto idx = torch::arange(i, std::min<int64_t>(i + batch_size, valid_cache.size()), torch::kLong);
+       			auto data = valid_cache.batch(idx, false);
+       			label = data.second.to(device);
+
+       			output = output_new->forward(data.first.to(device));
        			auto out = torch::nn::functional::log_softmax(output, 1);
        			loss = criterion(out, label);
 
+       			total_match += output.argmax(1).eq(label).sum().item<int64_t>();
        			total_loss += loss.item<float>();
        			iteration++;
        		}
@@ -247,7 +280,8 @@ int main() {
        		// Calculate Average Loss
        		float ave_loss = total_loss / iteration;
        		valid_loss_ave.push_back(ave_loss);
-       		std::cout << "Valid loss: " << ave_loss << "\n\n";
+       		std::cout << "Valid loss: " << ave_loss << ", acc: "
+       				  << ((float)total_match / valid_cache.size()) << "\n\n";
        	}
     }
 
@@ -8,6 +8,7 @@
 #include <torch/torch.h>
 #include <utility>
 #include <tuple>
+#include <chrono>
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -80,6 +81,29 @@ class VGGNetImpl : public torch::nn::Module {
         return tensors;
     }
 
+    // Content and style features in a single pass; layers past the deepest selected one are skipped.
+    std::pair<std::vector<torch::Tensor>, std::vector<torch::Tensor>> extract(torch::Tensor x) {
+        std::vector<torch::Tensor> contents, styles;
+
+        size_t last = 0;
+        for(auto i : content_layers_idxs_) last = std::max(last, i);
+        for(auto i : style_layers_idxs_)   last = std::max(last, i);
+
+        size_t layer_id = 0;
+        for (auto m : *layers) {
+            if( layer_id > last ) break;
+            x = m.forward<>(x);
+
+            if( std::find(content_layers_idxs_.begin(), content_layers_idxs_.end(), layer_id) != content_layers_idxs_.end() )
+            	contents.push_back(x);
+            if( std::find(style_layers_idxs_.begin(), style_layers_idxs_.end(), layer_id) != style_layers_idxs_.end() )
+            	styles.push_back(x);
+
+            ++layer_id;
+        }
+        return std::make_pair(contents, styles);
+    }
+
     void set_content_layer_idxs(const std::vector<size_t>& idxs) { content_layers_idxs_ = idxs; }
     std::vector<size_t> get_content_layer_idxs() const { return content_layers_idxs_; }
     void set_style_layer_idxs(const std::vector<size_t>& idxs) { style_layers_idxs_ = idxs; }
@@ -157,24 +181,6 @@ torch::Tensor postprocess(torch::Tensor img, torch::Device device,
     return imgT.clone();
 }
 
-std::pair<std::vector<torch::Tensor>, std::vector<torch::Tensor>> extract_features(
-										VGGNet& net, torch::Tensor& x) {
-	std::vector<torch::Tensor> contents = net->forward(x, false);
-	std::vector<torch::Tensor> styles   = net->forward(x, true);
-
-    return std::make_pair(contents, styles);
-}
-
-std::pair<torch::Tensor, std::vector<torch::Tensor>> get_contents(VGGNet& net, torch::Tensor& content_X) {
-    auto contents_Y = extract_features(net, content_X).first;
-    return std::make_pair(content_X, contents_Y);
-}
-
-std::pair<torch::Tensor, std::vector<torch::Tensor>> get_styles(VGGNet& net, torch::Tensor& style_X) {
-    auto styles_Y = extract_features(net, style_X).second;
-    return std::make_pair(style_X, styles_Y);
-}
-
 // --------------------------------
 // Defining the Loss Function
 // --------------------------------
@@ -185,14 +191,16 @@ torch::Tensor content_loss(torch::Tensor Y_hat, torch::Tensor Y) {
     return torch::square(Y_hat - Y.detach()).mean();
 }
 
+// X: (B, C, H, W) ===> (B, C, C)
 torch::Tensor gram(torch::Tensor X) {
-    int64_t num_channels = X.sizes()[1];
-    int64_t n = static_cast<int64_t>(X.numel() * 1.0 / X.sizes()[1]);
+    int64_t batch = X.size(0), num_channels = X.size(1);
+    int64_t n = X.size(2) * X.size(3);
 
-    X = X.reshape({num_channels, n});
-    return torch::matmul(X, X.t()) / (num_channels * n);
+    X = X.reshape({batch, num_channels, n});
+    return torch::bmm(X, X.transpose(1, 2)) / (num_channels * n);
 }
 
+// gram_Y (1, C, C) is broadcast over the batch of synthesized images
 torch::Tensor style_loss(torch::Tensor Y_hat, torch::Tensor gram_Y) {
     return torch::square(gram(Y_hat) - gram_Y.detach()).mean();
 }
@@ -206,57 +214,82 @@ torch::Tensor tv_loss(torch::Tensor Y_hat) {
 }
 
 // --------------------------
-// Loss Function
+// Style transfer engine
 // --------------------------
+// Stylizes a batch of equally sized content images against one style image. The style Gram
+// matrices and the content targets are computed once; every step runs a single pass through
+// the VGG layers for the whole batch. Losses stay on the device and are only copied to the
+// host every `report_every` steps.
+class StyleTransferEngine {
+public:
+	double content_weight = 1, style_weight = 1e4, tv_weight = 10;
 
-std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>, torch::Tensor, torch::Tensor>
-	compute_loss(torch::Tensor& X, std::vector<torch::Tensor>  contents_Y_hat,
-		std::vector<torch::Tensor> styles_Y_hat, std::vector<torch::Tensor> contents_Y,
-		std::vector<torch::Tensor>  styles_Y_gram) {
-
-	int64_t content_weight = 1, style_weight = 1e4, tv_weight = 10;
-	std::vector<torch::Tensor> contents_l, styles_l;
-
-    // Calculate the content, style, and total variance losses respectively
-    //contents_l = [content_loss(Y_hat, Y) * content_weight for Y_hat, Y in zip(
-    //    contents_Y_hat, contents_Y)]
-
-	for(int i = 0; i < contents_Y_hat.size(); i++)
-		contents_l.push_back(content_loss(contents_Y_hat[i], contents_Y[i]) * content_weight);
-
-    //styles_l = [style_loss(Y_hat, Y) * style_weight for Y_hat, Y in zip(
-    //    styles_Y_hat, styles_Y_gram)]
-
-	for(int i = 0; i < styles_Y_hat.size(); i++)
-		styles_l.push_back(style_loss(styles_Y_hat[i], styles_Y_gram[i]) * style_weight);
-
-    torch::Tensor tv_l = tv_loss(X) * tv_weight;
-    // Add up all the losses
-    torch::Tensor l = tv_l.clone();
-
-    //l = sum(styles_l + contents_l + [tv_l])
-    for(auto& t : contents_l)
-    	l = l + torch::sum(t);
-
-    for(auto& t : styles_l)
-        l = l + torch::sum(t);
+	StyleTransferEngine(VGGNet& net, torch::Tensor style_img, torch::Device device) : net_(net), device_(device) {
+		net_->to(device_);
+		net_->eval();
+		for(auto& p : net_->parameters())
+			p.requires_grad_(false);
 
-    return std::make_tuple(contents_l, styles_l, tv_l, l);
-}
+		torch::NoGradGuard no_grad;
+		for(auto& Y : net_->extract(style_img.to(device_)).second)
+			styles_Y_gram_.push_back(gram(Y));
+	}
 
-class SynthesizedImage : public torch::nn::Module {
-public:
-	torch::Tensor weight;
-	SynthesizedImage(c10::IntArrayRef img_shape) {
-        weight = torch::rand(img_shape);
-        register_parameter("weight", weight, true); // To register a parameter (or tensor which requires gradients) to a module
+	// contents: (B, 3, H, W) preprocessed content images; returns the (B, 3, H, W) synthesized images
+	torch::Tensor stylize(torch::Tensor contents, int64_t num_epochs, double lr, int64_t report_every = 10) {
+		contents = contents.to(device_);
+		std::vector<torch::Tensor> contents_Y;
+		{
+			torch::NoGradGuard no_grad;
+			contents_Y = net_->extract(contents).first;
+		}
+
+		torch::Tensor X = contents.clone().requires_grad_(true);
+		torch::optim::Adam trainer(std::vector<torch::Tensor>{X}, torch::optim::AdamOptions(lr));
+
+		history.clear();
+		std::vector<torch::Tensor> reported;
+		for( int64_t epoch = 1; epoch <= num_epochs; epoch++ ) {
+			trainer.zero_grad();
+			auto features = net_->extract(X);
+
+			torch::Tensor c_l = torch::zeros({}, X.options().requires_grad(false));
+			for(size_t i = 0; i < contents_Y.size(); i++)
+				c_l = c_l + content_loss(features.first[i], contents_Y[i]) * content_weight;
+
+			torch::Tensor s_l = torch::zeros({}, X.options().requires_grad(false));
+			for(size_t i = 0; i < styles_Y_gram_.size(); i++)
+				s_l = s_l + style_loss(features.second[i], styles_Y_gram_[i]) * style_weight;
+
+			torch::Tensor tv_l = tv_loss(X) * tv_weight;
+			torch::Tensor l = c_l + s_l + tv_l;
+			l.backward();
+			trainer.step();
+
+			if( epoch % report_every == 0 ) {
+				reported.push_back(torch::stack({torch::full({}, static_cast<double>(epoch), X.options()),
+												c_l.detach(), s_l.detach(), tv_l.detach()}));
+				// one host copy per report instead of one .item() per loss
+				auto row = reported.back().to(torch::kCPU);
+				std::cout << "epoch " << epoch << ", content_loss: " << row[1].item<float>()
+						  << ", style_loss: " << row[2].item<float>()
+						  << ", tv_loss: " << row[3].item<float>() << '\n';
+			}
+		}
+		if( ! reported.empty() )
+			history = torch::stack(reported).to(torch::kCPU);
+
+		return X.detach();
 	}
 
-    torch::Tensor forward() {
-        return weight;
-    }
-};
+	// (num_reports, 4) rows of (epoch, content loss, style loss, tv loss) from the last stylize() call
+	torch::Tensor history;
 
+private:
+	VGGNet& net_;
+	torch::Device device_;
+	std::vector<torch::Tensor> styles_Y_gram_;
+};
 
 int main() {
 
@@ -307,66 +340,35 @@ int main() {
 	// Model
 	VGGNet vgg19(config, content_layers, style_layers, false, vgg19_layers_scriptmodule_path);
 
-	auto content_img = preprocess(cimg, rgb_mean, rgb_std);
+	// the content images are stylized together as one batch
+	std::vector<std::string> content_files = {"./data/rainier.jpg", "./data/dog.jpg",
+											  "./data/giraffe.jpg", "./data/catdog.jpg"};
+	std::vector<torch::Tensor> content_imgs;
+	for(auto& file : content_files)
+		content_imgs.push_back(preprocess(CvMatToTensor(file, image_size), rgb_mean, rgb_std));
+	auto content_batch = torch::cat(content_imgs, 0);
 	auto style_img   = preprocess(simg, rgb_mean, rgb_std);
 
-	// auto t = torch::randn({3, 450, 300}).to(torch::kFloat32);
-	// std::cout << torch::sum(t) << '\n';
-
-	std::pair<torch::Tensor, std::vector<torch::Tensor>> cnt = get_contents(vgg19, content_img);
-	torch::Tensor contents_X = cnt.first;
-	std::vector<torch::Tensor> contents_Y = cnt.second;
-	std::vector<torch::Tensor> styles_Y = get_styles(vgg19, style_img).second;
-
-	// get_inits
-	SynthesizedImage gen_img(contents_X.sizes());
-
-	gen_img.weight.data().copy_(contents_X.data());
-
-	std::cout << gen_img.weight.sizes() << '\n';
-
-	torch::optim::Adam trainer(gen_img.parameters(), torch::optim::AdamOptions(0.3));
-
-	//styles_Y_gram = [gram(Y) for Y in styles_Y]
-	std::vector<torch::Tensor> styles_Y_gram;
-	for(auto& Y : styles_Y)
-		styles_Y_gram.push_back(gram(Y));
-
-	torch::Tensor X = gen_img.forward();
-	// scheduler = torch::optim::LRScheduler(trainer, lr_decay_epoch, 0.8)
+	StyleTransferEngine engine(vgg19, style_img, device);
 
 	// Training
 	int64_t num_epoches = 200;
 
-	std::vector<double> nepoch, c_loss, s_loss, tv_loss;
+	auto start = std::chrono::high_resolution_clock::now();
+	torch::Tensor X = engine.stylize(content_batch, num_epoches, 0.3, 10);
+	auto end = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	std::cout << content_files.size() << " images stylized in " << seconds << " s, "
+			  << (content_files.size() * 3600.0 / seconds) << " images/hour\n";
 
-	for( int64_t epoch = 1; epoch <= num_epoches; epoch++ ){
-        trainer.zero_grad();
-        auto features = extract_features(vgg19, X);
-        auto contents_Y_hat = features.first;
-		auto styles_Y_hat   = features.second;
-		auto losses = compute_loss(X, contents_Y_hat, styles_Y_hat, contents_Y, styles_Y_gram);
-        auto contents_l = std::get<0>(losses);
-        auto styles_l   = std::get<1>(losses);
-        auto tv_l = std::get<2>(losses);
-        auto l    = std::get<3>(losses);
-        l.backward();
-        trainer.step();
-        //scheduler.step()
-        if(epoch % 10 == 0 ) {
-        	std::cout << "content_loss: " << torch::sum(contents_l[0]).data().item<float>()
-					  << ", " << "style_loss: " << torch::sum(styles_l[0]).data().item<float>()
-        			  << ", " << "tv_loss: " << tv_l.data().item<float>() << '\n';
-
-        	nepoch.push_back(epoch*1.0);
-        	c_loss.push_back(torch::sum(contents_l[0]).data().item<float>());
-        	s_loss.push_back(torch::sum(styles_l[0]).data().item<float>());
-        	tv_loss.push_back(tv_l.data().item<float>());
-        }
+	std::vector<double> nepoch, c_loss, s_loss, tv_loss;
+	for(int64_t i = 0; i < engine.history.size(0); i++) {
+		nepoch.push_back(engine.history[i][0].item<double>());
+		c_loss.push_back(engine.history[i][1].item<double>());
+		s_loss.push_back(engine.history[i][2].item<double>());
+		tv_loss.push_back(engine.history[i][3].item<double>());
 	}
 
-	//auto X = preprocess(cimg, rgb_mean, rgb_std).to(device);
-
 	auto gimg = postprocess(X, device, rgb_mean, rgb_std);
 	std::cout << "gimg: " << gimg.sizes() << '\n';
 
@@ -5,8 +5,7 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
-#include <torchvision/vision.h>
-#include <torchvision/ops/roi_pool.h>
+#include "roi_ops.h"
 
 int main() {
 
@@ -35,11 +34,32 @@ int main() {
 	 */
 	// torchvision.ops.roi_pool(X, rois, output_size=(2, 2), spatial_scale=0.1)
 
-	std::tuple<at::Tensor, at::Tensor> rlt = vision::ops::roi_pool(X, rois, 0.1, 2, 2);
-
-	std::cout << "torchvision.ops.roi_pool():\n"
-		      << std::get<0>(rlt) << '\n';
-			  //<< std::get<1>(rlt) << '\n';
+	RoIPool roi_pool_layer(2, 2, 0.1);
+	std::cout << "RoIPool:\n" << roi_pool_layer->forward(X, rois) << '\n';
+
+	// RoIAlign samples the feature map bilinearly instead of snapping the regions to the grid
+	RoIAlign roi_align_layer(2, 2, 0.1, 2, true);
+	std::cout << "RoIAlign:\n" << roi_align_layer->forward(X, rois) << '\n';
+
+	// both ops are differentiable with respect to the feature map
+	auto Xg = X.clone().requires_grad_(true);
+	roi_align_layer->forward(Xg, rois).sum().backward();
+	std::cout << "RoIAlign grad:\n" << Xg.grad() << '\n';
+
+	// many RoIs over a batch, the usual Fast R-CNN setting
+	int64_t num_rois = 2000;
+	auto features = torch::randn({4, 256, 50, 50});
+	auto batch_idx = torch::randint(0, 4, {num_rois, 1}).to(torch::kFloat32);
+	auto xy = torch::rand({num_rois, 2}) * 600;
+	auto wh = torch::rand({num_rois, 2}) * 200 + 16;
+	auto many_rois = torch::cat({batch_idx, xy, xy + wh}, 1);
+
+	RoIAlign head_align(7, 7, 1.0 / 16, 2, true);
+	auto start = std::chrono::high_resolution_clock::now();
+	auto pooled = head_align->forward(features, many_rois);
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "RoIAlign over " << num_rois << " RoIs: " << pooled.sizes() << " in "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms\n";
 
 	std::cout << "Done!\n";
 }
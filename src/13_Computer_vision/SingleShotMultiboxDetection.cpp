@@ -90,16 +90,17 @@ std::vector<torch::nn::Sequential> get_blk(int i) {
     return blk;
 }
 
-std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> blk_forward(
-		torch::Tensor X,  std::vector<torch::nn::Sequential> blk, std::vector<float> sizes, std::vector<float> ratios,
-		torch::nn::Sequential cls_predictor, torch::nn::Sequential bbox_predictor) {
+// Anchors are not produced here any more: they only depend on the feature map shape, so
+// TinySSD asks its AnchorGenerator for all scales at once and reuses them across steps.
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> blk_forward(
+		torch::Tensor X,  std::vector<torch::nn::Sequential>& blk,
+		torch::nn::Sequential& cls_predictor, torch::nn::Sequential& bbox_predictor) {
 
     for(auto& b : blk)
     	X = b->forward(X);
-    torch::Tensor anchors = multibox_prior(X, sizes, ratios);
     torch::Tensor cls_preds = cls_predictor->forward(X);
 	torch::Tensor bbox_preds = bbox_predictor->forward(X);
-    return std::make_tuple(X, anchors, cls_preds, bbox_preds);
+    return std::make_tuple(X, cls_preds, bbox_preds);
 }
 
 
@@ -108,11 +109,13 @@ struct TinySSDImpl : public torch::nn::Module {
 	std::vector<std::vector<float>> sizes, ratios;
 	std::vector<std::vector<torch::nn::Sequential>> blk;
 	std::vector<torch::nn::Sequential> cls, bbox;
+	AnchorGenerator anchor_generator;
 	TinySSDImpl( int64_t num_classes, int64_t num_anchors,
 			std::vector<std::vector<float>> sizes, std::vector<std::vector<float>> ratios ) {
         this->num_classes = num_classes;
         this->sizes = sizes;
         this->ratios = ratios;
+        anchor_generator = AnchorGenerator(sizes, ratios);
         std::vector<int64_t> idx_to_in_channels = {64, 128, 128, 128, 128};
         for(int i = 0; i < 5; i++) {
             // Equivalent to the assignment statement `self.blk_i = get_blk(i)`
@@ -140,13 +143,15 @@ struct TinySSDImpl : public torch::nn::Module {
 	}
 
     std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> forward(torch::Tensor X) {
-        std::vector<torch::Tensor> anchors(5), cls_preds(5), bbox_preds(5);
+        std::vector<torch::Tensor> feature_maps(5), cls_preds(5), bbox_preds(5);
         for(int i = 0; i <5; i++) {
             // Here `getattr(self, 'blk_%d' % i)` accesses `self.blk_i`
-            std::tie(X, anchors[i], cls_preds[i], bbox_preds[i]) = blk_forward(
-                X, blk[i], sizes[i], ratios[i], cls[i], bbox[i]);
+            std::tie(X, cls_preds[i], bbox_preds[i]) = blk_forward(
+                X, blk[i], cls[i], bbox[i]);
+            feature_maps[i] = X;
         }
-		torch::Tensor anchor = torch::cat(torch::TensorList(anchors), 1);
+        // cached per (H, W, device, dtype): only the first step of a given input size builds anchors
+		torch::Tensor anchor = anchor_generator.generate(feature_maps);
 		torch::Tensor cls_pred = concat_preds(cls_preds);
         cls_pred = cls_pred.reshape({cls_pred.sizes()[0], -1, num_classes + 1});
 		torch::Tensor bbox_pred = concat_preds(bbox_preds);
@@ -272,6 +277,14 @@ int main() {
 	std::cout << "data: " << data.sizes() << std::endl;
 	std::cout << "a: " << a.sizes() << std::endl;
 */
+	auto val_targets = load_bananas_img_data(data_dir, false, imgSize);
+	auto val_set = BananasDataset(val_targets, imgSize).map(torch::data::transforms::Stack<>());
+	auto val_loader = torch::data::make_data_loader<torch::data::samplers::SequentialSampler>(
+													std::move(val_set), batch_size);
+
+	// the banana dataset has a single class, AP at IoU 0.5 and averaged over 0.5:0.95
+	MeanAveragePrecision evaluator(1);
+
 	torch::Tensor bbox_labels, bbox_masks, cls_labels;
 	std::vector<float> cls_errs, bbox_maes, epoch_num;
 
@@ -323,7 +336,23 @@ int main() {
 	    float cls_err  = 1 - tlt_cls_error / tlt_cls_num;
 		float bbox_mae =  tlt_bbox_mae / tlt_bbox_num;
 	    //animator.add(epoch + 1, (cls_err, bbox_mae))
-		std::cout << "Epoch: " << epoch << ", class err: " << cls_err << ", bbox mae: " << bbox_mae << '\n';
+
+	    net->eval();
+	    {
+	    	torch::NoGradGuard no_grad;
+	    	evaluator.reset();
+	    	for(auto& batch : *val_loader ) {
+	    		torch::Tensor vanchors, vcls_preds, vbbox_preds;
+	    		std::tie(vanchors, vcls_preds, vbbox_preds) = net->forward(batch.data.to(device));
+	    		torch::Tensor vcls_probs = torch::nn::functional::softmax(vcls_preds, 2).permute({0, 2, 1});
+	    		torch::Tensor detections = multibox_detection_batched(vcls_probs, vbbox_preds, vanchors, 0.5, 0.01).first;
+	    		evaluator.update(detections, batch.target);
+	    	}
+	    }
+	    DetectionEvalResult eval = evaluator.compute();
+
+		std::cout << "Epoch: " << epoch << ", class err: " << cls_err << ", bbox mae: " << bbox_mae
+				  << ", val mAP@0.5: " << eval.map50 << ", val mAP@[.5:.95]: " << eval.map << '\n';
 		cls_errs.push_back(cls_err);
 		bbox_maes.push_back(bbox_mae);
 		epoch_num.push_back(epoch*1.0);
@@ -339,9 +368,10 @@ int main() {
 	std::tie(anchors, cls_preds, bbox_preds)= net->forward(imgT.to(device));
 
 	torch::Tensor cls_probs = torch::nn::functional::softmax(cls_preds, 2).permute({0, 2, 1});
-	torch::Tensor output = multibox_detection(cls_probs, bbox_preds, anchors, 0.95, 0.1);
-	output.squeeze_();
-	auto prd = output.cpu();
+	torch::Tensor output, num_detections;
+	std::tie(output, num_detections) = multibox_detection_batched(cls_probs, bbox_preds, anchors, 0.95, 0.1);
+	// only the first num_detections rows of the padded (1, K, 6) output are valid
+	auto prd = output[0].narrow(0, 0, num_detections[0].item<int64_t>()).cpu();
 
 	std::cout << prd.sizes() << '\n';
 	std::cout << prd.index({Slice(0, 20), Slice()}) << '\n';
@@ -150,3 +150,143 @@ WideResNet101_2Impl::WideResNet101_2Impl(
     bool zero_init_residual)
     : ResNetImpl({3, 4, 23, 3}, num_classes, zero_init_residual, 1, 64 * 2) {}
 
+
+void QuantizedResNet::init(
+    const torch::nn::Conv2d& conv1,
+    const torch::nn::BatchNorm2d& bn1,
+    const std::vector<torch::nn::Sequential>& layers,
+    const torch::nn::Linear& fc) {
+  stem_.emplace_back(conv1, bn1, true);
+
+  for (const auto& layer : layers) {
+    for (const auto& module : layer->children()) {
+      QuantizedBlock qb;
+      torch::nn::Sequential downsample{nullptr};
+
+      if (auto* B = dynamic_cast<BasicBlock*>(module.get())) {
+        qb.convs.emplace_back(B->conv1, B->bn1, true);
+        qb.convs.emplace_back(B->conv2, B->bn2, false);
+        downsample = B->downsample;
+      } else if (auto* B = dynamic_cast<Bottleneck*>(module.get())) {
+        qb.convs.emplace_back(B->conv1, B->bn1, true);
+        qb.convs.emplace_back(B->conv2, B->bn2, true);
+        qb.convs.emplace_back(B->conv3, B->bn3, false);
+        downsample = B->downsample;
+      } else {
+        TORCH_CHECK(false, "QuantizedResNet: unsupported block ", module->name());
+      }
+
+      // downsample is conv1x1 followed by BatchNorm2d
+      if (!downsample.is_empty())
+        qb.downsample.emplace_back(
+            torch::nn::Conv2d(std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(downsample->ptr(0))),
+            torch::nn::BatchNorm2d(std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(downsample->ptr(1))),
+            false);
+
+      blocks_.push_back(std::move(qb));
+    }
+  }
+
+  fc_.emplace_back(fc, false);
+}
+
+torch::Tensor QuantizedResNet::forward(torch::Tensor x) {
+  torch::NoGradGuard no_grad;
+
+  x = quant_.forward(x);
+  x = stem_[0].forward(x);
+  x = torch::max_pool2d(x, 3, 2, 1);
+
+  for (auto& block : blocks_) {
+    auto identity = block.downsample.empty() ? x : block.downsample[0].forward(x);
+    auto out = x;
+    for (auto& conv : block.convs)
+      out = conv.forward(out);
+    x = block.add.forward(out, identity);
+  }
+
+  x = torch::adaptive_avg_pool2d(x, {1, 1});
+  x = x.reshape({x.size(0), -1});
+  x = fc_[0].forward(x);
+
+  return x.is_quantized() ? x.dequantize() : x;
+}
+
+void QuantizedResNet::calibrate(const torch::Tensor& x) {
+  forward(x);
+}
+
+void QuantizedResNet::convert() {
+  quant_.convert();
+  stem_[0].convert();
+  for (auto& block : blocks_) {
+    for (auto& conv : block.convs)
+      conv.convert();
+    for (auto& conv : block.downsample)
+      conv.convert();
+    block.add.convert();
+  }
+  fc_[0].convert();
+}
+
+std::vector<ChannelGroup> resnet_channel_groups(
+    const torch::nn::Conv2d& conv1,
+    const torch::nn::BatchNorm2d& bn1,
+    const std::vector<torch::nn::Sequential>& layers,
+    const torch::nn::Linear& fc) {
+  std::vector<ChannelGroup> groups;
+
+  ChannelGroup stream;
+  stream.producers.push_back(conv1);
+  stream.norms.push_back(bn1);
+
+  for (const auto& layer : layers) {
+    for (const auto& module : layer->children()) {
+      std::vector<std::pair<torch::nn::Conv2d, torch::nn::BatchNorm2d>> path;
+      torch::nn::Sequential downsample{nullptr};
+
+      if (auto* B = dynamic_cast<BasicBlock*>(module.get())) {
+        path = {{B->conv1, B->bn1}, {B->conv2, B->bn2}};
+        downsample = B->downsample;
+      } else if (auto* B = dynamic_cast<Bottleneck*>(module.get())) {
+        path = {{B->conv1, B->bn1}, {B->conv2, B->bn2}, {B->conv3, B->bn3}};
+        downsample = B->downsample;
+      } else {
+        TORCH_CHECK(false, "resnet_channel_groups: unsupported block ", module->name());
+      }
+
+      // inner channels; grouped (ResNeXt) convolutions keep theirs
+      for (size_t i = 0; i + 1 < path.size(); i++) {
+        if (path[i].first->options.groups() != 1 || path[i + 1].first->options.groups() != 1)
+          continue;
+        ChannelGroup inner;
+        inner.producers.push_back(path[i].first);
+        inner.norms.push_back(path[i].second);
+        inner.consumers.push_back(path[i + 1].first);
+        groups.push_back(inner);
+      }
+
+      // the block reads the current residual stream ...
+      stream.consumers.push_back(path[0].first);
+      if (!downsample.is_empty()) {
+        // ... and a downsample starts a new one, shared with the block's last convolution
+        torch::nn::Conv2d conv(std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(downsample->ptr(0)));
+        torch::nn::BatchNorm2d bn(std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(downsample->ptr(1)));
+        stream.consumers.push_back(conv);
+        groups.push_back(stream);
+
+        stream = ChannelGroup();
+        stream.producers = {conv, path.back().first};
+        stream.norms = {bn, path.back().second};
+      } else {
+        // ... or adds to it through the identity shortcut
+        stream.producers.push_back(path.back().first);
+        stream.norms.push_back(path.back().second);
+      }
+    }
+  }
+
+  stream.linear_consumers.push_back(fc);
+  groups.push_back(stream);
+  return groups;
+}
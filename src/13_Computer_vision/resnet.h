@@ -2,6 +2,9 @@
 
 #include <torch/torch.h>
 
+#include "../utils/quantization.h"
+#include "../utils/pruning.h"
+
 template <typename Block>
 struct ResNetImpl;
 
@@ -248,3 +251,52 @@ TORCH_MODULE(ResNext101_32x8d);
 TORCH_MODULE(WideResNet50_2);
 TORCH_MODULE(WideResNet101_2);
 
+
+// Int8 post-training quantized copy of a trained ResNet (see ../utils/quantization.h). Each
+// convolution has its BatchNorm folded in, block-internal ReLUs are fused into the convolutions
+// and the residual add + ReLU runs as one quantized op.
+class QuantizedResNet {
+ public:
+  template <typename Block>
+  explicit QuantizedResNet(ResNetImpl<Block>& net) {
+    init(net.conv1, net.bn1, {net.layer1, net.layer2, net.layer3, net.layer4}, net.fc);
+  }
+
+  // fp32 in, fp32 out
+  torch::Tensor forward(torch::Tensor x);
+  void calibrate(const torch::Tensor& x);
+  void convert();
+
+ private:
+  struct QuantizedBlock {
+    std::vector<QuantizedConv2d> convs;
+    std::vector<QuantizedConv2d> downsample;
+    QuantizedAdd add{true};
+  };
+
+  void init(
+      const torch::nn::Conv2d& conv1,
+      const torch::nn::BatchNorm2d& bn1,
+      const std::vector<torch::nn::Sequential>& layers,
+      const torch::nn::Linear& fc);
+
+  QuantStub quant_;
+  std::vector<QuantizedConv2d> stem_;
+  std::vector<QuantizedBlock> blocks_;
+  std::vector<QuantizedLinear> fc_;
+};
+
+// Channel groups for structured pruning (see ../utils/pruning.h): the inner channels of every block,
+// and one group per residual stream, i.e. the channels the stem / downsample convolutions and the
+// last convolution of every block share through the identity shortcuts.
+std::vector<ChannelGroup> resnet_channel_groups(
+    const torch::nn::Conv2d& conv1,
+    const torch::nn::BatchNorm2d& bn1,
+    const std::vector<torch::nn::Sequential>& layers,
+    const torch::nn::Linear& fc);
+
+template <typename Block>
+std::vector<ChannelGroup> resnet_channel_groups(ResNetImpl<Block>& net) {
+  return resnet_channel_groups(
+      net.conv1, net.bn1, {net.layer1, net.layer2, net.layer3, net.layer4}, net.fc);
+}
@@ -0,0 +1,512 @@
+#include "roi_ops.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <ATen/Dispatch.h>
+
+namespace {
+
+void check_roi_inputs(const torch::Tensor& input, const torch::Tensor& rois) {
+  TORCH_CHECK(input.device().is_cpu(), "roi ops: input must be a CPU tensor");
+  TORCH_CHECK(input.dim() == 4, "roi ops: input must be (N, C, H, W)");
+  TORCH_CHECK(rois.dim() == 2 && rois.size(1) == 5, "roi ops: rois must be (K, 5)");
+}
+
+// ----------------------------------------------------------------
+// RoIPool
+// ----------------------------------------------------------------
+
+// Cell range [h0, h1) x [w0, w1) of the feature map covered by one output bin
+struct PoolBin {
+  int64_t h0, h1, w0, w1;
+};
+
+// Box corners are snapped to feature cells. Bin p of a box spanning `size` cells covers cells
+// floor(p * size / pooled) .. ceil((p + 1) * size / pooled) of the box, clipped to the map, so
+// neighbouring bins may share a row or column. A box thinner than one cell counts as one cell.
+template <typename T>
+std::vector<PoolBin> pool_bins(const T* roi, T spatial_scale, int64_t height, int64_t width,
+                               int64_t pooled_height, int64_t pooled_width) {
+  const int64_t x0 = std::round(roi[1] * spatial_scale), y0 = std::round(roi[2] * spatial_scale);
+  const int64_t x1 = std::round(roi[3] * spatial_scale), y1 = std::round(roi[4] * spatial_scale);
+  const T cell_h = static_cast<T>(std::max<int64_t>(y1 - y0 + 1, 1)) / pooled_height;
+  const T cell_w = static_cast<T>(std::max<int64_t>(x1 - x0 + 1, 1)) / pooled_width;
+  auto clip = [](int64_t v, int64_t hi) { return std::min(std::max<int64_t>(v, 0), hi); };
+
+  std::vector<PoolBin> bins(pooled_height * pooled_width);
+  for (int64_t ph = 0; ph < pooled_height; ++ph) {
+    for (int64_t pw = 0; pw < pooled_width; ++pw) {
+      PoolBin& bin = bins[ph * pooled_width + pw];
+      bin.h0 = clip(y0 + static_cast<int64_t>(std::floor(ph * cell_h)), height);
+      bin.h1 = clip(y0 + static_cast<int64_t>(std::ceil((ph + 1) * cell_h)), height);
+      bin.w0 = clip(x0 + static_cast<int64_t>(std::floor(pw * cell_w)), width);
+      bin.w1 = clip(x0 + static_cast<int64_t>(std::ceil((pw + 1) * cell_w)), width);
+    }
+  }
+  return bins;
+}
+
+// Max over the cells of each bin. An empty bin (box outside the map) outputs 0 and stores the
+// argmax -1, which the backward pass skips.
+template <typename T>
+void roi_pool_forward_kernel(
+    const T* input,
+    const T spatial_scale,
+    int64_t channels,
+    int64_t height,
+    int64_t width,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    const T* rois,
+    int64_t num_rois,
+    T* output,
+    int64_t* argmax) {
+  const int64_t plane = height * width, bins_per_roi = pooled_height * pooled_width;
+
+  #pragma omp parallel for
+  for (int64_t n = 0; n < num_rois; ++n) {
+    const T* roi = rois + n * 5;
+    const int64_t image = static_cast<int64_t>(roi[0]);
+    // the bin layout does not depend on the channel
+    const std::vector<PoolBin> bins = pool_bins(roi, spatial_scale, height, width, pooled_height, pooled_width);
+
+    for (int64_t c = 0; c < channels; ++c) {
+      const T* feature = input + (image * channels + c) * plane;
+      T* out = output + (n * channels + c) * bins_per_roi;
+      int64_t* arg = argmax + (n * channels + c) * bins_per_roi;
+
+      for (int64_t b = 0; b < bins_per_roi; ++b) {
+        const PoolBin& bin = bins[b];
+        T best = -std::numeric_limits<T>::max();
+        int64_t best_at = -1;
+        for (int64_t h = bin.h0; h < bin.h1; ++h) {
+          for (int64_t w = bin.w0; w < bin.w1; ++w) {
+            if (feature[h * width + w] > best) {
+              best = feature[h * width + w];
+              best_at = h * width + w;
+            }
+          }
+        }
+        out[b] = best_at < 0 ? T(0) : best;
+        arg[b] = best_at;
+      }
+    }
+  }
+}
+
+// Routes each output gradient to the cell that won the max. Threads own channels, so RoIs that
+// overlap never add to the same element concurrently.
+template <typename T>
+void roi_pool_backward_kernel(
+    const T* grad_output,
+    const int64_t* argmax,
+    int64_t num_rois,
+    int64_t channels,
+    int64_t height,
+    int64_t width,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    const T* rois,
+    T* grad_input) {
+  const int64_t plane = height * width, bins_per_roi = pooled_height * pooled_width;
+
+  #pragma omp parallel for
+  for (int64_t c = 0; c < channels; ++c) {
+    for (int64_t n = 0; n < num_rois; ++n) {
+      const int64_t image = static_cast<int64_t>(rois[n * 5]);
+      T* grad = grad_input + (image * channels + c) * plane;
+      const int64_t offset = (n * channels + c) * bins_per_roi;
+
+      for (int64_t b = 0; b < bins_per_roi; ++b) {
+        const int64_t at = argmax[offset + b];
+        if (at >= 0)
+          grad[at] += grad_output[offset + b];
+      }
+    }
+  }
+}
+
+// ----------------------------------------------------------------
+// RoIAlign
+// ----------------------------------------------------------------
+
+// Four neighbouring cells of a sample point and their bilinear weights
+template <typename T>
+struct BilinearSample {
+  int64_t index[4];   // top-left, top-right, bottom-left, bottom-right
+  T weight[4];
+};
+
+// A point further than one cell outside the map gets zero weights. Otherwise it is clamped onto
+// the map, and on the last row / column both neighbours collapse onto the same cell.
+template <typename T>
+BilinearSample<T> bilinear_sample(int64_t height, int64_t width, T y, T x) {
+  BilinearSample<T> s{{0, 0, 0, 0}, {0, 0, 0, 0}};
+  if (y < -1.0 || y > height || x < -1.0 || x > width)
+    return s;
+
+  y = std::min(std::max(y, T(0)), static_cast<T>(height - 1));
+  x = std::min(std::max(x, T(0)), static_cast<T>(width - 1));
+  const int64_t top = static_cast<int64_t>(y), left = static_cast<int64_t>(x);
+  const int64_t bottom = std::min(top + 1, height - 1), right = std::min(left + 1, width - 1);
+  const T dy = y - top, dx = x - left;
+
+  s.index[0] = top * width + left;
+  s.index[1] = top * width + right;
+  s.index[2] = bottom * width + left;
+  s.index[3] = bottom * width + right;
+  s.weight[0] = (1 - dy) * (1 - dx);
+  s.weight[1] = (1 - dy) * dx;
+  s.weight[2] = dy * (1 - dx);
+  s.weight[3] = dy * dx;
+  return s;
+}
+
+// Bin layout of one RoI on the feature map. Unlike RoIPool the box keeps its fractional
+// coordinates. `aligned` moves it by half a cell so that cell centres sit at integer + 0.5;
+// without it a box is at least one cell wide (the original Mask R-CNN behaviour). Every bin is
+// the average of grid_h x grid_w evenly spaced bilinear samples: sampling_ratio per side, or
+// ceil(bin size) when sampling_ratio is 0.
+template <typename T>
+struct AlignGeometry {
+  T y0, x0, bin_h, bin_w;
+  int64_t grid_h, grid_w;
+  T count;
+
+  T sample_y(int64_t ph, int64_t iy) const { return y0 + bin_h * (ph + (iy + T(0.5)) / grid_h); }
+  T sample_x(int64_t pw, int64_t ix) const { return x0 + bin_w * (pw + (ix + T(0.5)) / grid_w); }
+};
+
+template <typename T>
+AlignGeometry<T> align_geometry(const T* roi, T spatial_scale, int64_t pooled_height, int64_t pooled_width,
+                                int64_t sampling_ratio, bool aligned) {
+  AlignGeometry<T> g;
+  const T shift = aligned ? T(0.5) : T(0);
+  g.x0 = roi[1] * spatial_scale - shift;
+  g.y0 = roi[2] * spatial_scale - shift;
+  T box_w = roi[3] * spatial_scale - shift - g.x0;
+  T box_h = roi[4] * spatial_scale - shift - g.y0;
+  if (!aligned) {
+    box_w = std::max(box_w, T(1));
+    box_h = std::max(box_h, T(1));
+  }
+
+  g.bin_h = box_h / pooled_height;
+  g.bin_w = box_w / pooled_width;
+  g.grid_h = sampling_ratio > 0 ? sampling_ratio : static_cast<int64_t>(std::ceil(g.bin_h));
+  g.grid_w = sampling_ratio > 0 ? sampling_ratio : static_cast<int64_t>(std::ceil(g.bin_w));
+  g.count = std::max<T>(g.grid_h * g.grid_w, 1);
+  return g;
+}
+
+template <typename T>
+void roi_align_forward_kernel(
+    const T* input,
+    const T spatial_scale,
+    int64_t channels,
+    int64_t height,
+    int64_t width,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned,
+    const T* rois,
+    int64_t num_rois,
+    T* output) {
+  const int64_t plane = height * width, bins_per_roi = pooled_height * pooled_width;
+
+  #pragma omp parallel for
+  for (int64_t n = 0; n < num_rois; ++n) {
+    const T* roi = rois + n * 5;
+    const int64_t image = static_cast<int64_t>(roi[0]);
+    const AlignGeometry<T> g = align_geometry(roi, spatial_scale, pooled_height, pooled_width, sampling_ratio, aligned);
+
+    // sample positions and weights are the same for every channel, compute them once per RoI
+    std::vector<BilinearSample<T>> samples;
+    samples.reserve(bins_per_roi * g.grid_h * g.grid_w);
+    for (int64_t ph = 0; ph < pooled_height; ++ph)
+      for (int64_t pw = 0; pw < pooled_width; ++pw)
+        for (int64_t iy = 0; iy < g.grid_h; ++iy)
+          for (int64_t ix = 0; ix < g.grid_w; ++ix)
+            samples.push_back(bilinear_sample(height, width, g.sample_y(ph, iy), g.sample_x(pw, ix)));
+
+    const int64_t per_bin = g.grid_h * g.grid_w;
+    for (int64_t c = 0; c < channels; ++c) {
+      const T* feature = input + (image * channels + c) * plane;
+      T* out = output + (n * channels + c) * bins_per_roi;
+
+      const BilinearSample<T>* s = samples.data();
+      for (int64_t b = 0; b < bins_per_roi; ++b) {
+        T sum = 0;
+        for (int64_t i = 0; i < per_bin; ++i, ++s)
+          for (int k = 0; k < 4; ++k)
+            sum += s->weight[k] * feature[s->index[k]];
+        out[b] = sum / g.count;
+      }
+    }
+  }
+}
+
+// Spreads the gradient of each bin evenly over its samples and bilinearly onto their cells.
+// Parallel over channels like the RoIPool backward; the per-RoI geometry is computed once up front.
+template <typename T>
+void roi_align_backward_kernel(
+    const T* grad_output,
+    const T spatial_scale,
+    int64_t channels,
+    int64_t height,
+    int64_t width,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned,
+    const T* rois,
+    int64_t num_rois,
+    T* grad_input) {
+  const int64_t plane = height * width, bins_per_roi = pooled_height * pooled_width;
+
+  std::vector<AlignGeometry<T>> geometry(num_rois);
+  for (int64_t n = 0; n < num_rois; ++n)
+    geometry[n] = align_geometry(rois + n * 5, spatial_scale, pooled_height, pooled_width, sampling_ratio, aligned);
+
+  #pragma omp parallel for
+  for (int64_t c = 0; c < channels; ++c) {
+    for (int64_t n = 0; n < num_rois; ++n) {
+      const AlignGeometry<T>& g = geometry[n];
+      const int64_t image = static_cast<int64_t>(rois[n * 5]);
+      T* grad = grad_input + (image * channels + c) * plane;
+      const T* grad_bins = grad_output + (n * channels + c) * bins_per_roi;
+
+      for (int64_t ph = 0; ph < pooled_height; ++ph) {
+        for (int64_t pw = 0; pw < pooled_width; ++pw) {
+          const T share = grad_bins[ph * pooled_width + pw] / g.count;
+          for (int64_t iy = 0; iy < g.grid_h; ++iy) {
+            const T y = g.sample_y(ph, iy);
+            for (int64_t ix = 0; ix < g.grid_w; ++ix) {
+              const BilinearSample<T> s = bilinear_sample(height, width, y, g.sample_x(pw, ix));
+              for (int k = 0; k < 4; ++k)
+                grad[s.index[k]] += share * s.weight[k];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+class RoIPoolFunction : public torch::autograd::Function<RoIPoolFunction> {
+ public:
+  static torch::Tensor forward(
+      torch::autograd::AutogradContext* ctx,
+      const torch::Tensor& input,
+      const torch::Tensor& rois,
+      double spatial_scale,
+      int64_t pooled_height,
+      int64_t pooled_width) {
+    torch::Tensor output, argmax;
+    std::tie(output, argmax) = roi_pool_forward(input, rois, spatial_scale, pooled_height, pooled_width);
+    ctx->saved_data["input_shape"] = input.sizes();
+    ctx->save_for_backward({rois, argmax});
+    return output;
+  }
+
+  static torch::autograd::variable_list backward(
+      torch::autograd::AutogradContext* ctx,
+      torch::autograd::variable_list grad_output) {
+    auto saved = ctx->get_saved_variables();
+    auto input_shape = ctx->saved_data["input_shape"].toIntVector();
+    auto grad_input = roi_pool_backward(grad_output[0], saved[0], saved[1], input_shape);
+    return {grad_input, torch::Tensor(), torch::Tensor(), torch::Tensor(), torch::Tensor()};
+  }
+};
+
+class RoIAlignFunction : public torch::autograd::Function<RoIAlignFunction> {
+ public:
+  static torch::Tensor forward(
+      torch::autograd::AutogradContext* ctx,
+      const torch::Tensor& input,
+      const torch::Tensor& rois,
+      double spatial_scale,
+      int64_t pooled_height,
+      int64_t pooled_width,
+      int64_t sampling_ratio,
+      bool aligned) {
+    ctx->saved_data["spatial_scale"] = spatial_scale;
+    ctx->saved_data["pooled_height"] = pooled_height;
+    ctx->saved_data["pooled_width"] = pooled_width;
+    ctx->saved_data["sampling_ratio"] = sampling_ratio;
+    ctx->saved_data["aligned"] = aligned;
+    ctx->saved_data["input_shape"] = input.sizes();
+    ctx->save_for_backward({rois});
+    return roi_align_forward(input, rois, spatial_scale, pooled_height, pooled_width, sampling_ratio, aligned);
+  }
+
+  static torch::autograd::variable_list backward(
+      torch::autograd::AutogradContext* ctx,
+      torch::autograd::variable_list grad_output) {
+    auto rois = ctx->get_saved_variables()[0];
+    auto input_shape = ctx->saved_data["input_shape"].toIntVector();
+    auto grad_input = roi_align_backward(
+        grad_output[0],
+        rois,
+        ctx->saved_data["spatial_scale"].toDouble(),
+        ctx->saved_data["pooled_height"].toInt(),
+        ctx->saved_data["pooled_width"].toInt(),
+        ctx->saved_data["sampling_ratio"].toInt(),
+        ctx->saved_data["aligned"].toBool(),
+        input_shape);
+    return {grad_input, torch::Tensor(), torch::Tensor(), torch::Tensor(),
+            torch::Tensor(), torch::Tensor(), torch::Tensor()};
+  }
+};
+
+} // namespace
+
+std::tuple<torch::Tensor, torch::Tensor> roi_pool_forward(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width) {
+  check_roi_inputs(input, rois);
+
+  int64_t num_rois = rois.size(0);
+  int64_t channels = input.size(1), height = input.size(2), width = input.size(3);
+
+  torch::Tensor output = torch::zeros({num_rois, channels, pooled_height, pooled_width}, input.options());
+  torch::Tensor argmax = torch::full({num_rois, channels, pooled_height, pooled_width}, -1,
+                                     input.options().dtype(torch::kLong));
+  if (output.numel() == 0)
+    return std::make_tuple(output, argmax);
+
+  auto input_ = input.contiguous();
+  auto rois_ = rois.to(input.scalar_type()).contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "roi_pool_forward", [&] {
+    roi_pool_forward_kernel<scalar_t>(
+        input_.data_ptr<scalar_t>(), static_cast<scalar_t>(spatial_scale), channels, height, width,
+        pooled_height, pooled_width, rois_.data_ptr<scalar_t>(), num_rois,
+        output.data_ptr<scalar_t>(), argmax.data_ptr<int64_t>());
+  });
+  return std::make_tuple(output, argmax);
+}
+
+torch::Tensor roi_pool_backward(
+    const torch::Tensor& grad_output,
+    const torch::Tensor& rois,
+    const torch::Tensor& argmax,
+    torch::IntArrayRef input_shape) {
+  torch::Tensor grad_input = torch::zeros(input_shape, grad_output.options());
+  if (grad_output.numel() == 0)
+    return grad_input;
+
+  auto grad_ = grad_output.contiguous();
+  auto rois_ = rois.to(grad_output.scalar_type()).contiguous();
+  auto argmax_ = argmax.contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES(grad_output.scalar_type(), "roi_pool_backward", [&] {
+    roi_pool_backward_kernel<scalar_t>(
+        grad_.data_ptr<scalar_t>(), argmax_.data_ptr<int64_t>(), rois.size(0),
+        input_shape[1], input_shape[2], input_shape[3], grad_output.size(2), grad_output.size(3),
+        rois_.data_ptr<scalar_t>(), grad_input.data_ptr<scalar_t>());
+  });
+  return grad_input;
+}
+
+torch::Tensor roi_align_forward(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned) {
+  check_roi_inputs(input, rois);
+
+  int64_t num_rois = rois.size(0);
+  int64_t channels = input.size(1), height = input.size(2), width = input.size(3);
+
+  torch::Tensor output = torch::zeros({num_rois, channels, pooled_height, pooled_width}, input.options());
+  if (output.numel() == 0)
+    return output;
+
+  auto input_ = input.contiguous();
+  auto rois_ = rois.to(input.scalar_type()).contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES(input.scalar_type(), "roi_align_forward", [&] {
+    roi_align_forward_kernel<scalar_t>(
+        input_.data_ptr<scalar_t>(), static_cast<scalar_t>(spatial_scale), channels, height, width,
+        pooled_height, pooled_width, sampling_ratio, aligned, rois_.data_ptr<scalar_t>(), num_rois,
+        output.data_ptr<scalar_t>());
+  });
+  return output;
+}
+
+torch::Tensor roi_align_backward(
+    const torch::Tensor& grad_output,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned,
+    torch::IntArrayRef input_shape) {
+  torch::Tensor grad_input = torch::zeros(input_shape, grad_output.options());
+  if (grad_output.numel() == 0)
+    return grad_input;
+
+  auto grad_ = grad_output.contiguous();
+  auto rois_ = rois.to(grad_output.scalar_type()).contiguous();
+
+  AT_DISPATCH_FLOATING_TYPES(grad_output.scalar_type(), "roi_align_backward", [&] {
+    roi_align_backward_kernel<scalar_t>(
+        grad_.data_ptr<scalar_t>(), static_cast<scalar_t>(spatial_scale), input_shape[1], input_shape[2],
+        input_shape[3], pooled_height, pooled_width, sampling_ratio, aligned, rois_.data_ptr<scalar_t>(),
+        rois.size(0), grad_input.data_ptr<scalar_t>());
+  });
+  return grad_input;
+}
+
+torch::Tensor roi_pool(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width) {
+  return RoIPoolFunction::apply(input, rois, spatial_scale, pooled_height, pooled_width);
+}
+
+torch::Tensor roi_align(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned) {
+  return RoIAlignFunction::apply(input, rois, spatial_scale, pooled_height, pooled_width, sampling_ratio, aligned);
+}
+
+RoIPoolImpl::RoIPoolImpl(int64_t pooled_height, int64_t pooled_width, double spatial_scale)
+    : pooled_height(pooled_height), pooled_width(pooled_width), spatial_scale(spatial_scale) {}
+
+torch::Tensor RoIPoolImpl::forward(torch::Tensor input, torch::Tensor rois) {
+  return roi_pool(input, rois, spatial_scale, pooled_height, pooled_width);
+}
+
+RoIAlignImpl::RoIAlignImpl(
+    int64_t pooled_height,
+    int64_t pooled_width,
+    double spatial_scale,
+    int64_t sampling_ratio,
+    bool aligned)
+    : pooled_height(pooled_height),
+      pooled_width(pooled_width),
+      sampling_ratio(sampling_ratio),
+      spatial_scale(spatial_scale),
+      aligned(aligned) {}
+
+torch::Tensor RoIAlignImpl::forward(torch::Tensor input, torch::Tensor rois) {
+  return roi_align(input, rois, spatial_scale, pooled_height, pooled_width, sampling_ratio, aligned);
+}
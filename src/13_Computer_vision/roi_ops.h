@@ -0,0 +1,89 @@
+#pragma once
+
+#include <torch/torch.h>
+
+// Region of interest pooling operators for Fast / Faster R-CNN style heads, native CPU
+// implementations with the same semantics as torchvision.ops.roi_pool / roi_align.
+//
+// input: (N, C, H, W) feature map
+// rois:  (K, 5) rows of (batch index, x1, y1, x2, y2) in input image coordinates;
+//        spatial_scale maps them onto the feature map
+// output: (K, C, pooled_height, pooled_width)
+//
+// The forward passes are parallelised over RoIs with OpenMP, the backward passes over channels
+// so that overlapping RoIs never write the same gradient element from two threads.
+
+std::tuple<torch::Tensor, torch::Tensor> roi_pool_forward(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width);
+
+torch::Tensor roi_pool_backward(
+    const torch::Tensor& grad_output,
+    const torch::Tensor& rois,
+    const torch::Tensor& argmax,
+    torch::IntArrayRef input_shape);
+
+torch::Tensor roi_align_forward(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned);
+
+torch::Tensor roi_align_backward(
+    const torch::Tensor& grad_output,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio,
+    bool aligned,
+    torch::IntArrayRef input_shape);
+
+// autograd-aware entry points
+torch::Tensor roi_pool(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width);
+
+torch::Tensor roi_align(
+    const torch::Tensor& input,
+    const torch::Tensor& rois,
+    double spatial_scale,
+    int64_t pooled_height,
+    int64_t pooled_width,
+    int64_t sampling_ratio = -1,
+    bool aligned = false);
+
+struct RoIPoolImpl : torch::nn::Module {
+  int64_t pooled_height, pooled_width;
+  double spatial_scale;
+
+  RoIPoolImpl(int64_t pooled_height, int64_t pooled_width, double spatial_scale);
+
+  torch::Tensor forward(torch::Tensor input, torch::Tensor rois);
+};
+TORCH_MODULE(RoIPool);
+
+struct RoIAlignImpl : torch::nn::Module {
+  int64_t pooled_height, pooled_width, sampling_ratio;
+  double spatial_scale;
+  bool aligned;
+
+  RoIAlignImpl(
+      int64_t pooled_height,
+      int64_t pooled_width,
+      double spatial_scale,
+      int64_t sampling_ratio = -1,
+      bool aligned = false);
+
+  torch::Tensor forward(torch::Tensor input, torch::Tensor rois);
+};
+TORCH_MODULE(RoIAlign);
@@ -2,9 +2,14 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <filesystem>
 #include "config.h"
 #include <stdio.h>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 struct Mish : torch::nn::Module
@@ -146,11 +151,45 @@ struct DetectionLayer : torch::nn::Module
   }
 };
 
+// Convolution with BatchNorm already folded into weight / bias, followed by an in-place activation
+struct FusedConvLayer : torch::nn::Module
+{
+  torch::Tensor weight, bias;
+  int64_t _stride;
+  int64_t _pad;
+  ActivationKind _activation;
+
+  FusedConvLayer(torch::Tensor w, torch::Tensor b, int64_t stride, int64_t pad, ActivationKind activation)
+  {
+    weight = register_parameter("weight", w, false);
+    bias = register_parameter("bias", b, false);
+    _stride = stride;
+    _pad = pad;
+    _activation = activation;
+  }
+
+  torch::Tensor forward(torch::Tensor x)
+  {
+    x = torch::conv2d(x, weight, bias, {_stride, _stride}, {_pad, _pad});
+    if (_activation == ActivationKind::Leaky)
+    {
+      torch::leaky_relu_(x, 0.1);
+    }
+    else if (_activation == ActivationKind::Mish)
+    {
+      torch::mish_(x);
+    }
+    return x;
+  }
+};
+
 Darknet::Darknet(const char *conf_file, torch::Device *device)
 {
   config_ = Config(conf_file);
+  conf_file_ = conf_file;
   device_ = device;
   create_modules();
+  build_plan();
 }
 
 void Darknet::create_modules()
@@ -351,89 +390,325 @@ void Darknet::create_modules()
   }
 }
 
-void Darknet::create_convolutional(torch::nn::Sequential &module, Block &block, int in_channels)
+void Darknet::build_plan()
 {
+  size_t module_count = module_list.size();
+  plan_.assign(module_count, LayerPlan());
+  input_size_ = Config::get_int_from_block(config_.blocks_[0], "height", 0);
+
+  // a yolo layer passes its input through, so whoever reads it really reads the layer before it
+  auto resolve = [this](int ix) {
+    while (ix > 0 && plan_[ix].kind == LayerKind::Yolo)
+      ix -= 1;
+    return ix;
+  };
+
+  std::vector<int> last_use(module_count, -1);
+
+  for (size_t i = 0; i < module_count; i++)
+  {
+    Block &block = config_.blocks_[i + 1];
+    std::string layer_type = block["type"];
+    LayerPlan &layer = plan_[i];
+    layer.module = module_list[i].get();
+
+    if (layer_type == "convolutional")
+    {
+      layer.kind = LayerKind::Convolutional;
+      layer.batch_normalize = Config::get_int_from_block(block, "batch_normalize", 0) > 0;
+      std::string activation = Config::get_string_from_block(block, "activation", "");
+      if (activation == "leaky")
+        layer.activation = ActivationKind::Leaky;
+      else if (activation == "mish")
+        layer.activation = ActivationKind::Mish;
+    }
+    else if (layer_type == "upsample")
+    {
+      layer.kind = LayerKind::Upsample;
+    }
+    else if (layer_type == "maxpool")
+    {
+      layer.kind = LayerKind::Maxpool;
+    }
+    else if (layer_type == "route")
+    {
+      layer.kind = LayerKind::Route;
+      std::vector<int> layers;
+      Config::split(block["layers"], layers, ",");
+      for (size_t j = 0; j < layers.size(); j++) {
+        int ix = layers[j] > 0 ? layers[j] : layers[j] + i;
+        layer.inputs.push_back(resolve(ix));
+      }
+      layer.groups = Config::get_int_from_block(block, "groups", 0);
+      layer.group_id = Config::get_int_from_block(block, "group_id", 0);
+      layer.chunk_size = Config::get_int_from_block(block, "chunk_size", 0);
+    }
+    else if (layer_type == "shortcut")
+    {
+      // the other operand is the running tensor, i.e. the output of layer i - 1
+      layer.kind = LayerKind::Shortcut;
+      int from = Config::get_int_from_block(block, "from", 0);
+      from = from > 0 ? from : from + i;
+      layer.inputs.push_back(resolve(from));
+    }
+    else if (layer_type == "yolo")
+    {
+      layer.kind = LayerKind::Yolo;
+      layer.num_classes = Config::get_int_from_block(block, "classes", 0);
+    }
+
+    for (int ix : layer.inputs) {
+      plan_[ix].keep_output = true;
+      last_use[ix] = std::max(last_use[ix], static_cast<int>(i));
+    }
+  }
 
+  for (size_t j = 0; j < module_count; j++) {
+    if (last_use[j] >= 0)
+      plan_[last_use[j]].release_after.push_back(j);
+  }
 }
 
-void Darknet::load_darknet_weights(const char *weights_file)
+void Darknet::fuse_for_inference(bool channels_last)
 {
-  std::ifstream fs(weights_file, std::ios::binary);
-  // header info: 5 * int32_t
-  int32_t header_size = sizeof(int32_t) * 5;
-  int64_t index_weight = 0;
-
-  fs.seekg(0, fs.end);
-  int64_t length = fs.tellg();
-  // skip header
-  length = length - header_size;
-
-  fs.seekg(header_size, fs.beg);
-  float *weights_src = (float *)malloc(length);
-  fs.read(reinterpret_cast<char *>(weights_src), length);
-  fs.close();
-
-  // at::TensorOptions options = torch::TensorOptions().dtype(torch::kFloat32);
-  at::Tensor weights = torch::from_blob(weights_src, {length / 4});
-  for (size_t i = 0; i < module_list.size(); i++)
+  torch::NoGradGuard no_grad;
+
+  for (size_t i = 0; i < plan_.size(); i++)
   {
-    Block module_info = config_.blocks_[i + 1];
+    LayerPlan &layer = plan_[i];
+    if (layer.kind != LayerKind::Convolutional)
+      continue;
 
-    std::string module_type = module_info["type"];
+    Block &block = config_.blocks_[i + 1];
+    int is_pad = Config::get_int_from_block(block, "pad", 0);
+    int kernel_size = Config::get_int_from_block(block, "size", 0);
+    int stride = Config::get_int_from_block(block, "stride", 1);
+    int pad = is_pad > 0 ? (kernel_size - 1) / 2 : 0;
 
-    // only conv layer need to load weight
-    if (module_type != "convolutional")
-      continue;
-    torch::nn::Sequential seq_module = module_list[i];
+    torch::nn::Conv2dImpl *conv_imp = dynamic_cast<torch::nn::Conv2dImpl *>(layer.module->ptr(0).get());
+    torch::Tensor weight = conv_imp->weight.detach();
+    torch::Tensor bias;
 
-    auto conv_module = seq_module.ptr()->ptr(0);
-    torch::nn::Conv2dImpl *conv_imp = dynamic_cast<torch::nn::Conv2dImpl *>(conv_module.get());
+    if (layer.batch_normalize)
+    {
+      // y = gamma * (conv(x) - mean) / sqrt(var + eps) + beta
+      //   = conv_{w * s}(x) + (beta - mean * s),  with s = gamma / sqrt(var + eps)
+      torch::nn::BatchNorm2dImpl *bn_imp = dynamic_cast<torch::nn::BatchNorm2dImpl *>(layer.module->ptr(1).get());
+      torch::Tensor scale = bn_imp->weight.detach() / torch::sqrt(bn_imp->running_var + bn_imp->options.eps());
+      weight = weight * scale.view({-1, 1, 1, 1});
+      bias = bn_imp->bias.detach() - bn_imp->running_mean * scale;
+    }
+    else
+    {
+      bias = conv_imp->bias.detach().clone();
+    }
+
+    if (channels_last)
+      weight = weight.contiguous(torch::MemoryFormat::ChannelsLast);
+    else
+      weight = weight.contiguous();
+
+    torch::nn::Sequential fused;
+    fused->push_back(std::make_shared<FusedConvLayer>(weight, bias, stride, pad, layer.activation));
+    replace_module("layer_" + std::to_string(i), fused);
+    module_list[i] = fused;
+    layer.module = fused.get();
+  }
+
+  fused_ = true;
+  channels_last_ = channels_last;
+}
+
+void Darknet::create_convolutional(torch::nn::Sequential &module, Block &block, int in_channels)
+{
 
-    int batch_normalize = Config::get_int_from_block(module_info, "batch_normalize", 0);
-    if (batch_normalize > 0)
+}
+
+// Source of the float payload of a .weights file: the file is mmapped when possible and
+// copied straight into the parameters, otherwise it is streamed tensor by tensor.
+class WeightsReader
+{
+public:
+  WeightsReader(const char *weights_file)
+  {
+    fd_ = open(weights_file, O_RDONLY);
+    TORCH_CHECK(fd_ >= 0, "failed to open weights file ", weights_file);
+
+    struct stat st;
+    TORCH_CHECK(fstat(fd_, &st) == 0, "failed to stat weights file ", weights_file);
+    file_size_ = st.st_size;
+
+    // header: major, minor, revision (int32), then images seen as int64 (int32 before 0.2)
+    int32_t version[3] = {0, 0, 0};
+    TORCH_CHECK(pread(fd_, version, sizeof(version), 0) == static_cast<ssize_t>(sizeof(version)), "weights file too short: ", weights_file);
+    header_size_ = sizeof(version) + ((version[0] * 10 + version[1]) >= 2 ? sizeof(int64_t) : sizeof(int32_t));
+    TORCH_CHECK(file_size_ >= header_size_ && (file_size_ - header_size_) % sizeof(float) == 0,
+                "weights file ", weights_file, " has an invalid size of ", file_size_, " bytes");
+    num_floats_ = (file_size_ - header_size_) / sizeof(float);
+
+    void *addr = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (addr != MAP_FAILED)
     {
-      // second module
-      auto bn_module = seq_module.ptr()->ptr(1);
+      map_ = addr;
+      madvise(map_, file_size_, MADV_SEQUENTIAL);
+    }
+    else
+    {
+      stream_buffer_.resize(kStreamBufferFloats);
+    }
+  }
 
-      torch::nn::BatchNorm2dImpl *bn_imp = dynamic_cast<torch::nn::BatchNorm2dImpl *>(bn_module.get());
+  ~WeightsReader()
+  {
+    if (map_ != nullptr)
+      munmap(map_, file_size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // copies the next dst.numel() floats of the file into dst
+  void read_into(torch::Tensor dst)
+  {
+    int64_t n = dst.numel();
+    TORCH_CHECK(offset_ + n <= num_floats_, "weights file is too short: needs at least ",
+                offset_ + n, " floats, has ", num_floats_);
+
+    if (map_ != nullptr)
+    {
+      const float *src = reinterpret_cast<const float *>(static_cast<const char *>(map_) + header_size_) + offset_;
+      dst.copy_(torch::from_blob(const_cast<float *>(src), dst.sizes(), torch::kFloat32));
+    }
+    else
+    {
+      // bounded buffer: never holds more than kStreamBufferFloats floats of the file
+      torch::Tensor flat = dst.view(-1);
+      for (int64_t done = 0; done < n; done += kStreamBufferFloats)
+      {
+        int64_t count = std::min<int64_t>(kStreamBufferFloats, n - done);
+        size_t bytes = count * sizeof(float);
+        off_t pos = header_size_ + (offset_ + done) * sizeof(float);
+        TORCH_CHECK(pread(fd_, stream_buffer_.data(), bytes, pos) == static_cast<ssize_t>(bytes),
+                    "failed to read weights at offset ", pos);
+        flat.slice(0, done, done + count).copy_(torch::from_blob(stream_buffer_.data(), {count}, torch::kFloat32));
+      }
+    }
+    offset_ += n;
+  }
 
-      int num_bn_biases = bn_imp->bias.numel();
+  int64_t consumed() const { return offset_; }
+  int64_t available() const { return num_floats_; }
+
+private:
+  static constexpr int64_t kStreamBufferFloats = 1 << 20;
+  int fd_ = -1;
+  void *map_ = nullptr;
+  size_t file_size_ = 0;
+  size_t header_size_ = 0;
+  int64_t num_floats_ = 0;
+  int64_t offset_ = 0;
+  std::vector<float> stream_buffer_;
+};
 
-      at::Tensor bn_bias = weights.slice(0, index_weight, index_weight + num_bn_biases);
-      index_weight += num_bn_biases;
+void Darknet::load_darknet_weights(const char *weights_file)
+{
+  TORCH_CHECK(!fused_, "load_darknet_weights must be called before fuse_for_inference");
+  torch::NoGradGuard no_grad;
+  WeightsReader reader(weights_file);
 
-      at::Tensor bn_weights = weights.slice(0, index_weight, index_weight + num_bn_biases);
-      index_weight += num_bn_biases;
+  for (size_t i = 0; i < plan_.size(); i++)
+  {
+    const LayerPlan &layer = plan_[i];
 
-      at::Tensor bn_running_mean = weights.slice(0, index_weight, index_weight + num_bn_biases);
-      index_weight += num_bn_biases;
+    // only conv layer need to load weight
+    if (layer.kind != LayerKind::Convolutional)
+      continue;
 
-      at::Tensor bn_running_var = weights.slice(0, index_weight, index_weight + num_bn_biases);
-      index_weight += num_bn_biases;
-      bn_bias = bn_bias.view_as(bn_imp->bias);
-      bn_weights = bn_weights.view_as(bn_imp->weight);
-      bn_running_mean = bn_running_mean.view_as(bn_imp->running_mean);
-      bn_running_var = bn_running_var.view_as(bn_imp->running_var);
+    torch::nn::Conv2dImpl *conv_imp = dynamic_cast<torch::nn::Conv2dImpl *>(layer.module->ptr(0).get());
 
-      bn_imp->bias.set_data(bn_bias);
-      bn_imp->weight.set_data(bn_weights);
-      bn_imp->running_mean.set_data(bn_running_mean);
-      bn_imp->running_var.set_data(bn_running_var);
+    if (layer.batch_normalize)
+    {
+      // second module; darknet order is bias, weight, running mean, running var
+      torch::nn::BatchNorm2dImpl *bn_imp = dynamic_cast<torch::nn::BatchNorm2dImpl *>(layer.module->ptr(1).get());
+      reader.read_into(bn_imp->bias);
+      reader.read_into(bn_imp->weight);
+      reader.read_into(bn_imp->running_mean);
+      reader.read_into(bn_imp->running_var);
     }
     else
     {
-      int num_conv_biases = conv_imp->bias.numel();
-      at::Tensor conv_bias = weights.slice(0, index_weight, index_weight + num_conv_biases);
-      index_weight += num_conv_biases;
-
-      conv_bias = conv_bias.view_as(conv_imp->bias);
-      conv_imp->bias.set_data(conv_bias);
-    }
-    int num_weights = conv_imp->weight.numel();
-    at::Tensor conv_weights = weights.slice(0, index_weight, index_weight + num_weights);
-    index_weight += num_weights;
-    conv_weights = conv_weights.view_as(conv_imp->weight);
-    conv_imp->weight.set_data(conv_weights);
+      reader.read_into(conv_imp->bias);
+    }
+    reader.read_into(conv_imp->weight);
+  }
+
+  TORCH_CHECK(reader.consumed() == reader.available(), "weights file ", weights_file, " holds ",
+              reader.available(), " floats but the network consumed ", reader.consumed());
+}
+
+void Darknet::save_checkpoint(const std::string &checkpoint_file)
+{
+  TORCH_CHECK(!fused_, "save_checkpoint must be called before fuse_for_inference");
+  torch::serialize::OutputArchive archive;
+  save(archive);
+  archive.save_to(checkpoint_file);
+}
+
+void Darknet::load_checkpoint(const std::string &checkpoint_file)
+{
+  TORCH_CHECK(!fused_, "load_checkpoint must be called before fuse_for_inference");
+  torch::serialize::InputArchive archive;
+  archive.load_from(checkpoint_file, *device_);
+  load(archive);
+}
+
+// size and modification time of the files a checkpoint was converted from
+static std::string source_stamp(const std::vector<std::string> &files)
+{
+  std::string stamp;
+  for (const auto &file : files)
+  {
+    auto size = std::filesystem::file_size(file);
+    auto mtime = std::filesystem::last_write_time(file).time_since_epoch().count();
+    stamp += file + ":" + std::to_string(size) + ":" + std::to_string(mtime) + ";";
+  }
+  return stamp;
+}
+
+void Darknet::load_weights(const std::string &weights_file, const std::string &checkpoint_file)
+{
+  TORCH_CHECK(!fused_, "load_weights must be called before fuse_for_inference");
+  if (checkpoint_file.empty())
+  {
+    load_darknet_weights(weights_file.c_str());
+    return;
+  }
+
+  std::string stamp = source_stamp({weights_file, conf_file_});
+  if (std::ifstream(checkpoint_file).good())
+  {
+    torch::serialize::InputArchive archive;
+    archive.load_from(checkpoint_file, *device_);
+    c10::IValue source;
+    if (archive.try_read("darknet_source", source) && source.isString() && source.toStringRef() == stamp)
+    {
+      load(archive);
+      return;
+    }
+    std::cout << checkpoint_file << " is out of date, converting " << weights_file << " again" << std::endl;
+  }
+
+  load_darknet_weights(weights_file.c_str());
+  try
+  {
+    torch::serialize::OutputArchive archive;
+    save(archive);
+    archive.write("darknet_source", c10::IValue(stamp));
+    archive.save_to(checkpoint_file);
+    std::cout << "converted weights saved to " << checkpoint_file << std::endl;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "could not write " << checkpoint_file << ", continuing with the loaded weights: " << e.what() << std::endl;
   }
 }
 
@@ -459,8 +734,7 @@ static inline torch::Tensor get_bbox_iou(torch::Tensor box1, torch::Tensor box2)
   torch::Tensor inter_rect_y2 = torch::min(b1_y2, b2_y2);
 
   // Intersection area
-  torch::Tensor inter_area = torch::max(inter_rect_x2 - inter_rect_x1 + 1,
-		  torch::zeros(inter_rect_x2.sizes())) * torch::max(inter_rect_y2 - inter_rect_y1 + 1, torch::zeros(inter_rect_x2.sizes()));
+  torch::Tensor inter_area = (inter_rect_x2 - inter_rect_x1 + 1).clamp_min_(0) * (inter_rect_y2 - inter_rect_y1 + 1).clamp_min_(0);
 
   // Union Area
   torch::Tensor b1_area = (b1_x2 - b1_x1 + 1) * (b1_y2 - b1_y1 + 1);
@@ -530,7 +804,6 @@ torch::Tensor Darknet::nms(torch::Tensor prediction, int num_classes, float conf
 
     // get unique classes
     std::vector<torch::Tensor> img_classes;
-    std::cout << "img_classes.size: " << img_classes.size() << '\n';
 
     for (size_t m = 0, len = image_prediction_data.size(0); m < len; m++) {
       bool found = false;
@@ -555,7 +828,6 @@ torch::Tensor Darknet::nms(torch::Tensor prediction, int num_classes, float conf
       auto class_mask_index = torch::nonzero(cls_mask.select(1, 5)).squeeze();
 
       auto image_pred_class = image_prediction_data.index_select(0, class_mask_index).view({-1, 7});
-      std::cout << "image_pred_class: " << image_pred_class << '\n';
 
       // ascend by confidence
       // seems that inverse method not work
@@ -569,7 +841,6 @@ torch::Tensor Darknet::nms(torch::Tensor prediction, int num_classes, float conf
       //conf_sort_index = torch::inverse(conf_sort_index); // The input tensor must have at least 2 dimensions
 
       image_pred_class = image_pred_class.index_select(0, conf_sort_index.squeeze()).cpu();
-      std::cout << "image_pred_class sorted: " << image_pred_class << '\n';
 
       for (int w = 0; w < image_pred_class.size(0) - 1; w++)
       {
@@ -581,7 +852,6 @@ torch::Tensor Darknet::nms(torch::Tensor prediction, int num_classes, float conf
         }
 
         auto ious = get_bbox_iou(image_pred_class[mi].unsqueeze(0), image_pred_class.slice(0, 0, mi));
-        std::cout << "ious: " << ious << '\n';
         auto iou_mask = (ious < nms_conf).to(torch::kFloat32).unsqueeze(1);
         image_pred_class.slice(0, 0, mi) = image_pred_class.slice(0, 0, mi) * iou_mask;
 
@@ -616,86 +886,58 @@ torch::Tensor Darknet::nms(torch::Tensor prediction, int num_classes, float conf
 
 torch::Tensor Darknet::forward(torch::Tensor x)
 {
+  size_t module_count = plan_.size();
 
-  int module_count = module_list.size();
-
+  // only outputs read by a later route / shortcut are stored, and each one is dropped
+  // as soon as its last reader has run
   std::vector<torch::Tensor> outputs(module_count);
+  std::vector<torch::Tensor> detections;
 
-  torch::Tensor result;
-  int write = 0;
+  if (channels_last_)
+    x = x.contiguous(torch::MemoryFormat::ChannelsLast);
 
-  for (int i = 0; i < module_count; i++)
+  for (size_t i = 0; i < module_count; i++)
   {
-    Block block = config_.blocks_[i + 1];
-    std::string layer_type = block["type"];
-
-    if (layer_type == "net")
-      continue;
+    const LayerPlan &layer = plan_[i];
 
-    if (layer_type == "convolutional" || layer_type == "upsample" || layer_type == "maxpool")
+    switch (layer.kind)
     {
-      torch::nn::SequentialImpl *seq_imp = dynamic_cast<torch::nn::SequentialImpl *>(module_list[i].ptr().get());
-      x = seq_imp->forward(x);
-      outputs[i] = x;
-    }
-    else if (layer_type == "route")
-    {
-      std::vector<int> layers;
-      int groups = Config::get_int_from_block(block, "groups", 0);
-      size_t group_id = Config::get_int_from_block(block, "group_id", 0);
-      Config::split(block["layers"], layers, ",");
-      for(size_t j =0; j< layers.size(); j++){
-        layers[j] = layers[j]  > 0 ? layers[j] : layers[j] + i;
-      }
-      if(layers.size()==1){
-        x = outputs[layers[0]];
-        if (groups!=0){
-          int64_t chunk_size = Config::get_int_from_block(block, "chunk_size", 0);
-          std::vector<torch::Tensor> group_tensor = at::split(x, chunk_size, 1);
-          x = group_tensor.at(group_id);
+    case LayerKind::Convolutional:
+    case LayerKind::Upsample:
+    case LayerKind::Maxpool:
+      x = layer.module->forward(x);
+      break;
+    case LayerKind::Route:
+      if (layer.inputs.size() == 1) {
+        x = outputs[layer.inputs[0]];
+        if (layer.groups != 0) {
+          x = x.split(layer.chunk_size, 1).at(layer.group_id);
         }
-      }else if(layers.size()==2){
-        torch::Tensor map_1 = outputs[layers[0]];
-        torch::Tensor map_2 = outputs[layers[1]];
-        x = torch::cat({map_1, map_2},1);
-      }else if(layers.size()==4){
-        torch::Tensor map_1 = outputs[layers[0]];
-        torch::Tensor map_2 = outputs[layers[1]];
-        torch::Tensor map_3 = outputs[layers[2]];
-        torch::Tensor map_4 = outputs[layers[3]];
-        x = torch::cat({map_1, map_2, map_3, map_4},1);
+      } else {
+        std::vector<torch::Tensor> maps;
+        maps.reserve(layer.inputs.size());
+        for (int ix : layer.inputs)
+          maps.push_back(outputs[ix]);
+        x = torch::cat(maps, 1);
       }
-      outputs[i]=x;
+      break;
+    case LayerKind::Shortcut:
+      x = x + outputs[layer.inputs[0]];
+      break;
+    case LayerKind::Yolo:
+      // the detection head output is collected, x passes through unchanged
+      detections.push_back(layer.module->forward(x, input_size_, layer.num_classes, *device_));
+      break;
+    default:
+      std::cout << "unknown type " << config_.blocks_[i + 1]["type"] << "\n";
     }
-    else if (layer_type == "shortcut")
-    {
-      int from = std::stoi(block["from"]);
-      from = from > 0 ? from : from + i;
-      x = outputs[i - 1] + outputs[from];
+
+    if (layer.keep_output)
       outputs[i] = x;
-    }
-    else if (layer_type == "yolo")
-    {
-      torch::nn::SequentialImpl *seq_imp = dynamic_cast<torch::nn::SequentialImpl *>(module_list[i].ptr().get());
-      Block net_info = config_.blocks_[0];
-      int inp_dim = Config::get_int_from_block(net_info, "height", 0);
-      int num_classes = Config::get_int_from_block(block, "classes", 0);
-      x = seq_imp->forward(x, inp_dim, num_classes, *device_);
-      if (write == 0)
-      {
-        result = x;
-        write = 1;
-      }
-      else
-      {
-        result = torch::cat({result, x}, 1);
-      }
-      outputs[i] = outputs[i - 1];
-    }else{
-      std::cout << "unknown type " << block["type"] << "\n";
-    }
+    for (int ix : layer.release_after)
+      outputs[ix].reset();
   }
-  return result;
+  return torch::cat(detections, 1);
 }
 
 void Darknet::show_config()
@@ -708,5 +950,5 @@ void Darknet::show_config()
 }
 
 int Darknet::get_input_size(){
-  return Config::get_int_from_block(config_.blocks_[0], "height", 0);
+  return input_size_;
 }
@@ -9,6 +9,33 @@
 #include "config.h"
 
 
+// Layer types understood by the forward executor, resolved once from the cfg block "type".
+enum class LayerKind { Convolutional, Upsample, Maxpool, Route, Shortcut, Yolo, Unknown };
+
+enum class ActivationKind { Linear, Leaky, Mish };
+
+// Compact, typed description of one layer, built at construction so that forward()
+// never touches the string-keyed Block maps.
+struct LayerPlan {
+  LayerKind kind = LayerKind::Unknown;
+  torch::nn::SequentialImpl *module = nullptr;
+  // absolute indices of the layer outputs read by route / shortcut
+  std::vector<int> inputs;
+  // route with groups: keep chunk `group_id` of size `chunk_size` along the channel dim
+  int groups = 0;
+  int group_id = 0;
+  int64_t chunk_size = 0;
+  // convolutional
+  bool batch_normalize = false;
+  ActivationKind activation = ActivationKind::Linear;
+  // yolo
+  int num_classes = 0;
+  // output must be stored because a later route / shortcut reads it
+  bool keep_output = false;
+  // stored outputs whose last consumer is this layer, released right after it runs
+  std::vector<int> release_after;
+};
+
 struct Darknet: torch::nn::Module {
   public:
   	Darknet(const char *conf_file, torch::Device *device);
@@ -16,6 +43,17 @@ struct Darknet: torch::nn::Module {
 
   	torch::Tensor forward(torch::Tensor x);
     void load_darknet_weights(const char *weights_file);
+    // native LibTorch checkpoint of the (unfused) parameters, much faster to load than .weights
+    void save_checkpoint(const std::string &checkpoint_file);
+    void load_checkpoint(const std::string &checkpoint_file);
+    // .weights through an optional checkpoint cache: checkpoint_file is loaded only when it was
+    // converted from the same .weights and cfg files (size and modification time), otherwise the
+    // .weights file is parsed and the checkpoint rewritten. A checkpoint that cannot be written
+    // (e.g. read-only directory) is skipped with a warning; an empty path disables the cache.
+    void load_weights(const std::string &weights_file, const std::string &checkpoint_file = "");
+    // inference only: folds BatchNorm into the conv weights, runs conv + activation as one
+    // module with an in-place activation and optionally switches to channels-last
+    void fuse_for_inference(bool channels_last = true);
     torch::Tensor predict(torch::Tensor input, int num_classes, float confidence, float nms_conf=0.4);
     torch::Tensor nms(torch::Tensor input, int num_classes, float confidence, float nms_conf=0.4);
     void show_config();
@@ -26,8 +64,14 @@ struct Darknet: torch::nn::Module {
   private:
   	torch::Device *device_;
     void create_convolutional(torch::nn::Sequential &module, Block &block, int in_channels);
+    void build_plan();
     Config config_;
+    std::string conf_file_;
 	  std::vector<torch::nn::Sequential> module_list;
+    std::vector<LayerPlan> plan_;
+    int input_size_ = 0;
+    bool fused_ = false;
+    bool channels_last_ = false;
 
     // void create_modules();
 };
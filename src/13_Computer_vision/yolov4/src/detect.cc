@@ -0,0 +1,63 @@
+#include <iostream>
+#include <torch/torch.h>
+
+#include "darknet.h"
+#include "coco_names.h"
+#include "detect_pipeline.h"
+
+// Batched detection over a directory / list of images or a video file, results written as JSON.
+// With batch size "bench" the input is run at batch sizes 1, 4 and 16 and images/sec is reported.
+
+int main(int argc, char* argv[]) {
+
+  if (argc < 5) {
+    std::cerr << "usage: yolov4_detect <cfg_path> <weight_path> <image dir | list.txt | image | video> <result.json>"
+                 " [batch_size | bench] [num_workers] [checkpoint.pt]\n";
+    return -1;
+  }
+  std::string cfg_path    = argv[1];
+  std::string weight_path = argv[2];
+  std::string input_path  = argv[3];
+  std::string json_path   = argv[4];
+  std::string batch_arg   = argc > 5 ? argv[5] : "4";
+  int num_workers         = argc > 6 ? std::atoi(argv[6]) : 2;
+  std::string checkpoint_path = argc > 7 ? argv[7] : "";
+
+  torch::Device device(torch::kCPU);
+
+  Darknet net(cfg_path.c_str(), &device);
+
+  net.load_weights(weight_path, checkpoint_path);
+  net.to(device);
+  net.eval();
+
+  bool video = DetectionPipeline::is_video(input_path);
+  std::vector<std::string> images;
+  if (!video) {
+    images = DetectionPipeline::list_images(input_path);
+    std::cout << images.size() << " images" << std::endl;
+  }
+
+  std::vector<int> batch_sizes;
+  if (batch_arg == "bench")
+    batch_sizes = {1, 4, 16};
+  else
+    batch_sizes = {std::max(1, std::atoi(batch_arg.c_str()))};
+
+  std::vector<FrameResult> results;
+  for (int batch_size : batch_sizes) {
+    DetectionPipelineOptions options;
+    options.batch_size = batch_size;
+    options.num_workers = num_workers;
+
+    DetectionPipeline pipeline(net, coco_class_names.size(), options);
+    results = video ? pipeline.run_video(input_path) : pipeline.run_images(images);
+
+    std::cout << "batch size " << batch_size << ": " << results.size() << " images, "
+              << pipeline.images_per_second() << " images/sec" << std::endl;
+  }
+
+  DetectionPipeline::write_json(results, json_path, coco_class_names);
+  std::cout << "results written to " << json_path << std::endl;
+  return 0;
+}
@@ -0,0 +1,337 @@
+#include "detect_pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <jsoncpp/json/value.h>
+#include <jsoncpp/json/writer.h>
+
+cv::Mat letterbox(const cv::Mat &image, int size, float &scale, int &pad_x, int &pad_y)
+{
+  scale = std::min(static_cast<float>(size) / image.cols, static_cast<float>(size) / image.rows);
+  int new_w = std::max(1, static_cast<int>(std::round(image.cols * scale)));
+  int new_h = std::max(1, static_cast<int>(std::round(image.rows * scale)));
+  pad_x = (size - new_w) / 2;
+  pad_y = (size - new_h) / 2;
+
+  cv::Mat resized;
+  cv::resize(image, resized, cv::Size(new_w, new_h), 0, 0, cv::INTER_LINEAR);
+
+  cv::Mat boxed(size, size, CV_8UC3, cv::Scalar(128, 128, 128));
+  resized.copyTo(boxed(cv::Rect(pad_x, pad_y, new_w, new_h)));
+  cv::cvtColor(boxed, boxed, cv::COLOR_BGR2RGB);
+  return boxed;
+}
+
+DetectionPipeline::DetectionPipeline(Darknet &net, int num_classes, DetectionPipelineOptions options)
+  : net_(net), num_classes_(num_classes), options_(options)
+{
+  input_size_ = net_.get_input_size();
+  options_.batch_size = std::max(1, options_.batch_size);
+  options_.num_workers = std::max(1, options_.num_workers);
+}
+
+std::vector<FrameResult> DetectionPipeline::run_images(const std::vector<std::string> &image_paths)
+{
+  return run([&image_paths](BlockingQueue<RawFrame> &raw) {
+    for (size_t i = 0; i < image_paths.size(); i++)
+    {
+      RawFrame frame;
+      frame.index = i;
+      frame.name = image_paths[i];
+      if (!raw.push(std::move(frame)))
+        return;
+    }
+  });
+}
+
+std::vector<FrameResult> DetectionPipeline::run_video(const std::string &video_path)
+{
+  return run([&video_path](BlockingQueue<RawFrame> &raw) {
+    // cv::VideoCapture is not thread safe: frames are decoded here and only letterboxed by the workers
+    cv::VideoCapture capture(video_path);
+    if (!capture.isOpened())
+    {
+      std::cerr << "failed to open video " << video_path << std::endl;
+      return;
+    }
+    int64_t index = 0;
+    cv::Mat image;
+    while (capture.read(image))
+    {
+      RawFrame frame;
+      frame.index = index;
+      frame.name = video_path + "#" + std::to_string(index);
+      frame.image = image.clone();
+      if (!raw.push(std::move(frame)))
+        return;
+      index++;
+    }
+  });
+}
+
+std::vector<FrameResult> DetectionPipeline::run(const std::function<void(BlockingQueue<RawFrame> &)> &source)
+{
+  BlockingQueue<RawFrame> raw(options_.queue_capacity);
+  BlockingQueue<PreparedFrame> prepared(options_.queue_capacity);
+  BlockingQueue<InferredBatch> inferred(options_.queue_capacity);
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // An exception in any stage is kept (the first one wins) and cancels every queue, so that the
+  // other stages finish; it is rethrown once all threads are joined.
+  std::mutex failure_mutex;
+  std::exception_ptr failure;
+  auto fail = [&](std::exception_ptr error) {
+    {
+      std::lock_guard<std::mutex> lock(failure_mutex);
+      if (!failure)
+        failure = error;
+    }
+    raw.cancel();
+    prepared.cancel();
+    inferred.cancel();
+  };
+
+  std::thread source_thread([&]() {
+    try
+    {
+      source(raw);
+    }
+    catch (...)
+    {
+      fail(std::current_exception());
+    }
+    raw.close();
+  });
+
+  // stage 1: decode + letterbox
+  std::atomic<int> workers_left(options_.num_workers);
+  std::vector<std::thread> workers;
+  for (int w = 0; w < options_.num_workers; w++)
+  {
+    workers.emplace_back([&]() {
+      try
+      {
+        RawFrame frame;
+        while (raw.pop(frame))
+        {
+          cv::Mat image = frame.image.empty() ? cv::imread(frame.name) : frame.image;
+          if (image.empty())
+          {
+            std::cerr << "failed to read " << frame.name << std::endl;
+            continue;
+          }
+
+          PreparedFrame out;
+          out.index = frame.index;
+          out.name = frame.name;
+          out.width = image.cols;
+          out.height = image.rows;
+          cv::Mat boxed = letterbox(image, input_size_, out.scale, out.pad_x, out.pad_y);
+          out.tensor = torch::from_blob(boxed.data, {input_size_, input_size_, 3}, torch::kByte)
+                         .permute({2, 0, 1}).to(torch::kFloat).div_(255.0);
+          if (!prepared.push(std::move(out)))
+            break;
+        }
+      }
+      catch (...)
+      {
+        fail(std::current_exception());
+      }
+      if (--workers_left == 0)
+        prepared.close();
+    });
+  }
+
+  // stage 3: map boxes back to the original images
+  std::vector<std::pair<int64_t, FrameResult>> indexed_results;
+  std::thread post_thread([&]() {
+    try
+    {
+      InferredBatch batch;
+      while (inferred.pop(batch))
+      {
+        std::vector<FrameResult> frames(batch.frames.size());
+        for (size_t b = 0; b < batch.frames.size(); b++)
+        {
+          frames[b].name = batch.frames[b].name;
+          frames[b].width = batch.frames[b].width;
+          frames[b].height = batch.frames[b].height;
+        }
+
+        // rows: batch index, x1, y1, x2, y2, object confidence, class score, class id
+        if (batch.detections.dim() == 2)
+        {
+          torch::Tensor detections = batch.detections.cpu().to(torch::kFloat).contiguous();
+          auto data = detections.accessor<float, 2>();
+          for (int64_t r = 0; r < detections.size(0); r++)
+          {
+            const PreparedFrame &frame = batch.frames[static_cast<size_t>(data[r][0])];
+            float max_x = frame.width - 1, max_y = frame.height - 1;
+            Detection det;
+            det.x1 = std::clamp((data[r][1] - frame.pad_x) / frame.scale, 0.0f, max_x);
+            det.y1 = std::clamp((data[r][2] - frame.pad_y) / frame.scale, 0.0f, max_y);
+            det.x2 = std::clamp((data[r][3] - frame.pad_x) / frame.scale, 0.0f, max_x);
+            det.y2 = std::clamp((data[r][4] - frame.pad_y) / frame.scale, 0.0f, max_y);
+            det.objectness = data[r][5];
+            det.class_score = data[r][6];
+            det.class_id = static_cast<int>(data[r][7]);
+            frames[static_cast<size_t>(data[r][0])].detections.push_back(det);
+          }
+        }
+
+        for (size_t b = 0; b < frames.size(); b++)
+          indexed_results.emplace_back(batch.frames[b].index, std::move(frames[b]));
+      }
+    }
+    catch (...)
+    {
+      fail(std::current_exception());
+    }
+  });
+
+  // stage 2: batched inference on this thread
+  try
+  {
+    torch::NoGradGuard no_grad;
+    std::vector<PreparedFrame> pending;
+    PreparedFrame frame;
+    bool more = true;
+    while (more)
+    {
+      more = prepared.pop(frame);
+      if (more)
+        pending.push_back(std::move(frame));
+
+      if (pending.size() == static_cast<size_t>(options_.batch_size) || (!more && !pending.empty()))
+      {
+        std::vector<torch::Tensor> tensors;
+        tensors.reserve(pending.size());
+        for (auto &p : pending)
+        {
+          tensors.push_back(p.tensor);
+          p.tensor = torch::Tensor();
+        }
+
+        InferredBatch batch;
+        batch.detections = net_.predict(torch::stack(tensors), num_classes_, options_.confidence, options_.nms_conf);
+        batch.frames = std::move(pending);
+        if (!inferred.push(std::move(batch)))
+          break;
+        pending.clear();
+      }
+    }
+  }
+  catch (...)
+  {
+    fail(std::current_exception());
+  }
+  inferred.close();
+
+  source_thread.join();
+  for (auto &w : workers)
+    w.join();
+  post_thread.join();
+  if (failure)
+    std::rethrow_exception(failure);
+
+  auto end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  images_per_second_ = seconds > 0 ? indexed_results.size() / seconds : 0.0;
+
+  std::sort(indexed_results.begin(), indexed_results.end(),
+            [](const std::pair<int64_t, FrameResult> &a, const std::pair<int64_t, FrameResult> &b) {
+              return a.first < b.first;
+            });
+  std::vector<FrameResult> results;
+  results.reserve(indexed_results.size());
+  for (auto &r : indexed_results)
+    results.push_back(std::move(r.second));
+  return results;
+}
+
+std::vector<std::string> DetectionPipeline::list_images(const std::string &path)
+{
+  std::vector<std::string> images;
+  const std::vector<std::string> extensions = {".jpg", ".jpeg", ".png", ".bmp"};
+
+  if (std::filesystem::is_directory(path))
+  {
+    for (const auto &entry : std::filesystem::directory_iterator(path))
+    {
+      std::string ext = entry.path().extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+      if (entry.is_regular_file() && std::find(extensions.begin(), extensions.end(), ext) != extensions.end())
+        images.push_back(entry.path().string());
+    }
+    std::sort(images.begin(), images.end());
+  }
+  else if (std::filesystem::path(path).extension() == ".txt")
+  {
+    std::ifstream fs(path);
+    std::string line;
+    while (std::getline(fs, line))
+    {
+      Config::trim(line);
+      if (line.length())
+        images.push_back(line);
+    }
+  }
+  else
+  {
+    images.push_back(path);
+  }
+  return images;
+}
+
+bool DetectionPipeline::is_video(const std::string &path)
+{
+  std::string ext = std::filesystem::path(path).extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == ".mp4" || ext == ".avi" || ext == ".mov" || ext == ".mkv";
+}
+
+void DetectionPipeline::write_json(const std::vector<FrameResult> &results, const std::string &json_file,
+                                   const std::vector<std::string> &class_names)
+{
+  Json::Value root(Json::arrayValue);
+  for (const auto &frame : results)
+  {
+    Json::Value item;
+    item["image"] = frame.name;
+    item["width"] = frame.width;
+    item["height"] = frame.height;
+    item["detections"] = Json::Value(Json::arrayValue);
+    for (const auto &det : frame.detections)
+    {
+      Json::Value d;
+      d["class_id"] = det.class_id;
+      if (det.class_id >= 0 && det.class_id < static_cast<int>(class_names.size()))
+        d["class"] = class_names[det.class_id];
+      d["score"] = det.class_score;
+      d["objectness"] = det.objectness;
+      Json::Value bbox(Json::arrayValue);
+      bbox.append(det.x1);
+      bbox.append(det.y1);
+      bbox.append(det.x2);
+      bbox.append(det.y2);
+      d["bbox"] = bbox;
+      item["detections"].append(d);
+    }
+    root.append(item);
+  }
+
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "  ";
+  std::unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+  std::ofstream out(json_file);
+  writer->write(root, &out);
+  out << std::endl;
+}
@@ -0,0 +1,155 @@
+#ifndef DETECT_PIPELINE_H_
+#define DETECT_PIPELINE_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+
+#include "darknet.h"
+
+// Bounded multi-producer / multi-consumer queue used between the pipeline stages.
+// pop() returns false once the queue is closed and drained.
+template <typename T>
+class BlockingQueue
+{
+public:
+  explicit BlockingQueue(size_t capacity) : capacity_(capacity) {}
+
+  // returns false (and drops the item) once the queue is closed
+  bool push(T item)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+    if (closed_)
+      return false;
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool pop(T &item)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+    if (items_.empty())
+      return false;
+    item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  // closes and drops the queued items, so that every stage stops at its next pop / push
+  void cancel()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    items_.clear();
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+private:
+  size_t capacity_;
+  bool closed_ = false;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_, not_full_;
+};
+
+struct DetectionPipelineOptions
+{
+  int batch_size = 4;
+  int num_workers = 2;        // decode + letterbox threads
+  size_t queue_capacity = 32;
+  float confidence = 0.6;
+  float nms_conf = 0.4;
+};
+
+// one detection in original image coordinates
+struct Detection
+{
+  float x1, y1, x2, y2;
+  float objectness;
+  float class_score;
+  int class_id;
+};
+
+struct FrameResult
+{
+  std::string name;
+  int width = 0;
+  int height = 0;
+  std::vector<Detection> detections;
+};
+
+// Resizes keeping the aspect ratio and pads to size x size with gray; returns an RGB image.
+cv::Mat letterbox(const cv::Mat &image, int size, float &scale, int &pad_x, int &pad_y);
+
+// Runs Darknet::predict over many images or the frames of a video with three pipelined stages:
+// decode + letterbox in worker threads, batched inference on the calling thread, and mapping
+// of the boxes back to original coordinates in a postprocessing thread.
+class DetectionPipeline
+{
+public:
+  DetectionPipeline(Darknet &net, int num_classes, DetectionPipelineOptions options);
+
+  std::vector<FrameResult> run_images(const std::vector<std::string> &image_paths);
+  std::vector<FrameResult> run_video(const std::string &video_path);
+
+  // images / second of the last run, wall clock from the first decode to the last result
+  double images_per_second() const { return images_per_second_; }
+
+  // a directory (all .jpg/.jpeg/.png/.bmp inside), a text file with one image path per line, or a single image
+  static std::vector<std::string> list_images(const std::string &path);
+  static bool is_video(const std::string &path);
+  static void write_json(const std::vector<FrameResult> &results, const std::string &json_file,
+                         const std::vector<std::string> &class_names);
+
+private:
+  struct RawFrame
+  {
+    int64_t index = 0;
+    std::string name;
+    cv::Mat image;  // empty: decode `name` from disk
+  };
+
+  struct PreparedFrame
+  {
+    int64_t index = 0;
+    std::string name;
+    int width = 0, height = 0;
+    float scale = 1.0;
+    int pad_x = 0, pad_y = 0;
+    torch::Tensor tensor;
+  };
+
+  struct InferredBatch
+  {
+    std::vector<PreparedFrame> frames;
+    torch::Tensor detections;
+  };
+
+  std::vector<FrameResult> run(const std::function<void(BlockingQueue<RawFrame> &)> &source);
+
+  Darknet &net_;
+  int num_classes_;
+  int input_size_;
+  DetectionPipelineOptions options_;
+  double images_per_second_ = 0.0;
+};
+
+#endif
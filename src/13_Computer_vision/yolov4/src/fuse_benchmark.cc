@@ -0,0 +1,91 @@
+#include <iostream>
+#include <torch/torch.h>
+#include <opencv2/opencv.hpp>
+#include <chrono>
+
+#include "darknet.h"
+#include "coco_names.h"
+
+// Compares the plain Darknet model with the BatchNorm-folded, channels-last one on the same
+// image: maximum output difference and average forward latency.
+
+double time_forward(Darknet &net, torch::Tensor input, int warmup, int runs) {
+  for (int i = 0; i < warmup; i++)
+    net.forward(input);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < runs; i++)
+    net.forward(input);
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / runs;
+}
+
+int main(int argc, char* argv[]) {
+
+//  usage: fuse_benchmark <cfg_path> <weight_path> <image path> [runs]
+  std::string cfg_path    = "./src/13_Computer_vision/yolov4/yolov4.cfg";
+  std::string weight_path = "./src/13_Computer_vision/yolov4/yolov4.weights";
+  std::string image_path  = "./data/dogbike.jpg";
+  int runs = 10;
+
+  if (argc >= 4) {
+    cfg_path = argv[1];
+    weight_path = argv[2];
+    image_path = argv[3];
+  }
+  if (argc >= 5) runs = std::atoi(argv[4]);
+
+  torch::Device device(torch::kCPU);
+  torch::NoGradGuard no_grad;
+
+  Darknet reference(cfg_path.c_str(), &device);
+  reference.load_darknet_weights(weight_path.c_str());
+  reference.to(device);
+  reference.eval();
+
+  Darknet fused(cfg_path.c_str(), &device);
+  fused.load_darknet_weights(weight_path.c_str());
+  fused.to(device);
+  fused.eval();
+  fused.fuse_for_inference(true);
+
+  int input_image_size = reference.get_input_size();
+
+  cv::Mat origin_image = cv::imread(image_path), resized_image;
+  if (origin_image.empty()) {
+    std::cerr << "failed to read " << image_path << std::endl;
+    return -1;
+  }
+  cv::cvtColor(origin_image, resized_image, cv::COLOR_BGR2RGB);
+  cv::resize(resized_image, resized_image, { input_image_size , input_image_size });
+
+  auto img_tensor = torch::from_blob(resized_image.data, { resized_image.rows, resized_image.cols, 3 },
+		  	  	  	  	  	  	  	  at::TensorOptions(torch::kByte));
+  img_tensor = img_tensor.permute({ 2, 0, 1 }).unsqueeze(0).to(torch::kFloat).div(255.0).to(device);
+
+  // correctness: raw head outputs (boxes, objectness, class scores) must agree
+  torch::Tensor out_ref = reference.forward(img_tensor);
+  torch::Tensor out_fused = fused.forward(img_tensor);
+  float max_diff = (out_ref - out_fused).abs().max().item<float>();
+  float max_conf_diff = (out_ref.slice(2, 4, out_ref.size(2)) - out_fused.slice(2, 4, out_fused.size(2))).abs().max().item<float>();
+  std::cout << "max |fused - unfused| over all outputs: " << max_diff << '\n';
+  std::cout << "max |fused - unfused| over scores:      " << max_conf_diff << '\n';
+
+  auto det_ref = reference.predict(img_tensor, coco_class_names.size(), 0.6, 0.4);
+  auto det_fused = fused.predict(img_tensor, coco_class_names.size(), 0.6, 0.4);
+  int64_t num_ref = det_ref.dim() == 1 ? 0 : det_ref.size(0);
+  int64_t num_fused = det_fused.dim() == 1 ? 0 : det_fused.size(0);
+  std::cout << "detections unfused: " << num_ref << ", fused: " << num_fused << '\n';
+
+  double t_ref = time_forward(reference, img_tensor, 2, runs);
+  double t_fused = time_forward(fused, img_tensor, 2, runs);
+
+  std::cout << "input " << input_image_size << "x" << input_image_size << ", " << runs << " runs\n";
+  std::cout << "unfused: " << t_ref << " ms/image\n";
+  std::cout << "fused:   " << t_fused << " ms/image\n";
+  std::cout << "speedup: " << t_ref / t_fused << "x\n";
+
+  bool ok = max_conf_diff < 1e-3 && num_ref == num_fused;
+  std::cout << (ok ? "fused model matches" : "fused model DIFFERS") << std::endl;
+  return ok ? 0 : 1;
+}
@@ -23,7 +23,7 @@ int main(int argc, char* argv[]) {
   std::cout << "hello\n";
 
 //  if (argc != 4) {
-//    std::cerr << "usage: yolov4 <cfg_path>, <weight_path> <image path>\n";
+//    std::cerr << "usage: yolov4 <cfg_path>, <weight_path> <image path> [checkpoint.pt]\n";
 //    return -1;
 //  }
   std::string cfg_path    = "./src/13_Computer_vision/yolov4/yolov4.cfg";
@@ -34,15 +34,18 @@ int main(int argc, char* argv[]) {
 
   torch::Device device(device_type);
   std::string cfg_file = cfg_path;
-  if (argc == 4) cfg_file = argv[1];
+  if (argc >= 4) cfg_file = argv[1];
 
   Darknet net(cfg_file.c_str(), &device);
   int input_image_size = net.get_input_size();
 
   std::cout << "loading weight ..." << std::endl;
 
-  if (argc == 4) weight_path = argv[2];
-  net.load_darknet_weights(weight_path.c_str());
+  if (argc >= 4) weight_path = argv[2];
+
+  // optional native checkpoint, (re)converted from the .weights file when that or the cfg changed
+  std::string checkpoint_path = argc == 5 ? argv[4] : "";
+  net.load_weights(weight_path, checkpoint_path);
   std::cout << "weight loaded ..." << std::endl;
 
   cv::Mat origin_image, resized_image;
@@ -50,7 +53,7 @@ int main(int argc, char* argv[]) {
   torch::NoGradGuard no_grad;
   net.eval();
 
-  if (argc == 4) image_path = argv[3];
+  if (argc >= 4) image_path = argv[3];
   origin_image = cv::imread(image_path);
 
   cv::cvtColor(origin_image, resized_image, cv::COLOR_BGR2RGB);
@@ -167,6 +167,54 @@ int main() {
     double min = *min_element(test_mse.begin(), test_mse.end());
     std::cout << "min test mse = " << min << '\n';
 
+    // Top-10 unseen movies for the first users, scored over all items at once
+    TopKRetriever retriever(model->u_emb->weight, model->i_emb->weight);
+    InteractionCSR seen(x_train.index({Slice(), 0}), x_train.index({Slice(), 1}), num_users, num_items);
+    auto top = retriever.recommend(torch::arange(1, 6), 10, &seen);
+    std::cout << "top-10 items of users 1..5:\n" << top.first << '\n';
+
+	// -------------------------------------------------------------
+	// Implicit feedback: BPR with sampled negatives, leave-last-out
+	// -------------------------------------------------------------
+	Interactions interactions = read_ml100k_interactions(file_name, 4);
+	Interactions train_set, test_set;
+	std::tie(train_set, test_set) = leave_last_out_split(interactions);
+	InteractionCSR train_csr = train_set.csr();
+	std::cout << "implicit: " << train_set.size() << " train / " << test_set.size() << " test interactions\n";
+
+	NegativeSampler sampler(train_csr, NegativeSampler::Mode::Popularity);
+	BPRBatches bpr(train_set, sampler, batch_size);
+
+	LFMModel bpr_model = LFMModel(interactions.num_users, interactions.num_items, 20);
+	bpr_model->u_emb->weight.data().normal_(0, 0.1);
+	bpr_model->i_emb->weight.data().normal_(0, 0.1);
+	torch::optim::Adam bpr_optim = torch::optim::Adam(bpr_model->parameters(), 1e-2);
+	std::vector<double> bpr_xx, bpr_hr, bpr_ndcg;
+
+	for(int epoch = 0; epoch < 50; epoch++) {
+		bpr_model->train();
+		double total_loss = 0.;
+		int cnt = 0;
+		torch::Tensor u, pos, neg;
+		for(bpr.reset(); bpr.next(u, pos, neg); cnt++) {
+			auto diff = bpr_model->forward(u, pos) - bpr_model->forward(u, neg);
+			auto l = -torch::log_sigmoid(diff).mean();
+			bpr_optim.zero_grad();
+			l.backward();
+			bpr_optim.step();
+			total_loss += l.item<double>();
+		}
+
+		if( (epoch + 1) % 5 == 0 ) {
+			TopKRetriever retriever(bpr_model->u_emb->weight, bpr_model->i_emb->weight);
+			RankingMetrics m = evaluate_ranking(retriever, test_set, train_csr, 10);
+			printf("BPR epoch = %3d, loss = %.4f, HR@10 = %.4f, NDCG@10 = %.4f\n", epoch + 1, total_loss / cnt, m.hit_rate, m.ndcg);
+			bpr_xx.push_back(epoch + 1.0);
+			bpr_hr.push_back(m.hit_rate);
+			bpr_ndcg.push_back(m.ndcg);
+		}
+	}
+
 	auto F = figure(true);
 	F->size(800, 600);
 	F->add_axes(false);
@@ -182,6 +230,21 @@ int main() {
 	matplot::legend(ax1, {});
 	matplot::show();
 
+	auto F2 = figure(true);
+	F2->size(800, 600);
+	F2->add_axes(false);
+	F2->reactive_mode(false);
+	F2->tiledlayout(1, 1);
+	F2->position(0, 0);
+
+	auto ax2 = F2->nexttile();
+	matplot::hold(ax2, true);
+	matplot::plot(ax2, bpr_xx, bpr_hr, "b-")->line_width(2).display_name("HR@10");
+	matplot::plot(ax2, bpr_xx, bpr_ndcg, "m--")->line_width(2).display_name("NDCG@10");
+	matplot::xlabel(ax2, "epoch");
+	matplot::legend(ax2, {});
+	matplot::show();
+
 	std::cout << "Done!\n";
 }
 
@@ -1,7 +1,10 @@
 #include <torch/utils.h>
 #include "../utils/ch_16_util.h"
+#include "../utils/large_batch.h"
+#include "../utils/sparse_optim.h"
 #include "../utils.h"
 #include "../TempHelpFunctions.hpp"
+#include <chrono>
 
 #include <matplot/matplot.h>
 using namespace matplot;
@@ -43,7 +46,8 @@ TORCH_MODULE(MatrixFactorization);
 
 std::tuple<std::vector<double>, std::vector<double>> train(MatrixFactorization& model, torch::Tensor X_train,
 		torch::Tensor y_train, torch::Tensor X_valid, torch::Tensor y_valid, torch::nn::MSELoss& loss_func,
-		int num_epochs, float learning_rate, float weight_decay, int batch_size, torch::Device device) {
+		int num_epochs, float learning_rate, float weight_decay, int batch_size, torch::Device device,
+		int accumulation_steps = 1, const std::string& optim = "adam", double max_grad_norm = 0.0) {
 	std::vector<double> train_ls, valid_ls;
 
 	auto dataset = LRdataset(X_train, y_train)
@@ -53,11 +57,28 @@ std::tuple<std::vector<double>, std::vector<double>> train(MatrixFactorization&
 		                   std::move(dataset), batch_size);
 
 
-    auto optimizer = torch::optim::Adam(model->parameters(), torch::optim::AdamOptions(learning_rate).weight_decay(weight_decay));
-    //#optimizer = torch.optim.SparseAdam(model.parameters(), lr=learning_rate)
     model->to(device);
+    std::unique_ptr<torch::optim::Optimizer> optimizer;
+    if( model->sparse && optim == "adagrad" )
+    	// one accumulator per embedding row instead of two moments per weight
+    	optimizer = std::make_unique<RowWiseAdagrad>(model->parameters(),
+    					RowWiseAdagradOptions(learning_rate).weight_decay(weight_decay));
+    else if( model->sparse )
+    	// sparse embedding gradients: only the rows of the batch are updated, with lazy weight decay
+    	optimizer = std::make_unique<SparseAdam>(model->parameters(), SparseAdamOptions(learning_rate).weight_decay(weight_decay));
+    else if( optim == "lamb" )
+    	optimizer = std::make_unique<LAMB>(model->parameters(), LAMBOptions(learning_rate).weight_decay(weight_decay));
+    else if( optim == "lars" )
+    	optimizer = std::make_unique<LARS>(model->parameters(), LARSOptions(learning_rate).weight_decay(weight_decay));
+    else
+    	optimizer = std::make_unique<torch::optim::Adam>(model->parameters(),
+    					torch::optim::AdamOptions(learning_rate).weight_decay(weight_decay));
+
+    // effective batch = batch_size * accumulation_steps, gradients clipped to max_grad_norm (0: no clipping)
+    GradientAccumulator accumulator(*optimizer, model->parameters(), accumulation_steps, max_grad_norm);
 
     for(int epoch= 0; epoch < num_epochs; epoch++) {
+        auto epoch_start = std::chrono::high_resolution_clock::now();
         model->train();
         double total_loss = 0.0;
         int total_len =  0;
@@ -69,13 +90,12 @@ std::tuple<std::vector<double>, std::vector<double>> train(MatrixFactorization&
 			auto y = batch.target.to(device);
             auto y_pred = model->forward(x_u, x_i);
             auto l = loss_func(y_pred, y.flatten()).sum();
-            optimizer.zero_grad();
-            l.backward();
-            optimizer.step();
+            accumulator.backward(l);
 
             total_loss += l.data().item<double>();
             total_len += y.size(0);
 		}
+        accumulator.flush();
         train_ls.push_back(total_loss / total_len);
 
         if(X_valid.numel() > 0 ) {
@@ -87,7 +107,11 @@ std::tuple<std::vector<double>, std::vector<double>> train(MatrixFactorization&
             auto valid_loss = loss_func(model(X_valid.index({Slice(), 0}), X_valid.index({Slice(), 0})), y_valid.flatten());
             valid_ls.push_back(valid_loss.data().item<double>() / n);
         }
-        printf("epoch %3d, train mse %.4f, valid mse %.4f\n", epoch + 1, train_ls[epoch], valid_ls[epoch]);
+        double epoch_sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - epoch_start).count();
+        printf("epoch %3d, train mse %.4f, valid mse %.4f, %.2f sec", epoch + 1, train_ls[epoch], valid_ls[epoch], epoch_sec);
+        if( accumulator.last_grad_norm().defined() )
+        	printf(", grad norm %.2f", accumulator.last_grad_norm().item<double>());
+        printf("\n");
     }
     return std::make_tuple(train_ls, valid_ls);
 }
@@ -153,6 +177,51 @@ int main() {
     //printVector(train_ls);
     //printVector(valid_ls);
 
+    // Large effective batch on the same memory: 8 micro-batches of 1024 per LAMB / LARS step, with the
+    // accumulated gradient clipped to a global norm of 10 (the loss is a sum over the batch)
+    MatrixFactorization large_model = MatrixFactorization(30, num_users, num_items, false);
+    std::vector<double> large_train_ls, large_valid_ls;
+    std::tie(large_train_ls, large_valid_ls) = train(large_model, x_train, y_train, x_test, y_test, lsf,
+    		num_epochs, 0.01, weight_decay, batch_size, device, 8, "lamb", 10.0);
+
+    MatrixFactorization lars_model = MatrixFactorization(30, num_users, num_items, false);
+    std::vector<double> lars_train_ls, lars_valid_ls;
+    std::tie(lars_train_ls, lars_valid_ls) = train(lars_model, x_train, y_train, x_test, y_test, lsf,
+    		num_epochs, 0.5, weight_decay, batch_size, device, 8, "lars", 10.0);
+
+    // Sparse embeddings: SparseAdam and row-wise Adagrad touch only the rows of each batch
+    MatrixFactorization sparse_model = MatrixFactorization(30, num_users, num_items, true);
+    std::vector<double> sparse_train_ls, sparse_valid_ls;
+    std::tie(sparse_train_ls, sparse_valid_ls) = train(sparse_model, x_train, y_train, x_test, y_test, lsf,
+    		num_epochs, learning_rate, weight_decay, batch_size, device);
+
+    MatrixFactorization adagrad_model = MatrixFactorization(30, num_users, num_items, true);
+    std::vector<double> adagrad_train_ls, adagrad_valid_ls;
+    std::tie(adagrad_train_ls, adagrad_valid_ls) = train(adagrad_model, x_train, y_train, x_test, y_test, lsf,
+    		num_epochs, 0.05, weight_decay, batch_size, device, 1, "adagrad");
+
+    // Top-K retrieval: the embeddings and biases go into one item matrix, scored per block of users
+    TopKRetriever retriever(model->user_embedding->weight, model->item_embedding->weight,
+    						model->user_bias->weight, model->item_bias->weight);
+    InteractionCSR seen(x_train.index({Slice(), 0}), x_train.index({Slice(), 1}), num_users, num_items);
+    auto top = retriever.recommend(torch::arange(1, 6), 10, &seen);
+    std::cout << "top-10 unseen items of users 1..5:\n" << top.first << '\n';
+
+    // serving scale: top-100 for 10k users over 1M items, 50 seen items each
+    {
+    	int64_t U = 10000, I = 1000000, D = 30;
+    	TopKRetriever big(torch::randn({U, D}), torch::randn({I, D}), torch::randn({U}), torch::randn({I}));
+    	auto su = torch::arange(U).repeat_interleave(50);
+    	auto si = torch::randint(I, {U * 50});
+    	InteractionCSR big_seen(su, si, U, I);
+
+    	auto start = std::chrono::high_resolution_clock::now();
+    	auto rec = big.recommend(torch::arange(U), 100, &big_seen);
+    	auto end = std::chrono::high_resolution_clock::now();
+    	std::cout << "top-100 for " << U << " users over " << I << " items: "
+    			  << std::chrono::duration<double>(end - start).count() << " sec\n";
+    }
+
     std::vector<double> xx;
     for(int i = 1; i <= train_ls.size(); i++)
     	xx.push_back(1.0 * i);
@@ -168,6 +237,11 @@ int main() {
 	matplot::hold(ax1, true);
 	matplot::semilogy(ax1, xx, train_ls, "b-")->line_width(2).display_name("train loss");
 	matplot::semilogy(ax1, xx, valid_ls, "m--")->line_width(2).display_name("valid loss");
+	matplot::semilogy(ax1, xx, large_train_ls, "g-")->line_width(2).display_name("train loss (LAMB, batch 8192)");
+	matplot::semilogy(ax1, xx, large_valid_ls, "r--")->line_width(2).display_name("valid loss (LAMB, batch 8192)");
+	matplot::semilogy(ax1, xx, lars_valid_ls, "c--")->line_width(2).display_name("valid loss (LARS, batch 8192)");
+	matplot::semilogy(ax1, xx, sparse_valid_ls, "k-.")->line_width(2).display_name("valid loss (SparseAdam)");
+	matplot::semilogy(ax1, xx, adagrad_valid_ls, "y-.")->line_width(2).display_name("valid loss (row-wise Adagrad)");
 	matplot::xlabel(ax1, "epoch");
 	matplot::ylabel(ax1, "loss");
 	matplot::legend(ax1, {});
@@ -5,11 +5,7 @@
 #include <cmath>
 #include <bits/stdc++.h>
 #include "../TempHelpFunctions.hpp"
-#include <opencv2/opencv.hpp>
-#include <opencv2/core.hpp>
-#include <opencv2/highgui.hpp>
-#include <opencv2/imgproc.hpp>
-using namespace cv;
+#include "../utils/ch_19_util.h"
 
 template <typename T>
 bool IsEqual(T rhs, T lhs) {
@@ -20,149 +16,12 @@ bool IsEqual(T rhs, T lhs) {
     return diff <= epsilon ;
 }
 
-class Env {
-public:
-	std::vector<std::string> action_space;
-	int n_actions = 0, x1 = 0, y1 = 0, end_game = 0;
-	torch::Tensor migong;
-	Mat frame;
-
-    Env() {
-        action_space = {"u", "d", "l", "r"};
-        n_actions = action_space.size();
-        frame = Mat(300, 300, CV_8UC3, cv::Scalar(255, 255, 255));
-        start_env();
-    }
-
-    std::tuple<int, int> start_env(void) {
-        migong = torch::tensor({{1, 0, 0, 0, 0},
-                       {0, 0, 0, 3, 0},
-                       {0, 0, 0, 0, 0},
-                       {0, 3, 0, 0, 0},
-                       {0, 0, 0, 0, 2}});
-        x1 = 0;
-        y1 = 0;
-        end_game = 0;
-        return std::make_tuple(x1, y1);
-    }
-
-    void display(void) {
-        Mat frameFace = frame.clone();
-
-        for(auto& i : range(5, 0) )  {
-            cv::line(frameFace, {i * 60, 0}, {i * 60, 300}, {0, 0, 0}, 1);
-            cv::line(frameFace, {0, i * 60}, {300, i * 60}, {0, 0, 0}, 1);
-        }
-
-        for(auto& x : range(5, 0)) {
-            for(auto& y : range(5, 0)) {
-                if(migong[y][x].data().item<int>() == 1)
-                    cv::circle(frameFace, {x * 60 + 30, y * 60 + 30}, 25, {255, 0, 0}, -1);
-                if(migong[y][x].data().item<int>() == 2)
-                    cv::circle(frameFace, {x * 60 + 30, y * 60 + 30}, 25, {0, 255, 0}, -1);
-                if(migong[y][x].data().item<int>() == 3)
-                    cv::circle(frameFace, {x * 60 + 30, y * 60 + 30}, 25, {0, 0, 255}, -1);
-            }
-        }
-
-        cv::imshow(" ", frameFace);
-        cv::waitKey(30);
-    }
-
-    std::tuple<int, float, int, int> step(int action) {
-        float r = 0.;
-        // ['u'0, 'd'1, 'l'2, 'r'3]
-        if(action == 0) {
-            if( y1 == 0 ) {
-                r = -0.5;
-            } else {
-                migong[y1][x1] = 0;
-                migong[y1 - 1][x1] = 1;
-                y1 -= 1;
-                if( y1 == 1 && x1 == 3 ) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 3 && x1 == 1) {
-                    end_game = 1;
-                    r = -1;
-                } else if( y1 == 4 && x1 == 4 ) {
-                    end_game = 2;
-                    r = 1;
-                }
-            }
-        }
-        if( action == 1 ) {
-            if(y1 == 4) {
-                r = -0.5;
-            } else {
-                migong[y1][x1] = 0;
-                migong[y1 + 1][x1] = 1;
-                y1 += 1;
-                if(y1 == 1 && x1 == 3 ) {
-                    end_game = 1;
-                    r = -1;
-                } else if( y1 == 3 && x1 == 1) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 4 && x1 == 4) {
-                    end_game = 2;
-                    r = 1;
-                }
-            }
-        }
-
-        if(action == 2) {
-            if(x1 == 0) {
-                r = -0.5;
-            } else {
-                migong[y1][x1] = 0;
-                migong[y1][x1 - 1] = 1;
-                x1 -= 1;
-                if( y1 == 1 && x1 == 3 ) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 3 && x1 == 1) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 4 && x1 == 4) {
-                    end_game = 2;
-                    r = 1;
-                }
-            }
-        }
-
-        if( action == 3 ) {
-            if(x1 == 4) {
-                r = -0.5;
-            } else {
-                migong[y1][x1] = 0;
-                migong[y1][x1 + 1] = 1;
-                x1 += 1;
-                if(y1 == 1 && x1 == 3) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 3 && x1 == 1) {
-                    end_game = 1;
-                    r = -1;
-                } else if(y1 == 4 && x1 == 4) {
-                    end_game = 2;
-                    r = 1;
-                }
-            }
-        }
-
-        return std::make_tuple( end_game, r, x1, y1);
-    }
-};
-
-
-
 class QLearningAgent {
 	std::vector<int> actions;
 	float learning_rate, discount_factor, epsilon;
 	std::map<std::string, std::vector<float>> q_table;
 public:
-	QLearningAgent(std::vector<int> _actions, torch::Tensor migong) {
+	QLearningAgent(std::vector<int> _actions, int row, int col) {
         //['u', 'd', 'l', 'r'] <=> [0, 1, 2, 3]
         actions = _actions;
         learning_rate = 0.01;
@@ -173,9 +32,7 @@ public:
         	q_table.clear();
         }
 
-        std::cout << migong.sizes() << '\n';
-        int row = migong.size(0);
-        int col = migong.size(1);
+        std::cout << "[" << row << ", " << col << "]\n";
         for(int i = 0; i < row; i++) {
         	for(int j = 0; j < col; j++) {
         		std::string state = std::to_string(i) + "_" + std::to_string(j);
@@ -234,38 +91,45 @@ public:
 };
 
 
-int main() {
+int main(int argc, char** argv) {
 	std::cout << "Current path is " << get_current_dir_name() << '\n';
 	torch::manual_seed(123);
 
-	Env env = Env();
-	QLearningAgent agent = QLearningAgent(range(env.n_actions, 0), env.migong);
+	// rendering is opt-in: ./19_Q_learning --render
+	bool render = argc > 1 && std::string(argv[1]) == "--render";
+
+	GridWorldSpec spec;
+	VecGridEnv env(1, spec);
+	QLearningAgent agent = QLearningAgent(range(env.n_actions(), 0), spec.rows, spec.cols);
+	int actions[1] = {0};
 
 	int Failed = 0;
 	int Succeeded = 0;
 	int num_games = 200;
 	for(auto& episode : range(num_games, 0) ) {
-		int x, y;
-	    std::tie(x, y) = env.start_env();
-	    std::string state = std::to_string(x) + "_" + std::to_string(y);
+	    env.reset();
+	    std::string state = std::to_string(env.x(0)) + "_" + std::to_string(env.y(0));
 	    while(true) {
-	        env.display();
+	        if( render )
+	            env.render(0, 30);
 	        // agent generate action
 	        int action = agent.get_action(state);
-	        int done;
-	        float reward;
-	        std::tie(done, reward, x, y) = env.step(action);
-	        std::string next_state = std::to_string(x) + "_" + std::to_string(y);
+	        actions[0] = action;
+	        VecStep step = env.step(torch::from_blob(actions, {1}, torch::kInt));
+	        int64_t done = step.dones.data_ptr<int64_t>()[0];
+	        float reward = step.rewards.data_ptr<float>()[0];
+	        // the position reached by the step, before an automatic reset
+	        std::string next_state = std::to_string(env.final_x(0)) + "_" + std::to_string(env.final_y(0));
 	        // update Q-table
 	        agent.learn(state, action, reward, next_state);
 
 	        // when ends at end, start new game
-	        if( done == 1 || done == 2 ) {
-	            if(done == 1) {
+	        if( done == kTrap || done == kGoal ) {
+	            if(done == kTrap) {
 	                std::cout << "Epoch: " << episode << " reward: " << reward << " Failed\n";
 	                Failed += 1;
 	            }
-	            if(done == 2) {
+	            if(done == kGoal) {
 	            	std::cout << "Epoch: " << episode << " reward: " << reward << " Succeeded\n";
 	                Succeeded += 1;
 	            }
@@ -279,7 +143,3 @@ int main() {
 
 	std::cout << "Done!\n";
 }
-
-
-
-
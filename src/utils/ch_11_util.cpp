@@ -1,32 +1,83 @@
 #include "ch_11_util.h"
+#include <ATen/CPUGeneratorImpl.h>
 #include <string>
+#include <cmath>
 
 std::list<std::pair<torch::Tensor, torch::Tensor>> get_data_ch11(torch::Tensor X,
 																		torch::Tensor Y, int64_t batch_size) {
 
 	int64_t num_examples = X.size(0);
 	std::list<std::pair<torch::Tensor, torch::Tensor>> batched_data;
-	// data index
-	std::vector<int64_t> index;
-	for (int64_t i = 0; i < num_examples; ++i) {
-			index.push_back(i);
+
+	// one gather into shuffled copies, then views of them
+	auto idx = torch::randperm(num_examples, torch::TensorOptions(torch::kLong).device(X.device()));
+	auto X_shuffled = X.index_select(0, idx);
+	auto Y_shuffled = Y.index_select(0, idx.to(Y.device()));
+
+	for (int64_t i = 0; i < num_examples; i += batch_size) {
+		int64_t n = std::min(batch_size, num_examples - i);
+		batched_data.push_back(std::make_pair(X_shuffled.narrow(0, i, n), Y_shuffled.narrow(0, i, n)));
 	}
-	std::random_shuffle(index.begin(), index.end());
+	return batched_data;
+}
 
-	for (int64_t i = 0; i < index.size(); i +=batch_size) {
-		std::vector<int64_t>::const_iterator first = index.begin() + i;
-		std::vector<int64_t>::const_iterator last = index.begin() + std::min(i + batch_size, num_examples);
-		std::vector<int64_t> indices(first, last);
+// -----------------------------------------------------------
+// Lazy minibatches
+// -----------------------------------------------------------
+MinibatchLoader::MinibatchLoader(torch::Tensor X, torch::Tensor Y, int64_t batch_size, bool shuffle,
+								 bool drop_last, uint64_t seed) : X_(X), Y_(Y), batch_size_(batch_size),
+								 shuffle_(shuffle), drop_last_(drop_last), seed_(seed) {
+	TORCH_CHECK(X_.size(0) == Y_.size(0), "MinibatchLoader: X and Y differ in length");
+	TORCH_CHECK(batch_size_ > 0, "MinibatchLoader: batch_size must be positive");
+	if( shuffle_ ) {
+		X_buf_ = torch::empty_like(X_, torch::MemoryFormat::Contiguous);
+		Y_buf_ = torch::empty_like(Y_, torch::MemoryFormat::Contiguous);
+	} else {
+		X_buf_ = X_.contiguous();
+		Y_buf_ = Y_.contiguous();
+	}
+}
 
-		int64_t idx_size = indices.size();
-		torch::Tensor idx = (torch::from_blob(indices.data(), {idx_size}, torch::kInt64)).clone();
+int64_t MinibatchLoader::num_batches() const {
+	int64_t n = X_.size(0);
+	return drop_last_ ? n / batch_size_ : (n + batch_size_ - 1) / batch_size_;
+}
 
-		auto batch_x = X.index_select(0, idx);
-		auto batch_y = Y.index_select(0, idx);
+void MinibatchLoader::permute(int64_t epoch) {
+	if( ! shuffle_ )
+		return;
+	auto gen = at::detail::createCPUGenerator(seed_ + static_cast<uint64_t>(epoch));
+	auto idx = torch::randperm(X_.size(0), gen, torch::kLong);
+	torch::index_select_out(X_buf_, X_, 0, idx.to(X_.device()));
+	torch::index_select_out(Y_buf_, Y_, 0, idx.to(Y_.device()));
+}
 
-		batched_data.push_back(std::make_pair(batch_x, batch_y));
+MinibatchLoader::Iterator MinibatchLoader::begin() {
+	if( ! prepared_ ) {
+		epoch_++;
+		batch_ = 0;
+		permute(epoch_);
 	}
-	return batched_data;
+	prepared_ = false;
+	return Iterator(this, false);
+}
+
+bool MinibatchLoader::next(torch::Tensor& X, torch::Tensor& Y) {
+	if( batch_ >= num_batches() )
+		return false;
+	int64_t start = batch_ * batch_size_;
+	int64_t n = std::min(batch_size_, X_buf_.size(0) - start);
+	X = X_buf_.narrow(0, start, n);
+	Y = Y_buf_.narrow(0, start, n);
+	batch_++;
+	return true;
+}
+
+void MinibatchLoader::seek(int64_t epoch, int64_t batch) {
+	epoch_ = epoch;
+	batch_ = batch;
+	permute(epoch_);
+	prepared_ = true;
 }
 
 double f_2d(double x1, double x2) {
@@ -70,3 +121,172 @@ void show_trace_2d( std::pair<std::vector<double>, std::vector<double>> rlt, std
 		matplot::title(ax, tlt);
 	matplot::show();
 }
+
+// -----------------------------------------------------------
+// Fused scratch optimizers
+// -----------------------------------------------------------
+FusedOptimizer::FusedOptimizer(std::vector<torch::Tensor> params, ScratchAlgorithm algorithm,
+							   OptimHyperParams hyperparams) : params_(params), algorithm_(algorithm), hp_(hyperparams) {
+	TORCH_CHECK(! params_.empty(), "FusedOptimizer: no parameters");
+	int64_t numel = 0;
+	for(auto& p : params_)
+		numel += p.numel();
+
+	auto options = params_[0].options().requires_grad(false);
+	flat_params_ = torch::empty({numel}, options);
+	flat_grads_ = torch::zeros({numel}, options);
+	state1_ = torch::zeros({numel}, options);
+	state2_ = torch::zeros({numel}, options);
+
+	// the parameters and their gradients become views into the flat buffers
+	torch::NoGradGuard no_grad;
+	int64_t offset = 0;
+	for(auto& p : params_) {
+		TORCH_CHECK(p.options().dtype() == options.dtype() && p.device() == options.device(),
+					"FusedOptimizer: parameters must share dtype and device");
+		int64_t n = p.numel();
+		auto view = flat_params_.narrow(0, offset, n).view(p.sizes());
+		view.copy_(p);
+		p.set_data(view);
+
+		auto grad = flat_grads_.narrow(0, offset, n).view(p.sizes());
+		if( p.grad().defined() )
+			grad.copy_(p.grad());
+		p.mutable_grad() = grad;
+		offset += n;
+	}
+}
+
+// Autograd accumulates into existing gradients in place, so they normally stay in the flat buffer;
+// gradients that were replaced (e.g. set to undefined by other code) are copied back.
+void FusedOptimizer::gather_grads() {
+	int64_t offset = 0;
+	for(auto& p : params_) {
+		int64_t n = p.numel();
+		auto slot = flat_grads_.narrow(0, offset, n);
+		auto grad = p.grad();
+		if( ! grad.defined() ) {
+			slot.zero_();
+			p.mutable_grad() = slot.view(p.sizes());
+		} else if( grad.data_ptr() != slot.data_ptr() ) {
+			slot.copy_(grad.reshape({-1}));
+			p.mutable_grad() = slot.view(p.sizes());
+		}
+		offset += n;
+	}
+}
+
+void FusedOptimizer::zero_grad() {
+	flat_grads_.zero_();
+	gather_grads();
+}
+
+void FusedOptimizer::step() {
+	torch::NoGradGuard no_grad;
+	gather_grads();
+	t_++;
+
+	if( flat_params_.device().is_cpu() && flat_params_.scalar_type() == torch::kFloat ) {
+		float* p = flat_params_.data_ptr<float>();
+		const float* g_ = flat_grads_.data_ptr<float>();
+		float* s1 = state1_.data_ptr<float>();
+		float* s2 = state2_.data_ptr<float>();
+		const int64_t n = flat_params_.numel();
+		const float lr = hp_.lr, wd = hp_.weight_decay, eps = hp_.eps;
+
+		switch( algorithm_ ) {
+		case ScratchAlgorithm::SGDMomentum: {
+			const float momentum = hp_.momentum;
+			#pragma omp parallel for simd
+			for(int64_t i = 0; i < n; i++) {
+				float g = wd != 0.0f ? g_[i] + wd * p[i] : g_[i];
+				s1[i] = t_ == 1 ? g : s1[i] * momentum + g;
+				p[i] = p[i] + (-lr) * s1[i];
+			}
+			break;
+		}
+		case ScratchAlgorithm::Adagrad: {
+			#pragma omp parallel for simd
+			for(int64_t i = 0; i < n; i++) {
+				float g = wd != 0.0f ? g_[i] + wd * p[i] : g_[i];
+				s1[i] = s1[i] + g * g;
+				p[i] = p[i] + (-lr) * (g / (std::sqrt(s1[i]) + eps));
+			}
+			break;
+		}
+		case ScratchAlgorithm::RMSProp: {
+			const float alpha = hp_.gamma, one_minus_alpha = 1.0 - hp_.gamma;
+			#pragma omp parallel for simd
+			for(int64_t i = 0; i < n; i++) {
+				float g = wd != 0.0f ? g_[i] + wd * p[i] : g_[i];
+				s1[i] = s1[i] * alpha + one_minus_alpha * g * g;
+				p[i] = p[i] + (-lr) * (g / (std::sqrt(s1[i]) + eps));
+			}
+			break;
+		}
+		case ScratchAlgorithm::Adadelta: {
+			const float rho = hp_.rho, one_minus_rho = 1.0 - hp_.rho;
+			#pragma omp parallel for simd
+			for(int64_t i = 0; i < n; i++) {
+				float g = wd != 0.0f ? g_[i] + wd * p[i] : g_[i];
+				s1[i] = s1[i] * rho + one_minus_rho * g * g;
+				float delta = std::sqrt(s2[i] + eps) / std::sqrt(s1[i] + eps) * g;
+				s2[i] = s2[i] * rho + one_minus_rho * delta * delta;
+				p[i] = p[i] + (-lr) * delta;
+			}
+			break;
+		}
+		case ScratchAlgorithm::Adam: {
+			const float beta1 = hp_.beta1, beta2 = hp_.beta2;
+			const float one_minus_beta1 = 1.0 - hp_.beta1, one_minus_beta2 = 1.0 - hp_.beta2;
+			const double bias_correction1 = 1.0 - std::pow(hp_.beta1, t_);
+			const float bias_correction2_sqrt = std::sqrt(1.0 - std::pow(hp_.beta2, t_));
+			const float step_size = hp_.lr / bias_correction1;
+			#pragma omp parallel for simd
+			for(int64_t i = 0; i < n; i++) {
+				float g = wd != 0.0f ? g_[i] + wd * p[i] : g_[i];
+				s1[i] = s1[i] + one_minus_beta1 * (g - s1[i]);
+				s2[i] = s2[i] * beta2 + one_minus_beta2 * g * g;
+				float denom = std::sqrt(s2[i]) / bias_correction2_sqrt + eps;
+				p[i] = p[i] + (-step_size) * (s1[i] / denom);
+			}
+			break;
+		}
+		}
+		return;
+	}
+
+	// other devices / dtypes: the same updates as in-place tensor ops on the flat buffers
+	auto g = hp_.weight_decay != 0.0 ? flat_grads_ + hp_.weight_decay * flat_params_ : flat_grads_;
+	switch( algorithm_ ) {
+	case ScratchAlgorithm::SGDMomentum:
+		if( t_ == 1 ) state1_.copy_(g);
+		else state1_.mul_(hp_.momentum).add_(g);
+		flat_params_.add_(state1_, -hp_.lr);
+		break;
+	case ScratchAlgorithm::Adagrad:
+		state1_.addcmul_(g, g, 1.0);
+		flat_params_.addcdiv_(g, state1_.sqrt().add_(hp_.eps), -hp_.lr);
+		break;
+	case ScratchAlgorithm::RMSProp:
+		state1_.mul_(hp_.gamma).addcmul_(g, g, 1.0 - hp_.gamma);
+		flat_params_.addcdiv_(g, state1_.sqrt().add_(hp_.eps), -hp_.lr);
+		break;
+	case ScratchAlgorithm::Adadelta: {
+		state1_.mul_(hp_.rho).addcmul_(g, g, 1.0 - hp_.rho);
+		auto delta = state2_.add(hp_.eps).sqrt_().div_(state1_.add(hp_.eps).sqrt_()).mul_(g);
+		state2_.mul_(hp_.rho).addcmul_(delta, delta, 1.0 - hp_.rho);
+		flat_params_.add_(delta, -hp_.lr);
+		break;
+	}
+	case ScratchAlgorithm::Adam: {
+		double bias_correction1 = 1.0 - std::pow(hp_.beta1, t_);
+		double bias_correction2 = 1.0 - std::pow(hp_.beta2, t_);
+		state1_.lerp_(g, 1.0 - hp_.beta1);
+		state2_.mul_(hp_.beta2).addcmul_(g, g, 1.0 - hp_.beta2);
+		auto denom = (state2_.sqrt() / std::sqrt(bias_correction2)).add_(hp_.eps);
+		flat_params_.addcdiv_(state1_, denom, -hp_.lr / bias_correction1);
+		break;
+	}
+	}
+}
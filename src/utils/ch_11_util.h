@@ -24,8 +24,109 @@ using namespace matplot;
 
 std::list<std::pair<torch::Tensor, torch::Tensor>> get_data_ch11(torch::Tensor X, torch::Tensor Y, int64_t batch_size=8);
 
+// Lazy minibatches of (X, Y). Every epoch permutes the data once into persistent contiguous buffers
+// and yields narrow() views of them, so no per-batch gather or allocation happens. Each range-for
+// over the loader is one epoch:
+//
+//	MinibatchLoader data_iter(X, Y, batch_size);
+//	for(int64_t epoch = 0; epoch < num_epochs; epoch++)
+//		for(auto& batch : data_iter) { ... batch.first, batch.second ... }
+//
+// The permutation of epoch e depends only on (seed, e), so seek() resumes an interrupted run with
+// the same batches. The views are overwritten by the next epoch.
+class MinibatchLoader {
+public:
+	MinibatchLoader(torch::Tensor X, torch::Tensor Y, int64_t batch_size, bool shuffle = true,
+					bool drop_last = false, uint64_t seed = 0);
+
+	class Iterator {
+	public:
+		Iterator(MinibatchLoader* loader, bool end) : loader_(loader), end_(end) { if( ! end_ ) advance(); }
+
+		const std::pair<torch::Tensor, torch::Tensor>& operator*() const { return batch_; }
+		const std::pair<torch::Tensor, torch::Tensor>* operator->() const { return &batch_; }
+		Iterator& operator++() { advance(); return *this; }
+		bool operator!=(const Iterator& other) const { return end_ != other.end_; }
+
+	private:
+		void advance() { end_ = ! loader_->next(batch_.first, batch_.second); }
+
+		MinibatchLoader* loader_;
+		bool end_;
+		std::pair<torch::Tensor, torch::Tensor> batch_;
+	};
+
+	// starts the next epoch (or the one prepared by seek())
+	Iterator begin();
+	Iterator end() { return Iterator(this, true); }
+
+	// next batch of the current epoch as views; false at the end of the epoch
+	bool next(torch::Tensor& X, torch::Tensor& Y);
+
+	// continue at batch `batch` of epoch `epoch` (0-based) with the next begin()
+	void seek(int64_t epoch, int64_t batch = 0);
+
+	int64_t num_batches() const;
+	int64_t epoch() const { return epoch_; }
+	int64_t position() const { return batch_; }
+
+private:
+	void permute(int64_t epoch);
+
+	torch::Tensor X_, Y_;
+	torch::Tensor X_buf_, Y_buf_;
+	int64_t batch_size_;
+	bool shuffle_, drop_last_;
+	uint64_t seed_;
+
+	int64_t epoch_ = -1, batch_ = 0;
+	bool prepared_ = false;		// the current epoch was set up by seek() and not iterated yet
+};
+
 double f_2d(double x1, double x2);
 
 void show_trace_2d( std::pair<std::vector<double>, std::vector<double>> rlt, std::string tlt="" );
 
+// Hyperparameters of the scratch optimizers; the defaults are those of torch::optim.
+struct OptimHyperParams {
+	double lr = 0.01;
+	double momentum = 0.9;					// SGD with momentum
+	double gamma = 0.99;					// RMSProp decay (alpha in torch::optim)
+	double rho = 0.9;						// Adadelta
+	double beta1 = 0.9, beta2 = 0.999;		// Adam
+	double eps = 1e-8;
+	double weight_decay = 0.0;				// L2 penalty added to the gradient
+};
+
+enum class ScratchAlgorithm { SGDMomentum, Adagrad, RMSProp, Adadelta, Adam };
+
+// Scratch optimizers applied as one fused pass over all parameters. On construction the parameters,
+// their gradients and the optimizer state are moved into flat contiguous buffers (the parameter
+// tensors become views into them), so a step is a single OpenMP-parallel loop that reads each
+// gradient once and updates state and parameter in place, whatever the number of tensors.
+// The update formulas follow torch::optim element by element.
+class FusedOptimizer {
+public:
+	FusedOptimizer(std::vector<torch::Tensor> params, ScratchAlgorithm algorithm,
+				   OptimHyperParams hyperparams = OptimHyperParams());
+
+	void step();
+	// zeroes the gradients in place, keeping them views into the flat buffer
+	void zero_grad();
+
+	OptimHyperParams& hyperparams() { return hp_; }
+	int64_t step_count() const { return t_; }
+
+private:
+	void gather_grads();
+
+	std::vector<torch::Tensor> params_;
+	ScratchAlgorithm algorithm_;
+	OptimHyperParams hp_;
+	int64_t t_ = 0;
+
+	torch::Tensor flat_params_, flat_grads_;
+	torch::Tensor state1_, state2_;		// momentum / sum of squares / first moment, second moment / delta
+};
+
 #endif /* SRC_UTILS_CH_11_UTIL_H_ */
@@ -3,11 +3,162 @@
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/hal/interface.h>
+#include <array>
+#include <fstream>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// IoU of box (ax1, ay1, ax2, ay2) against boxes stored column-wise in x1, y1, x2, y2 with areas `area2`.
+// `stride1` == 0 compares the same box against all M boxes (pairwise row), 4 walks a packed array
+// of boxes alongside (elementwise).
+template <IoUType type>
+static void iou_kernel(const float* b1, int64_t stride1, const float* x1, const float* y1,
+					   const float* x2, const float* y2, const float* area2, int64_t m, float* out) {
+	#pragma omp simd
+	for(int64_t j = 0; j < m; j++) {
+		const float* a = b1 + j * stride1;
+		float ax1 = a[0], ay1 = a[1], ax2 = a[2], ay2 = a[3];
+		float area1 = (ax2 - ax1) * (ay2 - ay1);
+
+		float iw = std::max(std::min(ax2, x2[j]) - std::max(ax1, x1[j]), 0.0f);
+		float ih = std::max(std::min(ay2, y2[j]) - std::max(ay1, y1[j]), 0.0f);
+		float inter = iw * ih;
+		float union_area = area1 + area2[j] - inter;
+		float iou = inter / union_area;
+
+		if constexpr (type != IoUType::IoU) {
+			// smallest box enclosing both
+			float cw = std::max(ax2, x2[j]) - std::min(ax1, x1[j]);
+			float ch = std::max(ay2, y2[j]) - std::min(ay1, y1[j]);
+			if constexpr (type == IoUType::GIoU) {
+				float c_area = cw * ch;
+				iou -= (c_area - union_area) / c_area;
+			} else {
+				float dx = (ax1 + ax2 - x1[j] - x2[j]) * 0.5f;
+				float dy = (ay1 + ay2 - y1[j] - y2[j]) * 0.5f;
+				iou -= (dx * dx + dy * dy) / (cw * cw + ch * ch);
+			}
+		}
+		out[j] = iou;
+	}
+}
 
+template <IoUType type>
+static void iou_kernel_pairwise(const float* boxes1, int64_t n, const torch::Tensor& cols2, const torch::Tensor& area2,
+								int64_t m, float* out) {
+	const float* c = cols2.data_ptr<float>();
+	const float* a2 = area2.data_ptr<float>();
+
+	#pragma omp parallel for if(n * m > 16384)
+	for(int64_t i = 0; i < n; i++)
+		iou_kernel<type>(boxes1 + i * 4, 0, c, c + m, c + 2 * m, c + 3 * m, a2, m, out + i * m);
+}
+
+static torch::Tensor iou_kernel_input(const torch::Tensor& boxes) {
+	return boxes.reshape({-1, 4}).to(torch::kCPU, torch::kFloat).contiguous();
+}
+
+torch::Tensor box_iou_pairwise(torch::Tensor boxes1, torch::Tensor boxes2, IoUType type) {
+	torch::NoGradGuard no_grad;
+	auto b1 = iou_kernel_input(boxes1);
+	auto b2 = iou_kernel_input(boxes2);
+	int64_t n = b1.size(0), m = b2.size(0);
+
+	// boxes2 as four contiguous columns so the inner loop reads unit-stride memory
+	auto cols2 = b2.t().contiguous();
+	auto area2 = ((cols2[2] - cols2[0]) * (cols2[3] - cols2[1])).contiguous();
+	auto out = torch::empty({n, m}, torch::kFloat);
+
+	switch( type ) {
+	case IoUType::GIoU:
+		iou_kernel_pairwise<IoUType::GIoU>(b1.data_ptr<float>(), n, cols2, area2, m, out.data_ptr<float>());
+		break;
+	case IoUType::DIoU:
+		iou_kernel_pairwise<IoUType::DIoU>(b1.data_ptr<float>(), n, cols2, area2, m, out.data_ptr<float>());
+		break;
+	default:
+		iou_kernel_pairwise<IoUType::IoU>(b1.data_ptr<float>(), n, cols2, area2, m, out.data_ptr<float>());
+	}
+	return out.to(boxes1.device(), boxes1.scalar_type());
+}
+
+torch::Tensor box_iou_elementwise(torch::Tensor boxes1, torch::Tensor boxes2, IoUType type) {
+	torch::NoGradGuard no_grad;
+	auto b1 = iou_kernel_input(boxes1);
+	auto b2 = iou_kernel_input(boxes2);
+	TORCH_CHECK(b1.size(0) == b2.size(0), "box_iou_elementwise: got ", b1.size(0), " and ", b2.size(0), " boxes");
+	int64_t n = b1.size(0);
+
+	auto cols2 = b2.t().contiguous();
+	auto area2 = ((cols2[2] - cols2[0]) * (cols2[3] - cols2[1])).contiguous();
+	auto out = torch::empty({n}, torch::kFloat);
+	const float* c = cols2.data_ptr<float>();
+
+	switch( type ) {
+	case IoUType::GIoU:
+		iou_kernel<IoUType::GIoU>(b1.data_ptr<float>(), 4, c, c + n, c + 2 * n, c + 3 * n,
+								  area2.data_ptr<float>(), n, out.data_ptr<float>());
+		break;
+	case IoUType::DIoU:
+		iou_kernel<IoUType::DIoU>(b1.data_ptr<float>(), 4, c, c + n, c + 2 * n, c + 3 * n,
+								  area2.data_ptr<float>(), n, out.data_ptr<float>());
+		break;
+	default:
+		iou_kernel<IoUType::IoU>(b1.data_ptr<float>(), 4, c, c + n, c + 2 * n, c + 3 * n,
+								 area2.data_ptr<float>(), n, out.data_ptr<float>());
+	}
+	return out.to(boxes1.device(), boxes1.scalar_type());
+}
+
+void box_iou_tiled(torch::Tensor boxes1, torch::Tensor boxes2,
+				   const std::function<void(int64_t, int64_t, const torch::Tensor&)>& fn,
+				   int64_t tile_rows, int64_t tile_cols, IoUType type) {
+	auto b1 = boxes1.reshape({-1, 4});
+	auto b2 = boxes2.reshape({-1, 4});
+	int64_t n = b1.size(0), m = b2.size(0);
+
+	for(int64_t r = 0; r < n; r += tile_rows) {
+		auto rows = b1.narrow(0, r, std::min(tile_rows, n - r));
+		for(int64_t c = 0; c < m; c += tile_cols) {
+			auto tile = box_iou_pairwise(rows, b2.narrow(0, c, std::min(tile_cols, m - c)), type);
+			fn(r, c, tile);
+		}
+	}
+}
+
+std::pair<torch::Tensor, torch::Tensor> box_iou_max(torch::Tensor boxes1, torch::Tensor boxes2,
+				   int64_t tile_rows, int64_t tile_cols, IoUType type) {
+	int64_t n = boxes1.reshape({-1, 4}).size(0);
+	auto best = torch::full({n}, -std::numeric_limits<float>::infinity(), torch::kFloat);
+	auto best_idx = torch::full({n}, -1, torch::kLong);
+
+	box_iou_tiled(boxes1, boxes2, [&](int64_t r, int64_t c, const torch::Tensor& tile) {
+		torch::Tensor tile_max, tile_idx;
+		std::tie(tile_max, tile_idx) = tile.to(torch::kCPU, torch::kFloat).max(1);
+		auto cur = best.narrow(0, r, tile.size(0));
+		auto cur_idx = best_idx.narrow(0, r, tile.size(0));
+		auto better = tile_max > cur;
+		cur.copy_(torch::where(better, tile_max, cur));
+		cur_idx.copy_(torch::where(better, tile_idx + c, cur_idx));
+	}, tile_rows, tile_cols, type);
+
+	return std::make_pair(best.to(boxes1.device()), best_idx.to(boxes1.device()));
+}
 
 // Intersection over Union (IoU)
 torch::Tensor box_iou(torch::Tensor boxes1, torch::Tensor boxes2) {
     //Compute pairwise IoU across two lists of anchor or bounding boxes."""
+	// CPU float boxes without autograd go through the packed kernel
+	if( boxes1.is_cpu() && boxes2.is_cpu() && boxes1.scalar_type() == torch::kFloat &&
+		boxes2.scalar_type() == torch::kFloat && ! (boxes1.requires_grad() || boxes2.requires_grad()) )
+		return box_iou_pairwise(boxes1, boxes2);
+
 	auto box_area = [](torch::Tensor box) noexcept {
 		return (box.index({Slice(), 2}) - box.index({Slice(), 0})) *
 				(box.index({Slice(), 3}) - box.index({Slice(), 1}));
@@ -212,6 +363,224 @@ torch::Tensor multibox_detection(torch::Tensor cls_probs, torch::Tensor offset_p
     return torch::stack(out);
 }
 
+std::pair<torch::Tensor, torch::Tensor> multibox_detection_batched(torch::Tensor cls_probs, torch::Tensor offset_preds,
+								torch::Tensor anchors, float nms_threshold, float pos_threshold,
+								int64_t pre_nms_top_k, int64_t max_detections) {
+	torch::NoGradGuard no_grad;
+	torch::Device device = cls_probs.device();
+	int64_t batch_size = cls_probs.size(0), num_anchors = cls_probs.size(2);
+	anchors = anchors.reshape({-1, 4});
+	offset_preds = offset_preds.reshape({batch_size, num_anchors, 4});
+
+	// Inverse offset transform for every image at once: (1, A, 4) anchors against (B, A, 4) offsets
+	auto anc = box_corner_to_center(anchors).unsqueeze(0);
+	auto anc_xy = anc.index({Ellipsis, Slice(None, 2)});
+	auto anc_wh = anc.index({Ellipsis, Slice(2, None)});
+	auto pred_xy = offset_preds.index({Ellipsis, Slice(None, 2)}) * anc_wh / 10 + anc_xy;
+	auto pred_wh = torch::exp(offset_preds.index({Ellipsis, Slice(2, None)}) / 5) * anc_wh;
+	auto predicted_bb = torch::cat({pred_xy - 0.5 * pred_wh, pred_xy + 0.5 * pred_wh}, -1);
+
+	// Most likely non-background class of every anchor, (B, A)
+	torch::Tensor conf, class_id;
+	std::tie(conf, class_id) = torch::max(cls_probs.index({Slice(), Slice(1, None)}), 1);
+
+	// Only the top-k most confident anchors of each image enter NMS, already sorted by confidence
+	int64_t k = std::min(pre_nms_top_k, num_anchors);
+	torch::Tensor top_conf, top_idx;
+	std::tie(top_conf, top_idx) = torch::topk(conf, k, 1, true, true);
+	auto top_bb = predicted_bb.gather(1, top_idx.unsqueeze(-1).expand({-1, -1, 4}));
+	auto top_class = class_id.gather(1, top_idx);
+
+	// Pairwise IoU inside each image, (B, k, k); boxes of different classes never suppress each other
+	auto area = (top_bb.index({Ellipsis, 2}) - top_bb.index({Ellipsis, 0})) *
+				(top_bb.index({Ellipsis, 3}) - top_bb.index({Ellipsis, 1}));
+	auto upperlefts = torch::max(top_bb.unsqueeze(2).index({Ellipsis, Slice(None, 2)}),
+								 top_bb.unsqueeze(1).index({Ellipsis, Slice(None, 2)}));
+	auto lowerrights = torch::min(top_bb.unsqueeze(2).index({Ellipsis, Slice(2, None)}),
+								  top_bb.unsqueeze(1).index({Ellipsis, Slice(2, None)}));
+	auto inters = (lowerrights - upperlefts).clamp(0);
+	auto inter_areas = inters.index({Ellipsis, 0}) * inters.index({Ellipsis, 1});
+	auto iou = inter_areas / (area.unsqueeze(2) + area.unsqueeze(1) - inter_areas);
+	auto suppress = ((iou > nms_threshold) & (top_class.unsqueeze(2) == top_class.unsqueeze(1))).cpu().contiguous();
+	auto valid = (top_conf >= pos_threshold).cpu().contiguous();
+
+	// Greedy suppression is sequential within an image but independent across images
+	const bool* suppress_ptr = suppress.data_ptr<bool>();
+	const bool* valid_ptr = valid.data_ptr<bool>();
+	torch::Tensor keep_idx = torch::zeros({batch_size, max_detections}, torch::kLong);
+	torch::Tensor counts = torch::zeros({batch_size}, torch::kLong);
+	int64_t* keep_ptr = keep_idx.data_ptr<int64_t>();
+	int64_t* counts_ptr = counts.data_ptr<int64_t>();
+
+	#pragma omp parallel for
+	for(int64_t b = 0; b < batch_size; b++) {
+		const bool* s = suppress_ptr + b * k * k;
+		const bool* v = valid_ptr + b * k;
+		int64_t* kp = keep_ptr + b * max_detections;
+		std::vector<char> removed(k, 0);
+		int64_t n = 0;
+		for(int64_t i = 0; i < k && n < max_detections; i++) {
+			if( ! v[i] || removed[i] ) continue;
+			kp[n++] = i;
+			for(int64_t j = i + 1; j < k; j++)
+				if( s[i * k + j] ) removed[j] = 1;
+		}
+		counts_ptr[b] = n;
+	}
+
+	keep_idx = keep_idx.to(device);
+	counts = counts.to(device);
+	auto padding = torch::arange(max_detections, torch::TensorOptions(torch::kLong).device(device)).unsqueeze(0)
+					>= counts.unsqueeze(1);
+
+	auto out_conf = top_conf.gather(1, keep_idx);
+	auto out_class = top_class.gather(1, keep_idx).to(top_conf.scalar_type());
+	auto out_bb = top_bb.gather(1, keep_idx.unsqueeze(-1).expand({-1, -1, 4}));
+
+	auto pred_info = torch::cat({out_class.unsqueeze(-1), out_conf.unsqueeze(-1), out_bb}, -1);
+	pred_info.masked_fill_(padding.unsqueeze(-1), 0);
+	pred_info.select(2, 0).masked_fill_(padding, -1);
+	return std::make_pair(pred_info, counts);
+}
+MeanAveragePrecision::MeanAveragePrecision(int64_t num_classes, std::vector<float> iou_thresholds,
+										   APInterpolation interpolation) {
+	num_classes_ = num_classes;
+	interpolation_ = interpolation;
+	if( iou_thresholds.empty() ) {
+		for(int i = 0; i < 10; i++)
+			iou_thresholds.push_back(0.5 + 0.05 * i);
+	}
+	iou_thresholds_ = iou_thresholds;
+	reset();
+}
+
+void MeanAveragePrecision::reset() {
+	num_images_ = 0;
+	dets_.assign(num_classes_, {});
+	gts_.assign(num_classes_, {});
+	num_gts_.assign(num_classes_, 0);
+}
+
+void MeanAveragePrecision::update(torch::Tensor predictions, torch::Tensor ground_truth) {
+	auto pred = predictions.detach().to(torch::kCPU, torch::kFloat).contiguous();
+	auto gt = ground_truth.detach().to(torch::kCPU, torch::kFloat).contiguous();
+	if( pred.dim() == 2 ) pred = pred.unsqueeze(0);
+	if( gt.dim() == 2 ) gt = gt.unsqueeze(0);
+	TORCH_CHECK(pred.size(0) == gt.size(0), "MeanAveragePrecision: batch sizes of predictions and ground truth differ");
+
+	auto p = pred.accessor<float, 3>();
+	auto g = gt.accessor<float, 3>();
+	for(int64_t b = 0; b < pred.size(0); b++) {
+		int64_t image = num_images_ + b;
+		for(int64_t k = 0; k < pred.size(1); k++) {
+			int64_t c = static_cast<int64_t>(p[b][k][0]);
+			if( c < 0 || c >= num_classes_ ) continue;
+			dets_[c].push_back({image, p[b][k][1], {p[b][k][2], p[b][k][3], p[b][k][4], p[b][k][5]}});
+		}
+		for(int64_t k = 0; k < gt.size(1); k++) {
+			int64_t c = static_cast<int64_t>(g[b][k][0]);
+			if( c < 0 || c >= num_classes_ ) continue;
+			gts_[c][image].push_back({{g[b][k][1], g[b][k][2], g[b][k][3], g[b][k][4]}});
+			num_gts_[c]++;
+		}
+	}
+	num_images_ += pred.size(0);
+}
+
+static inline float single_box_iou(const float* a, const float* b) {
+	float iw = std::max(std::min(a[2], b[2]) - std::max(a[0], b[0]), 0.0f);
+	float ih = std::max(std::min(a[3], b[3]) - std::max(a[1], b[1]), 0.0f);
+	float inter = iw * ih;
+	float uni = (a[2] - a[0]) * (a[3] - a[1]) + (b[2] - b[0]) * (b[3] - b[1]) - inter;
+	return uni > 0 ? inter / uni : 0.0f;
+}
+
+DetectionEvalResult MeanAveragePrecision::compute() const {
+	int64_t num_thresholds = iou_thresholds_.size();
+	auto ap = torch::full({num_thresholds, num_classes_}, std::numeric_limits<float>::quiet_NaN(), torch::kFloat);
+	float* ap_ptr = ap.data_ptr<float>();
+
+	#pragma omp parallel for schedule(dynamic)
+	for(int64_t c = 0; c < num_classes_; c++) {
+		if( num_gts_[c] == 0 ) continue;
+
+		// detections of this class by decreasing score
+		std::vector<int64_t> order(dets_[c].size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+			return dets_[c][a].score > dets_[c][b].score;
+		});
+
+		for(int64_t t = 0; t < num_thresholds; t++) {
+			float thr = iou_thresholds_[t];
+			std::unordered_map<int64_t, std::vector<char>> matched;
+			for(const auto& kv : gts_[c])
+				matched[kv.first].assign(kv.second.size(), 0);
+
+			std::vector<float> precision(order.size()), recall(order.size());
+			int64_t tp = 0, fp = 0;
+			for(size_t r = 0; r < order.size(); r++) {
+				const Det& d = dets_[c][order[r]];
+				auto it = gts_[c].find(d.image);
+				int64_t best = -1;
+				float best_iou = thr;
+				if( it != gts_[c].end() ) {
+					std::vector<char>& used = matched[d.image];
+					for(size_t j = 0; j < it->second.size(); j++) {
+						if( used[j] ) continue;
+						float iou = single_box_iou(d.box, it->second[j].box);
+						if( iou >= best_iou ) {
+							best_iou = iou;
+							best = j;
+						}
+					}
+					if( best >= 0 ) used[best] = 1;
+				}
+				if( best >= 0 ) tp++; else fp++;
+				precision[r] = static_cast<float>(tp) / (tp + fp);
+				recall[r] = static_cast<float>(tp) / num_gts_[c];
+			}
+
+			// make precision monotonically decreasing from the right
+			for(int64_t r = static_cast<int64_t>(precision.size()) - 2; r >= 0; r--)
+				precision[r] = std::max(precision[r], precision[r + 1]);
+
+			float value = 0.0;
+			if( interpolation_ == APInterpolation::COCO101 ) {
+				size_t r = 0;
+				for(int i = 0; i <= 100; i++) {
+					float level = i / 100.0f;
+					while( r < recall.size() && recall[r] < level ) r++;
+					value += r < recall.size() ? precision[r] : 0.0f;
+				}
+				value /= 101.0f;
+			} else {
+				float prev_recall = 0.0;
+				for(size_t r = 0; r < recall.size(); r++) {
+					value += (recall[r] - prev_recall) * precision[r];
+					prev_recall = recall[r];
+				}
+			}
+			ap_ptr[t * num_classes_ + c] = value;
+		}
+	}
+
+	DetectionEvalResult result;
+	result.iou_thresholds = iou_thresholds_;
+	result.ap = ap;
+	auto valid = ~torch::isnan(ap);
+	if( valid.any().item<bool>() )
+		result.map = ap.masked_select(valid).mean().item<float>();
+
+	result.map50 = std::numeric_limits<float>::quiet_NaN();
+	for(size_t t = 0; t < iou_thresholds_.size(); t++) {
+		if( std::abs(iou_thresholds_[t] - 0.5f) < 1e-6f ) {
+			result.map50 = valid[t].any().item<bool>() ? ap[t].masked_select(valid[t]).mean().item<float>() : 0.0f;
+			break;
+		}
+	}
+	return result;
+}
 
 void ShowManyImages(std::string title, std::vector<cv::Mat> imgs) {
 	int size;
@@ -413,6 +782,59 @@ torch::Tensor multibox_prior(torch::Tensor data, std::vector<float> sizes, std::
     return output.unsqueeze(0);
 }
 
+AnchorGenerator::AnchorGenerator(std::vector<std::vector<float>> sizes, std::vector<std::vector<float>> ratios) {
+	TORCH_CHECK(sizes.size() == ratios.size(), "AnchorGenerator: sizes and ratios must have one entry per scale");
+	sizes_ = sizes;
+	ratios_ = ratios;
+}
+
+AnchorGenerator::Key AnchorGenerator::make_key(const torch::Tensor& data, int64_t scale) const {
+	return std::make_tuple(scale, data.size(2), data.size(3),
+						   static_cast<int>(data.device().type()), static_cast<int>(data.device().index()),
+						   static_cast<int>(data.scalar_type()));
+}
+
+torch::Tensor AnchorGenerator::operator()(const torch::Tensor& data, size_t scale) {
+	TORCH_CHECK(scale < sizes_.size(), "AnchorGenerator: scale ", scale, " out of range");
+
+	Key key = make_key(data, scale);
+	auto it = anchors_.find(key);
+	if( it != anchors_.end() )
+		return it->second;
+
+	torch::NoGradGuard no_grad;
+	torch::Tensor anchors = multibox_prior(data, sizes_[scale], ratios_[scale]).to(data.scalar_type()).contiguous();
+	anchors_.emplace(key, anchors);
+	return anchors;
+}
+
+torch::Tensor AnchorGenerator::generate(const std::vector<torch::Tensor>& feature_maps) {
+	TORCH_CHECK(feature_maps.size() == sizes_.size(), "AnchorGenerator: expected ", sizes_.size(),
+				" feature maps, got ", feature_maps.size());
+
+	std::vector<Key> keys;
+	for(size_t i = 0; i < feature_maps.size(); i++)
+		keys.push_back(make_key(feature_maps[i], i));
+
+	auto it = concatenated_.find(keys);
+	if( it != concatenated_.end() )
+		return it->second;
+
+	std::vector<torch::Tensor> anchors;
+	for(size_t i = 0; i < feature_maps.size(); i++)
+		anchors.push_back((*this)(feature_maps[i], i));
+
+	// torch::cat writes every scale into a single freshly allocated, contiguous buffer
+	torch::Tensor output = torch::cat(anchors, 1);
+	concatenated_.emplace(keys, output);
+	return output;
+}
+
+void AnchorGenerator::clear() {
+	anchors_.clear();
+	concatenated_.clear();
+}
+
 //In order to [show all the anchor boxes centered on one pixel in the image],
 //we define the following show_bboxes function to draw multiple bounding boxes on the image.
 
@@ -1032,6 +1454,275 @@ torch::Tensor decode_segmap(torch::Tensor pred, int nc) {
 }
 
 // DATA_URL = 'http://d2l-data.s3-accelerate.amazonaws.com/'
+TestTimeAugmentation::TestTimeAugmentation(std::function<torch::Tensor(const torch::Tensor&)> model,
+		TTAOptions options) : model_(model), options_(options) {
+	// theta maps output coordinates to input coordinates in [-1, 1]: (s, tx, ty)
+	std::vector<std::array<double, 3>> transforms = {{1.0, 0.0, 0.0}};
+
+	if( options_.crop_fraction > 0.0 ) {
+		double f = options_.crop_fraction, d = 1.0 - f;
+		for(auto& t : std::vector<std::array<double, 2>>{{-d, -d}, {d, -d}, {-d, d}, {d, d}, {0.0, 0.0}})
+			transforms.push_back({f, t[0], t[1]});
+	}
+	for(auto scale : options_.scales)
+		transforms.push_back({1.0 / scale, 0.0, 0.0});
+
+	std::vector<float> data;
+	for(int flip = 0; flip < (options_.hflip ? 2 : 1); flip++)
+		for(auto& t : transforms) {
+			float sx = flip ? -t[0] : t[0];
+			std::vector<float> theta = {sx, 0.0f, static_cast<float>(t[1]), 0.0f, static_cast<float>(t[0]), static_cast<float>(t[2])};
+			data.insert(data.end(), theta.begin(), theta.end());
+		}
+
+	int64_t V = data.size() / 6;
+	thetas_ = torch::from_blob(data.data(), {V, 2, 3}, torch::kFloat).clone();
+}
+
+torch::Tensor TestTimeAugmentation::views(const torch::Tensor& X) const {
+	int64_t V = num_views(), B = X.size(0);
+	auto theta = thetas_.to(X.device(), X.scalar_type()).repeat_interleave(B, 0);	// (V * B, 2, 3)
+	auto Xr = X.unsqueeze(0).expand({V, B, X.size(1), X.size(2), X.size(3)})
+				.reshape({V * B, X.size(1), X.size(2), X.size(3)});
+
+	auto grid = torch::nn::functional::affine_grid(theta, {V * B, X.size(1), X.size(2), X.size(3)}, false);
+	return torch::nn::functional::grid_sample(Xr, grid, torch::nn::functional::GridSampleFuncOptions()
+				.mode(torch::kBilinear).padding_mode(torch::kReflection).align_corners(false));
+}
+
+torch::Tensor TestTimeAugmentation::forward(const torch::Tensor& X) {
+	torch::NoGradGuard no_grad;
+	int64_t V = num_views(), B = X.size(0);
+
+	torch::Tensor out = model_(V == 1 ? X : views(X));
+	if( options_.average_probs )
+		out = torch::softmax(out, -1);
+	return out.view({V, B, -1}).mean(0);
+}
+
+static const char feature_cache_magic[8] = {'D', '2', 'L', 'F', 'E', 'A', 'T', '2'};
+static const size_t feature_cache_header = sizeof(feature_cache_magic) + 4 * sizeof(int64_t);
+
+uint64_t FeatureCache::make_key(const std::string& description) {
+	// FNV-1a: unlike std::hash, the same on every build
+	uint64_t h = 14695981039346656037ULL;
+	for(unsigned char c : description) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+bool FeatureCache::is_current(const std::string& path, uint64_t key) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[sizeof(feature_cache_magic)];
+	int64_t header[4];
+	if( ! in.read(magic, sizeof(magic)) || ! in.read(reinterpret_cast<char*>(header), sizeof(header)) )
+		return false;
+	return std::memcmp(magic, feature_cache_magic, sizeof(magic)) == 0 && static_cast<uint64_t>(header[3]) == key;
+}
+
+void FeatureCache::build(const std::string& path,
+						 const std::function<torch::Tensor(const torch::Tensor&)>& backbone,
+						 const std::function<bool(torch::Tensor&, torch::Tensor&)>& next_batch,
+						 const std::vector<std::function<torch::Tensor(const torch::Tensor&)>>& views,
+						 uint64_t key) {
+	torch::NoGradGuard no_grad;
+
+	// written next to `path` and renamed into place once complete, so an interrupted build never
+	// leaves a truncated file behind that is_current() would accept
+	const std::string tmp = path + ".tmp";
+	std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+	if( ! out )
+		throw std::runtime_error("FeatureCache: cannot write " + tmp);
+
+	// the header is rewritten with the final sizes and the key once the dataset has been consumed
+	int64_t num_samples = 0, num_views = views.empty() ? 1 : views.size(), feature_dim = 0;
+	int64_t header[4] = {0, 0, 0, 0};
+	out.write(feature_cache_magic, sizeof(feature_cache_magic));
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	std::vector<int64_t> labels;
+	torch::Tensor images, targets;
+	while( next_batch(images, targets) ) {
+		std::vector<torch::Tensor> feats;
+		if( views.empty() ) {
+			feats.push_back(backbone(images).flatten(1));
+		} else {
+			for(auto& view : views)
+				feats.push_back(backbone(view(images)).flatten(1));
+		}
+		// (B, V, D)
+		auto batch = torch::stack(feats, 1).to(torch::kCPU, torch::kFloat).contiguous();
+		if( feature_dim == 0 )
+			feature_dim = batch.size(2);
+		TORCH_CHECK(batch.size(2) == feature_dim, "FeatureCache: feature size changed between batches");
+
+		out.write(reinterpret_cast<const char*>(batch.data_ptr<float>()), batch.numel() * sizeof(float));
+
+		auto t = targets.to(torch::kCPU, torch::kLong).contiguous();
+		labels.insert(labels.end(), t.data_ptr<int64_t>(), t.data_ptr<int64_t>() + t.numel());
+		num_samples += batch.size(0);
+	}
+
+	// keep the labels 8 byte aligned in the mapping
+	size_t feature_bytes = num_samples * num_views * feature_dim * sizeof(float);
+	if( feature_bytes % sizeof(int64_t) ) {
+		char pad[sizeof(int64_t)] = {0};
+		out.write(pad, sizeof(int64_t) - feature_bytes % sizeof(int64_t));
+	}
+	out.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(int64_t));
+
+	header[0] = num_samples;
+	header[1] = num_views;
+	header[2] = feature_dim;
+	header[3] = static_cast<int64_t>(key);
+	out.seekp(sizeof(feature_cache_magic));
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+	out.close();
+	if( ! out )
+		throw std::runtime_error("FeatureCache: failed writing " + tmp);
+	if( std::rename(tmp.c_str(), path.c_str()) != 0 )
+		throw std::runtime_error("FeatureCache: cannot rename " + tmp + " to " + path);
+}
+
+FeatureCache::FeatureCache(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if( fd < 0 )
+		throw std::runtime_error("FeatureCache: cannot open " + path);
+
+	struct stat st;
+	if( fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(feature_cache_header) ) {
+		close(fd);
+		throw std::runtime_error("FeatureCache: invalid cache file " + path);
+	}
+	length_ = st.st_size;
+	data_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if( data_ == MAP_FAILED ) {
+		data_ = nullptr;
+		throw std::runtime_error("FeatureCache: cannot map " + path);
+	}
+
+	const char* base = static_cast<const char*>(data_);
+	const int64_t* header = reinterpret_cast<const int64_t*>(base + sizeof(feature_cache_magic));
+	int64_t N = header[0], V = header[1], D = header[2];
+	key_ = static_cast<uint64_t>(header[3]);
+
+	size_t feature_bytes = N * V * D * sizeof(float);
+	size_t label_offset = feature_cache_header + (feature_bytes + sizeof(int64_t) - 1) / sizeof(int64_t) * sizeof(int64_t);
+	if( std::memcmp(base, feature_cache_magic, sizeof(feature_cache_magic)) != 0
+			|| label_offset + N * sizeof(int64_t) != length_ ) {
+		munmap(data_, length_);
+		data_ = nullptr;
+		throw std::runtime_error("FeatureCache: corrupt cache file " + path);
+	}
+
+	// the mapping is read-only: the tensors must not be modified in place
+	features_ = torch::from_blob(const_cast<char*>(base) + feature_cache_header, {N, V, D}, torch::kFloat);
+	labels_ = torch::from_blob(const_cast<char*>(base) + label_offset, {N}, torch::kLong);
+	madvise(data_, length_, MADV_WILLNEED);
+}
+
+FeatureCache::~FeatureCache() {
+	features_ = torch::Tensor();
+	labels_ = torch::Tensor();
+	if( data_ )
+		munmap(data_, length_);
+}
+
+std::pair<torch::Tensor, torch::Tensor> FeatureCache::batch(const torch::Tensor& indices, bool random_view) const {
+	auto idx = indices.to(torch::kLong);
+	torch::Tensor view = random_view && num_views() > 1 ? torch::randint(num_views(), {idx.size(0)}, torch::kLong)
+														 : torch::zeros({idx.size(0)}, torch::kLong);
+	return std::make_pair(features_.index({idx, view}), labels_.index_select(0, idx));
+}
+
+torch::Tensor segment_tiled(const std::function<torch::Tensor(const torch::Tensor&)>& model, torch::Tensor image,
+							TiledSegmentationOptions options,
+							const std::function<torch::Tensor(const torch::Tensor&)>& preprocess) {
+	torch::NoGradGuard no_grad;
+	int64_t H = image.size(1), W = image.size(2);
+	int64_t th = options.tile_height, tw = options.tile_width;
+
+	// images smaller than one tile are padded at the bottom / right
+	int64_t PH = std::max(H, th), PW = std::max(W, tw);
+	if( PH != H || PW != W )
+		image = torch::constant_pad_nd(image, {0, PW - W, 0, PH - H}, 0);
+
+	// tile origins along one axis; the last tile is aligned to the image border
+	auto tile_starts = [](int64_t size, int64_t tile, int64_t stride) {
+		std::vector<int64_t> starts;
+		for(int64_t p = 0; ; p += stride) {
+			if( p + tile >= size ) {
+				starts.push_back(size - tile);
+				break;
+			}
+			starts.push_back(p);
+		}
+		return starts;
+	};
+	std::vector<int64_t> ys = tile_starts(PH, th, std::max<int64_t>(th - options.overlap, 1));
+	std::vector<int64_t> xs = tile_starts(PW, tw, std::max<int64_t>(tw - options.overlap, 1));
+
+	// blending weight, 1 in the tile interior and ramping down over `overlap` pixels at the borders
+	auto ramp = [&options](int64_t n) {
+		auto i = torch::arange(n, torch::kFloat);
+		return (torch::min(i + 1, n - i) / static_cast<float>(options.overlap + 1)).clamp_max(1.0);
+	};
+	torch::Tensor window = ramp(th).unsqueeze(1) * ramp(tw).unsqueeze(0);
+
+	torch::Tensor labels = torch::empty({PH, PW}, torch::kLong);
+	torch::Tensor acc, weights;		// current band: (C, th, PW) weighted logits and (th, PW) weight sums
+	int64_t band_y = 0;
+
+	// rows [0, n) of the band are covered by no further tile: blend and write them out
+	auto flush = [&](int64_t n) {
+		auto blended = acc.narrow(1, 0, n) / weights.narrow(0, 0, n).clamp_min(1e-8);
+		labels.narrow(0, band_y, n).copy_(blended.argmax(0));
+	};
+
+	for(size_t r = 0; r < ys.size(); r++) {
+		int64_t y = ys[r];
+		if( acc.defined() && y > band_y ) {
+			int64_t done = y - band_y;
+			flush(done);
+			int64_t keep = th - done;
+			if( keep > 0 ) {
+				acc.narrow(1, 0, keep).copy_(acc.narrow(1, done, keep).clone());
+				weights.narrow(0, 0, keep).copy_(weights.narrow(0, done, keep).clone());
+			}
+			acc.narrow(1, keep, done).zero_();
+			weights.narrow(0, keep, done).zero_();
+			band_y = y;
+		}
+
+		for(size_t c0 = 0; c0 < xs.size(); c0 += options.batch_size) {
+			int64_t n = std::min<int64_t>(options.batch_size, xs.size() - c0);
+			std::vector<torch::Tensor> tiles(n);
+
+			#pragma omp parallel for num_threads(options.num_threads) if(options.num_threads > 1)
+			for(int64_t i = 0; i < n; i++) {
+				auto tile = image.index({Slice(), Slice(y, y + th), Slice(xs[c0 + i], xs[c0 + i] + tw)});
+				tiles[i] = preprocess ? preprocess(tile) : tile.contiguous();
+			}
+
+			torch::Tensor logits = model(torch::stack(tiles)).to(torch::kCPU, torch::kFloat);
+			if( ! acc.defined() ) {
+				acc = torch::zeros({logits.size(1), th, PW}, torch::kFloat);
+				weights = torch::zeros({th, PW}, torch::kFloat);
+			}
+			for(int64_t i = 0; i < n; i++) {
+				acc.narrow(2, xs[c0 + i], tw).add_(logits[i] * window);
+				weights.narrow(1, xs[c0 + i], tw).add_(window);
+			}
+		}
+	}
+	flush(PH - band_y);
+
+	return labels.narrow(0, 0, H).narrow(1, 0, W);
+}
+
 std::vector<std::pair<std::string, torch::Tensor>> load_bananas_img_data(
 		const std::string data_dir,  bool is_train, int imgSize) {
     //Read the banana detection dataset images and labels
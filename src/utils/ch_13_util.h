@@ -12,6 +12,8 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <functional>
 #include <chrono>
 #include <random>
 
@@ -27,6 +29,29 @@ using torch::indexing::Ellipsis;
 
 torch::Tensor box_iou(torch::Tensor boxes1, torch::Tensor boxes2);
 
+// Overlap measures of the IoU kernels. GIoU subtracts the share of the smallest enclosing box not
+// covered by the union, DIoU the squared center distance normalised by the enclosing box diagonal.
+enum class IoUType { IoU, GIoU, DIoU };
+
+// IoU kernels over packed (x1, y1, x2, y2) boxes. They run a vectorised loop over float buffers
+// on the CPU (auto-vectorised to AVX2 when compiled with -mavx2); other devices / dtypes are
+// copied to CPU float and the result is moved back.
+// Pairwise: (N, 4) x (M, 4) -> (N, M)
+torch::Tensor box_iou_pairwise(torch::Tensor boxes1, torch::Tensor boxes2, IoUType type=IoUType::IoU);
+
+// Elementwise: (N, 4) x (N, 4) -> (N,), overlap of boxes1[i] with boxes2[i]
+torch::Tensor box_iou_elementwise(torch::Tensor boxes1, torch::Tensor boxes2, IoUType type=IoUType::IoU);
+
+// Tiled pairwise IoU for very large N x M: the full matrix is never materialised, `fn` gets each
+// (row offset, column offset, tile) block with tiles of at most tile_rows x tile_cols.
+void box_iou_tiled(torch::Tensor boxes1, torch::Tensor boxes2,
+				   const std::function<void(int64_t, int64_t, const torch::Tensor&)>& fn,
+				   int64_t tile_rows=1024, int64_t tile_cols=4096, IoUType type=IoUType::IoU);
+
+// Best match of every box in boxes1 among boxes2 (max IoU and its index), computed tile by tile.
+std::pair<torch::Tensor, torch::Tensor> box_iou_max(torch::Tensor boxes1, torch::Tensor boxes2,
+				   int64_t tile_rows=1024, int64_t tile_cols=4096, IoUType type=IoUType::IoU);
+
 torch::Tensor assign_anchor_to_bbox(torch::Tensor ground_truth, torch::Tensor anchors,
 													torch::Device device, float iou_threshold=0.5);
 
@@ -41,6 +66,60 @@ torch::Tensor nms(torch::Tensor boxes, torch::Tensor scores, float iou_threshold
 torch::Tensor multibox_detection(torch::Tensor cls_probs, torch::Tensor offset_preds, torch::Tensor anchors,
 								float nms_threshold=0.5, float pos_threshold=0.009999999);
 
+// Batched variant of multibox_detection: decodes the offsets of all images at once, keeps the
+// pre_nms_top_k most confident anchors per image and runs a class-aware NMS over them.
+// Returns a (batch, max_detections, 6) tensor of (class id, confidence, x1, y1, x2, y2) rows sorted
+// by confidence and padded with class id -1, plus the number of valid rows per image.
+std::pair<torch::Tensor, torch::Tensor> multibox_detection_batched(torch::Tensor cls_probs, torch::Tensor offset_preds,
+								torch::Tensor anchors, float nms_threshold=0.5, float pos_threshold=0.009999999,
+								int64_t pre_nms_top_k=400, int64_t max_detections=100);
+
+// COCO / VOC style mean average precision over a detection dataset. Predictions are accumulated
+// batch by batch with update(); compute() sorts and matches every class in parallel and returns AP
+// for each IoU threshold.
+enum class APInterpolation { AllPoints, COCO101 };
+
+struct DetectionEvalResult {
+	std::vector<float> iou_thresholds;
+	torch::Tensor ap;			// (num thresholds, num classes), NaN for classes without ground truth
+	float map = 0.0;			// mean over thresholds and classes with ground truth
+	float map50 = 0.0;			// mean over classes at IoU 0.5, NaN when 0.5 is not a threshold
+};
+
+class MeanAveragePrecision {
+public:
+	// iou_thresholds empty: COCO thresholds 0.50:0.05:0.95
+	MeanAveragePrecision(int64_t num_classes, std::vector<float> iou_thresholds = {},
+						 APInterpolation interpolation = APInterpolation::COCO101);
+
+	// predictions: (B, K, 6) rows of (class id, score, x1, y1, x2, y2), class id < 0 marks padding,
+	//              e.g. the output of multibox_detection_batched
+	// ground_truth: (B, G, 5) rows of (class id, x1, y1, x2, y2), class id < 0 marks padding
+	void update(torch::Tensor predictions, torch::Tensor ground_truth);
+
+	DetectionEvalResult compute() const;
+	void reset();
+
+private:
+	struct Det {
+		int64_t image;
+		float score;
+		float box[4];
+	};
+	struct GtBox {
+		float box[4];
+	};
+
+	int64_t num_classes_;
+	std::vector<float> iou_thresholds_;
+	APInterpolation interpolation_;
+	int64_t num_images_ = 0;
+	// per class: detections, and ground truth boxes grouped by image
+	std::vector<std::vector<Det>> dets_;
+	std::vector<std::unordered_map<int64_t, std::vector<GtBox>>> gts_;
+	std::vector<int64_t> num_gts_;
+};
+
 std::pair<cv::Mat, torch::Tensor> readImg( std::string filename, std::vector<int> imgSize = {} );
 
 torch::Tensor box_corner_to_center(torch::Tensor boxes);
@@ -49,6 +128,35 @@ torch::Tensor box_center_to_corner(torch::Tensor boxes);
 
 torch::Tensor multibox_prior(torch::Tensor data, std::vector<float> sizes, std::vector<float> ratios);
 
+// Anchors only depend on (H, W, sizes, ratios), so AnchorGenerator builds them once with
+// multibox_prior() per (scale, H, W, device, dtype) and hands back the cached tensor afterwards.
+// Returned tensors are shared with the cache and must not be modified in place.
+class AnchorGenerator {
+public:
+	AnchorGenerator() {}
+	AnchorGenerator(std::vector<std::vector<float>> sizes, std::vector<std::vector<float>> ratios);
+
+	// Anchors of scale `scale` for the feature map `data` (N x C x H x W), shape (1, H*W*boxes_per_pixel, 4)
+	torch::Tensor operator()(const torch::Tensor& data, size_t scale);
+
+	// Anchors of all scales concatenated in one contiguous tensor, one feature map per scale
+	torch::Tensor generate(const std::vector<torch::Tensor>& feature_maps);
+
+	size_t num_scales() const { return sizes_.size(); }
+	int64_t boxes_per_pixel(size_t scale) const { return sizes_[scale].size() + ratios_[scale].size() - 1; }
+	void clear();
+
+private:
+	// (scale, H, W, device type, device index, dtype)
+	using Key = std::tuple<int64_t, int64_t, int64_t, int, int, int>;
+
+	Key make_key(const torch::Tensor& data, int64_t scale) const;
+
+	std::vector<std::vector<float>> sizes_, ratios_;
+	std::map<Key, torch::Tensor> anchors_;
+	std::map<std::vector<Key>, torch::Tensor> concatenated_;
+};
+
 void setLabel(cv::Mat& im, std::string label, cv::Scalar text_color, cv::Scalar text_bk_color, const cv::Point& pt);
 
 void show_bboxes(cv::Mat& img, torch::Tensor bboxes, std::vector<std::string> labels, std::vector<cv::Scalar> colors, int lineWidth=1);
@@ -111,6 +219,25 @@ torch::Tensor voc_label_indices(torch::Tensor colormap, std::unordered_map<std::
 
 torch::Tensor decode_segmap(torch::Tensor pred, int nc);
 
+// Tiled inference for semantic segmentation of images larger than the model can take at once.
+// Tiles overlap by `overlap` pixels; their logits are blended with a weight that ramps down towards
+// the tile borders. Only one band of tile rows is accumulated at a time, so peak memory grows with
+// tile_height x image width instead of the full image.
+struct TiledSegmentationOptions {
+	int64_t tile_height = 320;
+	int64_t tile_width = 480;
+	int64_t overlap = 64;
+	int64_t batch_size = 4;		// tiles per forward pass
+	int num_threads = 1;		// threads for tile preprocessing
+};
+
+// image: (3, H, W); model maps (B, 3, tile_height, tile_width) to (B, num_classes, tile_height, tile_width);
+// preprocess (optional) is applied to every (3, tile_height, tile_width) tile before batching.
+// Returns the (H, W) class index map.
+torch::Tensor segment_tiled(const std::function<torch::Tensor(const torch::Tensor&)>& model, torch::Tensor image,
+							TiledSegmentationOptions options = TiledSegmentationOptions(),
+							const std::function<torch::Tensor(const torch::Tensor&)>& preprocess = nullptr);
+
 // Randomly crop both feature and label images.
 std::pair<torch::Tensor, torch::Tensor> voc_rand_crop(torch::Tensor feature, torch::Tensor label,
 		int height, int width, std::vector<float> mean_, std::vector<float> std_, bool toRGB = true);
@@ -120,6 +247,80 @@ std::vector<std::pair<std::string, torch::Tensor>> load_bananas_img_data(const s
 using VocData = std::vector<std::pair<std::string, std::string>>;
 using Example = torch::data::Example<>;
 
+// Test-time augmentation for image classifiers. Every view (identity, corner / center crops and
+// zooms, each optionally mirrored) is an affine transform, so all views of a batch are produced by
+// one affine_grid + grid_sample call and classified in a single forward pass.
+struct TTAOptions {
+	bool hflip = true;				// add the mirrored version of every view
+	double crop_fraction = 0.0;		// > 0: add four corner crops and a center crop of this fraction of each side
+	std::vector<double> scales;		// zoom factors of extra views (> 1 zooms in, < 1 zooms out)
+	bool average_probs = false;		// average softmax probabilities instead of logits
+};
+
+class TestTimeAugmentation {
+public:
+	TestTimeAugmentation(std::function<torch::Tensor(const torch::Tensor&)> model, TTAOptions options = TTAOptions());
+
+	int64_t num_views() const { return thetas_.size(0); }
+
+	// (B, C, H, W) ===> (V * B, C, H, W), grouped by view
+	torch::Tensor views(const torch::Tensor& X) const;
+
+	// (B, C, H, W) ===> (B, num_classes) averaged over the views
+	torch::Tensor forward(const torch::Tensor& X);
+
+private:
+	std::function<torch::Tensor(const torch::Tensor&)> model_;
+	TTAOptions options_;
+	torch::Tensor thetas_;			// (V, 2, 3) affine matrices of the views
+};
+
+// Features of a frozen backbone, computed once and kept on disk. The file holds a 40 byte header
+// (magic, num_samples, num_views, feature_dim, key), float features laid out (num_samples, num_views,
+// feature_dim) and int64 labels. The key identifies what the features were computed from (see
+// make_key), so a cache built for another backbone, augmentation or dataset can be detected. It is
+// memory-mapped for reading, so the cache may be larger than RAM and the pages are shared between
+// processes training heads on the same features.
+class FeatureCache {
+public:
+	// next_batch fills a (B, C, H, W) image batch and its (B) labels, returning false at the end of
+	// the dataset. Each view maps an image batch to an augmented one (no views: the images as they are).
+	static void build(const std::string& path,
+					  const std::function<torch::Tensor(const torch::Tensor&)>& backbone,
+					  const std::function<bool(torch::Tensor&, torch::Tensor&)>& next_batch,
+					  const std::vector<std::function<torch::Tensor(const torch::Tensor&)>>& views = {},
+					  uint64_t key = 0);
+
+	// stable 64 bit hash of a description of the backbone / views / dataset
+	static uint64_t make_key(const std::string& description);
+	// true when `path` is a cache file built with `key`
+	static bool is_current(const std::string& path, uint64_t key);
+
+	explicit FeatureCache(const std::string& path);
+	~FeatureCache();
+
+	FeatureCache(const FeatureCache&) = delete;
+	FeatureCache& operator=(const FeatureCache&) = delete;
+
+	int64_t size() const { return features_.size(0); }
+	int64_t num_views() const { return features_.size(1); }
+	int64_t feature_dim() const { return features_.size(2); }
+	uint64_t key() const { return key_; }
+
+	// read-only views of the mapping: (N, V, D) features and (N) labels
+	torch::Tensor features() const { return features_; }
+	torch::Tensor labels() const { return labels_; }
+
+	// copies of the features of the given samples, each from a random view or from view 0: (B, D), (B)
+	std::pair<torch::Tensor, torch::Tensor> batch(const torch::Tensor& indices, bool random_view = true) const;
+
+private:
+	void* data_ = nullptr;
+	size_t length_ = 0;
+	uint64_t key_ = 0;
+	torch::Tensor features_, labels_;
+};
+
 class VOCSegDataset:public torch::data::Dataset<VOCSegDataset>{
 public:
 	VOCSegDataset(const VocData& data, std::vector<int> imgSize, bool clrMaped = true) : data_(data) {
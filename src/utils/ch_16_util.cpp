@@ -1,4 +1,6 @@
 #include "ch_16_util.h"
+#include <ATen/CPUGeneratorImpl.h>
+#include <cmath>
 
 std::string strip( const std::string& s ) {
 	const std::string WHITESPACE = " \n\r\t\f\v";
@@ -59,3 +61,350 @@ std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> train_tes
 
 
 
+
+// -----------------------------------------------------------
+// Interactions in CSR form
+// -----------------------------------------------------------
+InteractionCSR::InteractionCSR(const torch::Tensor& users, const torch::Tensor& items,
+							   int64_t num_users, int64_t num_items) : num_users_(num_users), num_items_(num_items) {
+	auto u = users.to(torch::kCPU, torch::kLong).flatten();
+	auto i = items.to(torch::kCPU, torch::kLong).flatten();
+	TORCH_CHECK(u.numel() == i.numel(), "InteractionCSR: users and items differ in length");
+
+	// sort by (user, item) and drop repeated pairs
+	auto key = std::get<0>(torch::_unique(u * num_items + i, /*sorted=*/true));
+	auto key_user = key.div(num_items, "floor");
+	indices_ = (key - key_user * num_items).contiguous();
+	indptr_ = torch::zeros({num_users + 1}, torch::kLong);
+	indptr_.narrow(0, 1, num_users).copy_(torch::bincount(key_user, {}, num_users).cumsum(0));
+}
+
+// -----------------------------------------------------------
+// Interaction logs and splits
+// -----------------------------------------------------------
+Interactions Interactions::select(const torch::Tensor& index) const {
+	Interactions out;
+	out.users = users.index_select(0, index);
+	out.items = items.index_select(0, index);
+	if( timestamps.defined() )
+		out.timestamps = timestamps.index_select(0, index);
+	out.num_users = num_users;
+	out.num_items = num_items;
+	return out;
+}
+
+Interactions read_ml100k_interactions(const std::string& file_name, int min_rating) {
+	std::ifstream fL(file_name.c_str());
+	TORCH_CHECK(fL.is_open(), "read_ml100k_interactions: cannot open ", file_name);
+
+	std::vector<int64_t> users, items, timestamps;
+	int64_t u, i, r, t;
+	while( fL >> u >> i >> r >> t ) {
+		if( r < min_rating )
+			continue;
+		users.push_back(u);
+		items.push_back(i);
+		timestamps.push_back(t);
+	}
+	fL.close();
+
+	Interactions data;
+	int64_t n = users.size();
+	data.users = torch::from_blob(users.data(), {n}, torch::kLong).clone();
+	data.items = torch::from_blob(items.data(), {n}, torch::kLong).clone();
+	data.timestamps = torch::from_blob(timestamps.data(), {n}, torch::kLong).clone();
+	data.num_users = n > 0 ? data.users.max().item<int64_t>() + 1 : 0;
+	data.num_items = n > 0 ? data.items.max().item<int64_t>() + 1 : 0;
+	return data;
+}
+
+std::pair<Interactions, Interactions> leave_last_out_split(const Interactions& data) {
+	int64_t n = data.size();
+	auto time = data.timestamps.defined() ? data.timestamps : torch::arange(n, torch::kLong);
+
+	// stable sorts: by time, then by user, so every user's interactions end with the latest
+	auto by_time = std::get<1>(time.sort(std::optional<bool>(true), 0));
+	auto by_user = std::get<1>(data.users.index_select(0, by_time).sort(std::optional<bool>(true), 0));
+	auto order = by_time.index_select(0, by_user);
+	auto u = data.users.index_select(0, order);
+
+	auto last = torch::ones({n}, torch::kBool);
+	auto has_prev = torch::zeros({n}, torch::kBool);
+	if( n > 1 ) {
+		last.narrow(0, 0, n - 1).copy_(u.narrow(0, 0, n - 1) != u.narrow(0, 1, n - 1));
+		has_prev.narrow(0, 1, n - 1).copy_(u.narrow(0, 1, n - 1) == u.narrow(0, 0, n - 1));
+	}
+	auto test = last & has_prev;
+	return {data.select(order.masked_select(~test)), data.select(order.masked_select(test))};
+}
+
+std::pair<Interactions, Interactions> time_split(const Interactions& data, double test_fraction) {
+	TORCH_CHECK(data.timestamps.defined(), "time_split: the interactions have no timestamps");
+	auto t = data.timestamps.to(torch::kDouble);
+	double cutoff = t.quantile(1.0 - test_fraction).item<double>();
+	auto test = t >= cutoff;
+	return {data.select(torch::nonzero(~test).flatten()), data.select(torch::nonzero(test).flatten())};
+}
+
+// -----------------------------------------------------------
+// Negative sampling
+// -----------------------------------------------------------
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// splitmix64
+static inline uint64_t next_random(uint64_t& state) {
+	return mix64(state += 0x9E3779B97F4A7C15ULL);
+}
+
+NegativeSampler::NegativeSampler(const InteractionCSR& positives, Mode mode, double alpha,
+								 uint64_t seed, int max_tries)
+	: num_items_(positives.num_items()), mode_(mode), seed_(seed), max_tries_(max_tries) {
+	TORCH_CHECK(num_items_ > 0, "NegativeSampler: empty catalogue");
+
+	uint64_t capacity = 16;
+	while( capacity < 2 * static_cast<uint64_t>(positives.nnz()) )
+		capacity <<= 1;
+	table_.assign(capacity, 0);
+	mask_ = capacity - 1;
+	for(int64_t u = 0; u < positives.num_users(); u++)
+		for(const int64_t* it = positives.begin(u); it != positives.end(u); it++) {
+			uint64_t key = static_cast<uint64_t>(u * num_items_ + *it) + 1;
+			uint64_t h = mix64(key) & mask_;
+			while( table_[h] != 0 && table_[h] != key )
+				h = (h + 1) & mask_;
+			table_[h] = key;
+		}
+
+	if( mode_ == Mode::Popularity ) {
+		// Vose's alias method over popularity^alpha
+		auto weight = torch::bincount(positives.indices(), {}, num_items_).to(torch::kDouble).pow(alpha);
+		weight = weight * (static_cast<double>(num_items_) / weight.sum().item<double>());
+		std::vector<double> p(weight.data_ptr<double>(), weight.data_ptr<double>() + num_items_);
+		alias_prob_.assign(num_items_, 1.0f);
+		alias_.resize(num_items_);
+		std::vector<int64_t> small, large;
+		for(int64_t i = 0; i < num_items_; i++) {
+			alias_[i] = i;
+			(p[i] < 1.0 ? small : large).push_back(i);
+		}
+		while( ! small.empty() && ! large.empty() ) {
+			int64_t s = small.back(), l = large.back();
+			small.pop_back();
+			alias_prob_[s] = p[s];
+			alias_[s] = l;
+			p[l] -= 1.0 - p[s];
+			if( p[l] < 1.0 ) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+	}
+}
+
+bool NegativeSampler::is_positive(int64_t user, int64_t item) const {
+	uint64_t key = static_cast<uint64_t>(user * num_items_ + item) + 1;
+	for(uint64_t h = mix64(key) & mask_; table_[h] != 0; h = (h + 1) & mask_)
+		if( table_[h] == key )
+			return true;
+	return false;
+}
+
+int64_t NegativeSampler::draw(uint64_t& state) const {
+	uint64_t r = next_random(state);
+	int64_t column = static_cast<int64_t>((static_cast<unsigned __int128>(r) * num_items_) >> 64);
+	if( mode_ == Mode::Uniform )
+		return column;
+	float coin = (next_random(state) >> 40) * (1.0f / 16777216.0f);
+	return coin < alias_prob_[column] ? column : alias_[column];
+}
+
+torch::Tensor NegativeSampler::sample(const torch::Tensor& users, int64_t num_negatives) {
+	auto u = users.to(torch::kCPU, torch::kLong).flatten().contiguous();
+	const int64_t B = u.numel();
+	auto out = torch::empty({B, num_negatives}, torch::kLong);
+	const int64_t* uid = u.data_ptr<int64_t>();
+	int64_t* neg = out.data_ptr<int64_t>();
+	const uint64_t stream = mix64(seed_ ^ mix64(++calls_));
+
+	#pragma omp parallel for schedule(static)
+	for(int64_t b = 0; b < B; b++) {
+		uint64_t state = stream ^ mix64(static_cast<uint64_t>(b) + 1);
+		for(int64_t j = 0; j < num_negatives; j++) {
+			int64_t item = draw(state);
+			for(int t = 1; t < max_tries_ && is_positive(uid[b], item); t++)
+				item = draw(state);
+			neg[b * num_negatives + j] = item;
+		}
+	}
+	return out.to(users.device());
+}
+
+// -----------------------------------------------------------
+// BPR batches
+// -----------------------------------------------------------
+BPRBatches::BPRBatches(const Interactions& train, NegativeSampler& sampler, int64_t batch_size, uint64_t seed)
+	: users_(train.users.to(torch::kCPU, torch::kLong)), items_(train.items.to(torch::kCPU, torch::kLong)),
+	  sampler_(sampler), batch_size_(batch_size), seed_(seed) {
+	reset();
+}
+
+void BPRBatches::reset() {
+	auto gen = at::detail::createCPUGenerator(seed_ + static_cast<uint64_t>(epoch_++));
+	order_ = torch::randperm(users_.numel(), gen, torch::kLong);
+	position_ = 0;
+}
+
+bool BPRBatches::next(torch::Tensor& users, torch::Tensor& positives, torch::Tensor& negatives) {
+	if( position_ >= users_.numel() )
+		return false;
+	int64_t n = std::min(batch_size_, users_.numel() - position_);
+	auto idx = order_.narrow(0, position_, n);
+	users = users_.index_select(0, idx);
+	positives = items_.index_select(0, idx);
+	negatives = sampler_.sample(users, 1).flatten();
+	position_ += n;
+	return true;
+}
+
+// -----------------------------------------------------------
+// Top-K retrieval
+// -----------------------------------------------------------
+TopKRetriever::TopKRetriever(const torch::Tensor& user_factors, const torch::Tensor& item_factors,
+							 const torch::Tensor& user_bias, const torch::Tensor& item_bias) {
+	torch::NoGradGuard no_grad;
+	auto P = user_factors.detach().to(torch::kCPU, torch::kFloat);
+	auto Q = item_factors.detach().to(torch::kCPU, torch::kFloat);
+	TORCH_CHECK(P.dim() == 2 && Q.dim() == 2 && P.size(1) == Q.size(1), "TopKRetriever: factor shapes differ");
+
+	if( user_bias.defined() || item_bias.defined() ) {
+		auto bu = user_bias.defined() ? user_bias.detach().to(torch::kCPU, torch::kFloat).reshape({-1, 1})
+									  : torch::zeros({P.size(0), 1});
+		auto bi = item_bias.defined() ? item_bias.detach().to(torch::kCPU, torch::kFloat).reshape({-1, 1})
+									  : torch::zeros({Q.size(0), 1});
+		// [p_u, 1, b_u] . [q_i, b_i, 1] = p_u . q_i + b_i + b_u
+		users_ = torch::cat({P, torch::ones({P.size(0), 1}), bu}, 1).contiguous();
+		items_ = torch::cat({Q, bi, torch::ones({Q.size(0), 1})}, 1).contiguous();
+	} else {
+		users_ = P.contiguous();
+		items_ = Q.contiguous();
+	}
+}
+
+std::pair<torch::Tensor, torch::Tensor> TopKRetriever::recommend(const torch::Tensor& users, int64_t k,
+		const InteractionCSR* exclude, int64_t user_block, int64_t item_block) const {
+	torch::NoGradGuard no_grad;
+	auto uid = users.to(torch::kCPU, torch::kLong).flatten().contiguous();
+	const int64_t B = uid.numel(), I = items_.size(0);
+	k = std::min(k, I);
+	item_block = std::min(item_block, I);
+
+	auto top_items = torch::full({B, k}, -1, torch::kLong);
+	auto top_scores = torch::full({B, k}, -std::numeric_limits<float>::infinity(), torch::kFloat);
+	int64_t* out_items = top_items.data_ptr<int64_t>();
+	float* out_scores = top_scores.data_ptr<float>();
+	const int64_t* uid_ptr = uid.data_ptr<int64_t>();
+
+	auto U = users_.index_select(0, uid);
+	auto buffer = torch::empty({std::min(user_block, B) * item_block}, torch::kFloat);
+	using Entry = std::pair<float, int64_t>;
+
+	for(int64_t ub = 0; ub < B; ub += user_block) {
+		const int64_t nb = std::min(user_block, B - ub);
+		std::vector<std::vector<Entry>> heaps(nb);
+		std::vector<const int64_t*> seen(nb, nullptr), seen_end(nb, nullptr);
+		for(int64_t j = 0; j < nb; j++) {
+			heaps[j].reserve(k);
+			if( exclude != nullptr && uid_ptr[ub + j] < exclude->num_users() ) {
+				seen[j] = exclude->begin(uid_ptr[ub + j]);
+				seen_end[j] = exclude->end(uid_ptr[ub + j]);
+			}
+		}
+
+		for(int64_t ib = 0; ib < I; ib += item_block) {
+			const int64_t ni = std::min(item_block, I - ib);
+			auto S = buffer.narrow(0, 0, nb * ni).view({nb, ni});
+			torch::mm_out(S, U.narrow(0, ub, nb), items_.narrow(0, ib, ni).t());
+			const float* s = S.data_ptr<float>();
+
+			#pragma omp parallel for schedule(dynamic, 8)
+			for(int64_t j = 0; j < nb; j++) {
+				auto& heap = heaps[j];
+				const float* row = s + j * ni;
+				const int64_t*& sp = seen[j];
+				for(int64_t i = 0; i < ni; i++) {
+					const int64_t item = ib + i;
+					// the seen items are sorted: advance the cursor with the scan
+					if( sp != seen_end[j] ) {
+						while( sp != seen_end[j] && *sp < item )
+							sp++;
+						if( sp != seen_end[j] && *sp == item )
+							continue;
+					}
+					const float v = row[i];
+					if( static_cast<int64_t>(heap.size()) < k ) {
+						heap.emplace_back(v, item);
+						std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+					} else if( v > heap.front().first ) {
+						std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+						heap.back() = Entry(v, item);
+						std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+					}
+				}
+			}
+		}
+
+		#pragma omp parallel for
+		for(int64_t j = 0; j < nb; j++) {
+			auto& heap = heaps[j];
+			std::sort_heap(heap.begin(), heap.end(), std::greater<Entry>());		// best first
+			for(size_t r = 0; r < heap.size(); r++) {
+				out_items[(ub + j) * k + r] = heap[r].second;
+				out_scores[(ub + j) * k + r] = heap[r].first;
+			}
+		}
+	}
+	return {top_items, top_scores};
+}
+
+RankingMetrics evaluate_ranking(const TopKRetriever& retriever, const Interactions& test,
+								const InteractionCSR& train, int64_t k) {
+	RankingMetrics metrics;
+	metrics.k = k;
+	metrics.cases = test.size();
+	if( metrics.cases == 0 )
+		return metrics;
+
+	auto test_users = test.users.to(torch::kCPU, torch::kLong).contiguous();
+	auto test_items = test.items.to(torch::kCPU, torch::kLong).contiguous();
+	auto unique_users = std::get<0>(torch::_unique(test_users, /*sorted=*/true));
+	auto top = retriever.recommend(unique_users, k, &train).first;
+	k = top.size(1);
+
+	std::vector<int64_t> row_of(retriever.num_users(), -1);
+	const int64_t* uu = unique_users.data_ptr<int64_t>();
+	for(int64_t r = 0; r < unique_users.numel(); r++)
+		row_of[uu[r]] = r;
+
+	const int64_t* tu = test_users.data_ptr<int64_t>();
+	const int64_t* ti = test_items.data_ptr<int64_t>();
+	const int64_t* rec = top.data_ptr<int64_t>();
+	double hits = 0, ndcg = 0;
+
+	#pragma omp parallel for reduction(+:hits, ndcg)
+	for(int64_t c = 0; c < metrics.cases; c++) {
+		const int64_t* row = rec + row_of[tu[c]] * k;
+		for(int64_t pos = 0; pos < k; pos++)
+			if( row[pos] == ti[c] ) {
+				hits += 1;
+				ndcg += 1.0 / std::log2(pos + 2.0);
+				break;
+			}
+	}
+	metrics.hit_rate = hits / metrics.cases;
+	metrics.ndcg = ndcg / metrics.cases;
+	return metrics;
+}
@@ -21,6 +21,9 @@
 #include <random>
 #include <iostream>
 #include <filesystem>
+#include <limits>
+#include <utility>
+#include <vector>
 #include <fstream>
 
 using torch::indexing::Slice;
@@ -35,5 +38,129 @@ torch::Tensor RangeTensorIndex(int64_t num, bool suffle = false);
 std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> train_test_split(torch::Tensor X,
 		torch::Tensor y, double test_size=0.3, bool suffle=true);
 
+// User -> item interactions in CSR form: the items of user u are indices[indptr[u] : indptr[u + 1]],
+// sorted and without duplicates.
+class InteractionCSR {
+public:
+	InteractionCSR() {}
+	// users, items: 1-D integer tensors of equal length
+	InteractionCSR(const torch::Tensor& users, const torch::Tensor& items, int64_t num_users, int64_t num_items);
+
+	int64_t num_users() const { return num_users_; }
+	int64_t num_items() const { return num_items_; }
+	int64_t nnz() const { return indices_.numel(); }
+
+	const int64_t* begin(int64_t user) const { return indices_.data_ptr<int64_t>() + indptr_.data_ptr<int64_t>()[user]; }
+	const int64_t* end(int64_t user) const { return indices_.data_ptr<int64_t>() + indptr_.data_ptr<int64_t>()[user + 1]; }
+	int64_t degree(int64_t user) const { return end(user) - begin(user); }
+	bool contains(int64_t user, int64_t item) const { return std::binary_search(begin(user), end(user), item); }
+
+	const torch::Tensor& indptr() const { return indptr_; }
+	const torch::Tensor& indices() const { return indices_; }
+
+private:
+	int64_t num_users_ = 0, num_items_ = 0;
+	torch::Tensor indptr_, indices_;		// int64, CPU
+};
+
+// Implicit-feedback interaction log: parallel 1-D tensors, int64 ids, timestamps optional.
+struct Interactions {
+	torch::Tensor users, items, timestamps;
+	int64_t num_users = 0, num_items = 0;
+
+	int64_t size() const { return users.numel(); }
+	Interactions select(const torch::Tensor& index) const;
+	InteractionCSR csr() const { return InteractionCSR(users, items, num_users, num_items); }
+};
+
+// Reads a MovieLens u.data file (user \t item \t rating \t timestamp); ratings below min_rating are
+// dropped, the rest count as positive interactions.
+Interactions read_ml100k_interactions(const std::string& file_name, int min_rating = 0);
+
+// Holds out the latest interaction of every user with at least two (ties broken by log order).
+std::pair<Interactions, Interactions> leave_last_out_split(const Interactions& data);
+
+// Holds out every interaction at or after the (1 - test_fraction) quantile of the timestamps.
+std::pair<Interactions, Interactions> time_split(const Interactions& data, double test_fraction = 0.2);
+
+// Negative items for (user, item) training: drawn uniformly or by popularity^alpha (alias table),
+// rejecting the user's positives with a hash-set lookup. Sampling runs over users in parallel with
+// OpenMP; every row has its own counter-based random stream, so the result does not depend on the
+// number of threads.
+class NegativeSampler {
+public:
+	enum class Mode { Uniform, Popularity };
+
+	NegativeSampler(const InteractionCSR& positives, Mode mode = Mode::Uniform, double alpha = 0.75,
+					uint64_t seed = 0, int max_tries = 32);
+
+	// (B, num_negatives) item ids for the given users
+	torch::Tensor sample(const torch::Tensor& users, int64_t num_negatives = 1);
+
+	bool is_positive(int64_t user, int64_t item) const;
+
+private:
+	int64_t draw(uint64_t& state) const;
+
+	int64_t num_items_;
+	Mode mode_;
+	uint64_t seed_, calls_ = 0;
+	int max_tries_;
+	std::vector<uint64_t> table_;			// open addressing, key + 1 (0 = empty)
+	uint64_t mask_ = 0;
+	std::vector<float> alias_prob_;
+	std::vector<int64_t> alias_;
+};
+
+// Epochs of BPR triples (user, positive item, negative item): the positive pairs are shuffled once
+// per epoch and the negatives are sampled per batch.
+class BPRBatches {
+public:
+	BPRBatches(const Interactions& train, NegativeSampler& sampler, int64_t batch_size, uint64_t seed = 0);
+
+	// starts the next epoch
+	void reset();
+	// false at the end of the epoch
+	bool next(torch::Tensor& users, torch::Tensor& positives, torch::Tensor& negatives);
+	int64_t num_batches() const { return (users_.numel() + batch_size_ - 1) / batch_size_; }
+
+private:
+	torch::Tensor users_, items_, order_;
+	NegativeSampler& sampler_;
+	int64_t batch_size_, position_ = 0, epoch_ = 0;
+	uint64_t seed_;
+};
+
+// Top-K item retrieval from a trained factorization model. The score of (u, i) is
+// p_u . q_i + b_u + b_i; the biases are folded into one extra column on each side, so the scores of a
+// block of users against a block of items are a single GEMM. Each user keeps a size-K min-heap across
+// item blocks, and items already seen (from an InteractionCSR) are skipped while scanning.
+class TopKRetriever {
+public:
+	// user_factors (U, D), item_factors (I, D); the biases (U) / (I) are optional
+	TopKRetriever(const torch::Tensor& user_factors, const torch::Tensor& item_factors,
+				  const torch::Tensor& user_bias = torch::Tensor(), const torch::Tensor& item_bias = torch::Tensor());
+
+	// (B, k) item ids and scores, best first, for the given user ids; rows of users with fewer than k
+	// unseen items are padded with -1 / -inf
+	std::pair<torch::Tensor, torch::Tensor> recommend(const torch::Tensor& users, int64_t k,
+			const InteractionCSR* exclude = nullptr, int64_t user_block = 256, int64_t item_block = 32768) const;
+
+	int64_t num_users() const { return users_.size(0); }
+	int64_t num_items() const { return items_.size(0); }
+
+private:
+	torch::Tensor users_, items_;	// contiguous float CPU, bias columns appended
+};
+
+struct RankingMetrics {
+	double hit_rate = 0, ndcg = 0;
+	int64_t k = 0, cases = 0;
+};
+
+// HR@K and NDCG@K of held-out interactions over the full catalogue: every test pair is a hit when
+// its item is in the user's top K, ranked among the items not seen in training.
+RankingMetrics evaluate_ranking(const TopKRetriever& retriever, const Interactions& test,
+								const InteractionCSR& train, int64_t k = 10);
 
 #endif /* SRC_UTILS_CH_16_UTIL_H_ */
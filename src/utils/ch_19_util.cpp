@@ -0,0 +1,338 @@
+#include "ch_19_util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <opencv2/opencv.hpp>
+
+
+// -----------------------------------------------------------
+// Replay buffer
+// -----------------------------------------------------------
+ReplayBuffer::ReplayBuffer(int64_t capacity, std::vector<int64_t> state_shape, torch::Dtype state_dtype)
+	: capacity_(capacity) {
+	TORCH_CHECK(capacity_ > 0, "ReplayBuffer: capacity must be positive");
+	std::vector<int64_t> shape = {capacity_};
+	shape.insert(shape.end(), state_shape.begin(), state_shape.end());
+
+	states_ = torch::zeros(shape, state_dtype);
+	next_states_ = torch::zeros(shape, state_dtype);
+	actions_ = torch::zeros({capacity_, 1}, torch::kLong);
+	rewards_ = torch::zeros({capacity_, 1}, torch::kFloat);
+	dones_ = torch::zeros({capacity_, 1}, torch::kFloat);
+	steps_ = torch::ones({capacity_, 1}, torch::kFloat);
+}
+
+int64_t ReplayBuffer::add(const Transition& t) {
+	int64_t slot = next_;
+	states_[slot].copy_(t.state.reshape(states_[slot].sizes()));
+	next_states_[slot].copy_(t.next_state.reshape(next_states_[slot].sizes()));
+	actions_.data_ptr<int64_t>()[slot] = t.action;
+	rewards_.data_ptr<float>()[slot] = t.reward;
+	dones_.data_ptr<float>()[slot] = t.done ? 1.0f : 0.0f;
+	steps_.data_ptr<float>()[slot] = static_cast<float>(t.steps);
+
+	next_ = (next_ + 1) % capacity_;
+	size_ = std::min(size_ + 1, capacity_);
+	return slot;
+}
+
+torch::Tensor ReplayBuffer::add_batch(const torch::Tensor& states, const torch::Tensor& actions, const torch::Tensor& rewards,
+									  const torch::Tensor& next_states, const torch::Tensor& dones) {
+	int64_t B = states.size(0);
+	TORCH_CHECK(B <= capacity_, "ReplayBuffer: batch larger than the capacity");
+	auto slots = torch::arange(next_, next_ + B, torch::kLong).remainder_(capacity_);
+
+	std::vector<int64_t> shape = states_.sizes().vec();
+	shape[0] = B;
+	states_.index_copy_(0, slots, states.to(torch::kCPU, states_.scalar_type()).reshape(shape));
+	next_states_.index_copy_(0, slots, next_states.to(torch::kCPU, next_states_.scalar_type()).reshape(shape));
+	actions_.index_copy_(0, slots, actions.to(torch::kCPU, torch::kLong).reshape({B, 1}));
+	rewards_.index_copy_(0, slots, rewards.to(torch::kCPU, torch::kFloat).reshape({B, 1}));
+	dones_.index_copy_(0, slots, dones.to(torch::kCPU, torch::kFloat).reshape({B, 1}));
+	steps_.index_fill_(0, slots, 1.0);
+
+	next_ = (next_ + B) % capacity_;
+	size_ = std::min(size_ + B, capacity_);
+	return slots;
+}
+
+ReplayBatch ReplayBuffer::gather(const torch::Tensor& indices) const {
+	ReplayBatch batch;
+	batch.indices = indices;
+	batch.states = states_.index_select(0, indices);
+	batch.actions = actions_.index_select(0, indices);
+	batch.rewards = rewards_.index_select(0, indices);
+	batch.next_states = next_states_.index_select(0, indices);
+	batch.dones = dones_.index_select(0, indices);
+	batch.steps = steps_.index_select(0, indices);
+	return batch;
+}
+
+ReplayBatch ReplayBuffer::sample(int64_t batch_size) {
+	TORCH_CHECK(size_ > 0, "ReplayBuffer: sampling from an empty buffer");
+	auto batch = gather(torch::randint(0, size_, {batch_size}, torch::kLong));
+	batch.weights = torch::ones({batch_size, 1});
+	return batch;
+}
+
+// -----------------------------------------------------------
+// Sum tree
+// -----------------------------------------------------------
+SumTree::SumTree(int64_t capacity) {
+	leaves_ = 1;
+	while( leaves_ < capacity )
+		leaves_ <<= 1;
+	tree_.assign(2 * leaves_, 0.0);
+}
+
+void SumTree::update(int64_t index, double priority) {
+	int64_t node = leaves_ + index;
+	double delta = priority - tree_[node];
+	for( ; node >= 1; node >>= 1)
+		tree_[node] += delta;
+}
+
+int64_t SumTree::find(double prefix) const {
+	int64_t node = 1;
+	while( node < leaves_ ) {
+		int64_t left = 2 * node;
+		if( prefix < tree_[left] ) {
+			node = left;
+		} else {
+			prefix -= tree_[left];
+			node = left + 1;
+		}
+	}
+	return node - leaves_;
+}
+
+// -----------------------------------------------------------
+// Prioritised replay
+// -----------------------------------------------------------
+PrioritizedReplayBuffer::PrioritizedReplayBuffer(int64_t capacity, std::vector<int64_t> state_shape, double alpha,
+												 double beta, torch::Dtype state_dtype)
+	: ReplayBuffer(capacity, state_shape, state_dtype), beta(beta), tree_(capacity), alpha_(alpha) {}
+
+int64_t PrioritizedReplayBuffer::add(const Transition& t) {
+	int64_t slot = ReplayBuffer::add(t);
+	tree_.update(slot, std::pow(max_priority_, alpha_));
+	return slot;
+}
+
+torch::Tensor PrioritizedReplayBuffer::add_batch(const torch::Tensor& states, const torch::Tensor& actions,
+		const torch::Tensor& rewards, const torch::Tensor& next_states, const torch::Tensor& dones) {
+	auto slots = ReplayBuffer::add_batch(states, actions, rewards, next_states, dones);
+	const int64_t* s = slots.data_ptr<int64_t>();
+	double p = std::pow(max_priority_, alpha_);
+	for(int64_t i = 0; i < slots.numel(); i++)
+		tree_.update(s[i], p);
+	return slots;
+}
+
+ReplayBatch PrioritizedReplayBuffer::sample(int64_t batch_size) {
+	TORCH_CHECK(size_ > 0, "PrioritizedReplayBuffer: sampling from an empty buffer");
+	auto indices = torch::empty({batch_size}, torch::kLong);
+	auto probs = torch::empty({batch_size, 1}, torch::kDouble);
+	auto u = torch::rand({batch_size}, torch::kDouble);
+	int64_t* idx = indices.data_ptr<int64_t>();
+	double* p = probs.data_ptr<double>();
+	const double* uu = u.data_ptr<double>();
+
+	// one draw per equal segment of the total priority
+	const double total = tree_.total(), segment = total / batch_size;
+	for(int64_t i = 0; i < batch_size; i++) {
+		int64_t slot = std::min(tree_.find((i + uu[i]) * segment), size_ - 1);
+		idx[i] = slot;
+		p[i] = tree_.get(slot) / total;
+	}
+
+	auto batch = gather(indices);
+	auto w = (probs * static_cast<double>(size_)).pow(-beta);
+	batch.weights = (w / w.max()).to(torch::kFloat);
+	return batch;
+}
+
+void PrioritizedReplayBuffer::update_priorities(const torch::Tensor& indices, const torch::Tensor& td_errors, double eps) {
+	auto idx = indices.to(torch::kCPU, torch::kLong).contiguous();
+	auto err = td_errors.detach().to(torch::kCPU, torch::kDouble).abs().flatten().contiguous();
+	const int64_t* i = idx.data_ptr<int64_t>();
+	const double* e = err.data_ptr<double>();
+	for(int64_t k = 0; k < idx.numel(); k++) {
+		double priority = e[k] + eps;
+		max_priority_ = std::max(max_priority_, priority);
+		tree_.update(i[k], std::pow(priority, alpha_));
+	}
+}
+
+// -----------------------------------------------------------
+// n-step returns
+// -----------------------------------------------------------
+Transition NStepAccumulator::fold() const {
+	Transition out = queue_.front();
+	double ret = 0.0, discount = 1.0;
+	int64_t k = 0;
+	for(const auto& t : queue_) {
+		ret += discount * t.reward;
+		discount *= gamma_;
+		k++;
+		out.next_state = t.next_state;
+		out.done = t.done;
+		if( t.done )
+			break;
+	}
+	out.reward = static_cast<float>(ret);
+	out.steps = k;
+	return out;
+}
+
+std::vector<Transition> NStepAccumulator::push(const Transition& t) {
+	std::vector<Transition> ready;
+	queue_.push_back(t);
+	if( t.done ) {
+		// the episode ended: every queued start gets its (shorter) return
+		ready = flush();
+	} else if( static_cast<int64_t>(queue_.size()) == n_ ) {
+		ready.push_back(fold());
+		queue_.pop_front();
+	}
+	return ready;
+}
+
+std::vector<Transition> NStepAccumulator::flush() {
+	std::vector<Transition> ready;
+	while( ! queue_.empty() ) {
+		ready.push_back(fold());
+		queue_.pop_front();
+	}
+	return ready;
+}
+
+// -----------------------------------------------------------
+// Vectorised grid world
+// -----------------------------------------------------------
+VecGridEnv::VecGridEnv(int64_t num_envs, GridWorldSpec spec) : spec_(std::move(spec)), num_envs_(num_envs) {
+	TORCH_CHECK(num_envs_ > 0, "VecGridEnv: num_envs must be positive");
+	const int64_t plane = spec_.rows * spec_.cols;
+	cells_.assign(plane, 0);
+	layout_.assign(3 * plane, 0.0f);
+	cells_[spec_.goal_y * spec_.cols + spec_.goal_x] = 2;
+	layout_[plane + spec_.goal_y * spec_.cols + spec_.goal_x] = 1.0f;
+	for(const auto& trap : spec_.traps) {
+		cells_[trap.second * spec_.cols + trap.first] = 3;
+		layout_[2 * plane + trap.second * spec_.cols + trap.first] = 1.0f;
+	}
+	x_.assign(num_envs_, spec_.start_x);
+	y_.assign(num_envs_, spec_.start_y);
+	t_.assign(num_envs_, 0);
+	final_x_ = x_;
+	final_y_ = y_;
+}
+
+void VecGridEnv::write_observation(float* out, int64_t env) const {
+	const int64_t plane = spec_.rows * spec_.cols;
+	std::memcpy(out, layout_.data(), 3 * plane * sizeof(float));
+	// the agent hides whatever it stands on, as in the original maze
+	const int64_t cell = y_[env] * spec_.cols + x_[env];
+	out[cell] = 1.0f;
+	out[plane + cell] = 0.0f;
+	out[2 * plane + cell] = 0.0f;
+}
+
+torch::Tensor VecGridEnv::reset() {
+	std::fill(x_.begin(), x_.end(), spec_.start_x);
+	std::fill(y_.begin(), y_.end(), spec_.start_y);
+	std::fill(t_.begin(), t_.end(), 0);
+	final_x_ = x_;
+	final_y_ = y_;
+	return observations();
+}
+
+torch::Tensor VecGridEnv::observations() const {
+	auto obs = torch::empty({num_envs_, 3, spec_.rows, spec_.cols}, torch::kFloat);
+	float* o = obs.data_ptr<float>();
+	const int64_t size = 3 * spec_.rows * spec_.cols;
+	for(int64_t e = 0; e < num_envs_; e++)
+		write_observation(o + e * size, e);
+	return obs;
+}
+
+VecStep VecGridEnv::step(const torch::Tensor& actions) {
+	auto act = actions.to(torch::kCPU, torch::kLong).contiguous().flatten();
+	TORCH_CHECK(act.numel() == num_envs_, "VecGridEnv: expected one action per environment");
+	const int64_t* a = act.data_ptr<int64_t>();
+	for(int64_t e = 0; e < num_envs_; e++)
+		TORCH_CHECK(a[e] >= 0 && a[e] < n_actions(), "VecGridEnv: invalid action ", a[e]);
+
+	VecStep out;
+	out.observations = torch::empty({num_envs_, 3, spec_.rows, spec_.cols}, torch::kFloat);
+	out.final_observations = torch::empty_like(out.observations);
+	out.rewards = torch::zeros({num_envs_}, torch::kFloat);
+	out.dones = torch::zeros({num_envs_}, torch::kLong);
+	float* obs = out.observations.data_ptr<float>();
+	float* fin = out.final_observations.data_ptr<float>();
+	float* rew = out.rewards.data_ptr<float>();
+	int64_t* done = out.dones.data_ptr<int64_t>();
+
+	// ['u'0, 'd'1, 'l'2, 'r'3]
+	static const int dx[4] = {0, 0, -1, 1}, dy[4] = {-1, 1, 0, 0};
+	const int64_t size = 3 * spec_.rows * spec_.cols;
+
+	#pragma omp parallel for schedule(static) if(num_envs_ >= 256)
+	for(int64_t e = 0; e < num_envs_; e++) {
+		const int nx = x_[e] + dx[a[e]], ny = y_[e] + dy[a[e]];
+		if( nx < 0 || nx >= spec_.cols || ny < 0 || ny >= spec_.rows ) {
+			rew[e] = spec_.wall_reward;
+		} else {
+			x_[e] = nx;
+			y_[e] = ny;
+			const uint8_t cell = cells_[ny * spec_.cols + nx];
+			if( cell == 3 ) {
+				rew[e] = spec_.trap_reward;
+				done[e] = kTrap;
+			} else if( cell == 2 ) {
+				rew[e] = spec_.goal_reward;
+				done[e] = kGoal;
+			}
+		}
+		t_[e] += 1;
+		if( done[e] == kRunning && spec_.max_steps > 0 && t_[e] >= spec_.max_steps )
+			done[e] = kTimeLimit;
+
+		final_x_[e] = x_[e];
+		final_y_[e] = y_[e];
+		write_observation(fin + e * size, e);
+		if( done[e] != kRunning ) {
+			x_[e] = spec_.start_x;
+			y_[e] = spec_.start_y;
+			t_[e] = 0;
+			write_observation(obs + e * size, e);
+		} else {
+			std::memcpy(obs + e * size, fin + e * size, size * sizeof(float));
+		}
+	}
+	return out;
+}
+
+void VecGridEnv::render(int64_t env, int delay_ms) const {
+	const int cell = 60;
+	cv::Mat frame(spec_.rows * cell, spec_.cols * cell, CV_8UC3, cv::Scalar(255, 255, 255));
+	for(int i = 0; i < spec_.cols; i++)
+		cv::line(frame, {i * cell, 0}, {i * cell, spec_.rows * cell}, {0, 0, 0}, 1);
+	for(int i = 0; i < spec_.rows; i++)
+		cv::line(frame, {0, i * cell}, {spec_.cols * cell, i * cell}, {0, 0, 0}, 1);
+
+	for(int y = 0; y < spec_.rows; y++) {
+		for(int x = 0; x < spec_.cols; x++) {
+			cv::Point c(x * cell + cell / 2, y * cell + cell / 2);
+			if( x == x_[env] && y == y_[env] )
+				cv::circle(frame, c, 25, {255, 0, 0}, -1);
+			else if( cells_[y * spec_.cols + x] == 2 )
+				cv::circle(frame, c, 25, {0, 255, 0}, -1);
+			else if( cells_[y * spec_.cols + x] == 3 )
+				cv::circle(frame, c, 25, {0, 0, 255}, -1);
+		}
+	}
+	cv::imshow(" ", frame);
+	cv::waitKey(delay_ms);
+}
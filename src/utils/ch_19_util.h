@@ -0,0 +1,168 @@
+#include <torch/torch.h>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#ifndef SRC_UTILS_CH_19_UTIL_H_
+#define SRC_UTILS_CH_19_UTIL_H_
+
+// One environment step. `steps` is the number of rewards folded into `reward` (n-step returns), so
+// the bootstrap term of the target is gamma^steps * (1 - done) * max_a Q(next_state, a).
+struct Transition {
+	torch::Tensor state;
+	int64_t action = 0;
+	float reward = 0;
+	torch::Tensor next_state;
+	bool done = false;
+	int64_t steps = 1;
+};
+
+struct ReplayBatch {
+	torch::Tensor states, actions, rewards, next_states, dones, steps;	// (B, ...), (B, 1) ...
+	torch::Tensor indices;		// slots in the buffer, for priority updates
+	torch::Tensor weights;		// importance-sampling weights (B, 1); ones for uniform sampling
+};
+
+// Replay memory in preallocated contiguous tensors, one per field. Insertion copies into the next
+// slot of a ring (O(1), no allocation); sampling is one index_select per field.
+class ReplayBuffer {
+public:
+	ReplayBuffer(int64_t capacity, std::vector<int64_t> state_shape, torch::Dtype state_dtype = torch::kFloat);
+	virtual ~ReplayBuffer() = default;
+
+	virtual int64_t add(const Transition& t);
+	// a batch of transitions from vectorised environments: states (B, ...), actions / rewards / dones (B)
+	virtual torch::Tensor add_batch(const torch::Tensor& states, const torch::Tensor& actions, const torch::Tensor& rewards,
+									const torch::Tensor& next_states, const torch::Tensor& dones);
+
+	virtual ReplayBatch sample(int64_t batch_size);
+
+	int64_t size() const { return size_; }
+	int64_t capacity() const { return capacity_; }
+
+protected:
+	ReplayBatch gather(const torch::Tensor& indices) const;
+
+	int64_t capacity_, size_ = 0, next_ = 0;
+	torch::Tensor states_, actions_, rewards_, next_states_, dones_, steps_;
+};
+
+// Binary tree of partial sums over `capacity` leaves: O(log n) update and prefix-sum search.
+class SumTree {
+public:
+	explicit SumTree(int64_t capacity);
+
+	void update(int64_t index, double priority);
+	// leaf whose cumulative range contains `prefix` (0 <= prefix < total())
+	int64_t find(double prefix) const;
+	double total() const { return tree_[1]; }
+	double get(int64_t index) const { return tree_[leaves_ + index]; }
+
+private:
+	int64_t leaves_;
+	std::vector<double> tree_;	// tree_[1] is the root, leaves start at leaves_
+};
+
+// Prioritised experience replay (Schaul et al., 2016): slots are drawn with probability
+// p_i^alpha / sum p^alpha by stratified sum-tree search, with importance weights
+// (N * P(i))^-beta normalised by their maximum. New transitions get the largest priority so far.
+class PrioritizedReplayBuffer : public ReplayBuffer {
+public:
+	PrioritizedReplayBuffer(int64_t capacity, std::vector<int64_t> state_shape, double alpha = 0.6,
+							double beta = 0.4, torch::Dtype state_dtype = torch::kFloat);
+
+	int64_t add(const Transition& t) override;
+	torch::Tensor add_batch(const torch::Tensor& states, const torch::Tensor& actions, const torch::Tensor& rewards,
+							const torch::Tensor& next_states, const torch::Tensor& dones) override;
+	ReplayBatch sample(int64_t batch_size) override;
+
+	// new priorities |td_error| + eps of the sampled slots
+	void update_priorities(const torch::Tensor& indices, const torch::Tensor& td_errors, double eps = 1e-6);
+
+	double beta = 0.4;		// annealed towards 1 by the caller
+
+private:
+	SumTree tree_;
+	double alpha_, max_priority_ = 1.0;
+};
+
+// Folds the rewards of n consecutive steps of one environment into n-step transitions
+// (r_0 + gamma r_1 + ... + gamma^(n-1) r_(n-1), s_n). push() returns the transitions that are complete:
+// one per step once n steps are queued, and the whole tail when an episode ends.
+class NStepAccumulator {
+public:
+	NStepAccumulator(int64_t n, double gamma) : n_(n), gamma_(gamma) {}
+
+	std::vector<Transition> push(const Transition& t);
+	// the queued tail as shorter, non-terminal transitions (episode cut by a time limit)
+	std::vector<Transition> flush();
+	void clear() { queue_.clear(); }
+
+private:
+	Transition fold() const;
+
+	int64_t n_;
+	double gamma_;
+	std::deque<Transition> queue_;
+};
+
+// -----------------------------------------------------------
+// Vectorised grid world
+// -----------------------------------------------------------
+// Layout of the treasure maze of chapter 19: the agent starts at (start_x, start_y), a trap ends the
+// episode with trap_reward, the goal with goal_reward, and a move into the border costs wall_reward.
+struct GridWorldSpec {
+	int rows = 5, cols = 5;
+	int start_x = 0, start_y = 0;
+	int goal_x = 4, goal_y = 4;
+	std::vector<std::pair<int, int>> traps = {{3, 1}, {1, 3}};	// (x, y)
+	float wall_reward = -0.5, trap_reward = -1.0, goal_reward = 1.0;
+	int max_steps = 0;			// episode time limit, 0 for none
+};
+
+// done codes of VecGridEnv::step
+constexpr int64_t kRunning = 0, kTrap = 1, kGoal = 2, kTimeLimit = 3;
+
+struct VecStep {
+	torch::Tensor observations;			// (N, 3, rows, cols), already reset where an episode ended
+	torch::Tensor final_observations;	// (N, 3, rows, cols) reached by this step, before any reset
+	torch::Tensor rewards;				// (N) float
+	torch::Tensor dones;				// (N) long, one of the done codes above
+};
+
+// N copies of the grid world stepped together on plain arrays of positions. Observations are the
+// one-hot planes (agent, goal, traps) as one float tensor, finished episodes reset themselves, and
+// nothing is drawn unless render() is called, so training runs headless.
+class VecGridEnv {
+public:
+	VecGridEnv(int64_t num_envs, GridWorldSpec spec = GridWorldSpec());
+
+	torch::Tensor reset();
+	// actions (N) in [0, 4): up, down, left, right
+	VecStep step(const torch::Tensor& actions);
+	torch::Tensor observations() const;
+
+	// opt-in OpenCV view of one environment
+	void render(int64_t env = 0, int delay_ms = 10) const;
+
+	int64_t num_envs() const { return num_envs_; }
+	const GridWorldSpec& spec() const { return spec_; }
+	int n_actions() const { return 4; }
+	std::vector<int64_t> observation_shape() const { return {3, spec_.rows, spec_.cols}; }
+	int x(int64_t env) const { return x_[env]; }
+	int y(int64_t env) const { return y_[env]; }
+	// position reached by the last step, before an automatic reset
+	int final_x(int64_t env) const { return final_x_[env]; }
+	int final_y(int64_t env) const { return final_y_[env]; }
+
+private:
+	void write_observation(float* out, int64_t env) const;
+
+	GridWorldSpec spec_;
+	int64_t num_envs_;
+	std::vector<int> x_, y_, t_, final_x_, final_y_;
+	std::vector<uint8_t> cells_;		// 0 free, 2 goal, 3 trap
+	std::vector<float> layout_;			// observation planes without the agent
+};
+
+#endif /* SRC_UTILS_CH_19_UTIL_H_ */
@@ -0,0 +1,231 @@
+#include "dqn.h"
+#include "large_batch.h"
+
+#include <algorithm>
+#include <iostream>
+
+
+// -----------------------------------------------------------
+// Q network
+// -----------------------------------------------------------
+QNetImpl::QNetImpl(std::vector<int64_t> obs_shape, int64_t n_actions, bool dueling) : dueling(dueling) {
+	TORCH_CHECK(obs_shape.size() == 3, "QNet: observations must be (channels, rows, cols)");
+	const int64_t features = 25 * (obs_shape[1] - 4) * (obs_shape[2] - 4);
+	c1 = torch::nn::Conv2d(torch::nn::Conv2dOptions(obs_shape[0], 25, 5).stride(1).padding(0));
+	f1 = torch::nn::Linear(torch::nn::LinearOptions(features, 16));
+	f1->weight.data().normal_(0., 0.1);
+	f2 = torch::nn::Linear(torch::nn::LinearOptions(16, n_actions));
+	f2->weight.data().normal_(0., 0.1);
+	register_module("c1", c1);
+	register_module("f1", f1);
+	register_module("f2", f2);
+	if( dueling ) {
+		value = torch::nn::Linear(torch::nn::LinearOptions(16, 1));
+		value->weight.data().normal_(0., 0.1);
+		register_module("value", value);
+	}
+}
+
+torch::Tensor QNetImpl::forward(torch::Tensor x) {
+	x = torch::nn::functional::relu(c1->forward(x));
+	x = x.view({x.size(0), -1});
+	x = torch::nn::functional::relu(f1->forward(x));
+	torch::Tensor q = f2->forward(x);
+	if( dueling )
+		q = value->forward(x) + q - q.mean(1, true);
+	return q;
+}
+
+// -----------------------------------------------------------
+// DQN trainer
+// -----------------------------------------------------------
+// Moves the parameters of `module` into one contiguous buffer and makes them views of it.
+static torch::Tensor flatten_parameters(torch::nn::Module& module) {
+	torch::NoGradGuard no_grad;
+	auto params = module.parameters();
+	int64_t numel = 0;
+	for(const auto& p : params)
+		numel += p.numel();
+	auto flat = torch::empty({numel}, params.front().options());
+	int64_t offset = 0;
+	for(auto& p : params) {
+		auto view = flat.narrow(0, offset, p.numel()).view(p.sizes());
+		view.copy_(p);
+		p.set_data(view);
+		offset += p.numel();
+	}
+	return flat;
+}
+
+DQNTrainer::DQNTrainer(VecGridEnv& env, DQNConfig config) : env_(env), config_(config) {
+	TORCH_CHECK(config_.tau > 0.0 && config_.tau <= 1.0, "DQNTrainer: tau must be in (0, 1]");
+	auto shape = env_.observation_shape();
+	online = QNet(shape, env_.n_actions(), config_.dueling);
+	target = QNet(shape, env_.n_actions(), config_.dueling);
+	online->to(config_.device);
+	target->to(config_.device);
+	online_flat_ = flatten_parameters(*online);
+	target_flat_ = flatten_parameters(*target);
+	target_flat_.copy_(online_flat_);
+	for(auto& p : target->parameters())
+		p.requires_grad_(false);
+
+	optimizer_ = std::make_unique<torch::optim::Adam>(online->parameters(), torch::optim::AdamOptions(config_.lr));
+	if( ! config_.epsilon_schedule )
+		config_.epsilon_schedule = std::make_shared<PolynomialDecay>(config_.epsilon_decay_steps, 1.0, 0.0);
+
+	if( config_.prioritized )
+		memory_ = std::make_unique<PrioritizedReplayBuffer>(config_.memory_capacity, shape, 0.6, config_.beta_start);
+	else
+		memory_ = std::make_unique<ReplayBuffer>(config_.memory_capacity, shape);
+	n_step_.assign(env_.num_envs(), NStepAccumulator(config_.n_step, config_.gamma));
+	obs_ = env_.reset();
+}
+
+double DQNTrainer::epsilon() const {
+	return config_.epsilon_end + (config_.epsilon_start - config_.epsilon_end) * config_.epsilon_schedule->multiplier(steps_);
+}
+
+torch::Tensor DQNTrainer::act(const torch::Tensor& obs, double epsilon) {
+	torch::NoGradGuard no_grad;
+	const int64_t n = obs.size(0);
+	auto greedy = online->forward(obs.to(config_.device)).argmax(1).to(torch::kCPU);
+	if( epsilon <= 0.0 )
+		return greedy;
+	auto random = torch::randint(0, env_.n_actions(), {n}, torch::kLong);
+	return torch::where(torch::rand({n}) < epsilon, random, greedy);
+}
+
+void DQNTrainer::store(const torch::Tensor& obs, const torch::Tensor& actions, const VecStep& step) {
+	auto terminal = (step.dones == kTrap).logical_or(step.dones == kGoal);
+	if( config_.n_step == 1 ) {
+		memory_->add_batch(obs, actions, step.rewards, step.final_observations, terminal);
+		return;
+	}
+
+	const int64_t* a = actions.data_ptr<int64_t>();
+	const float* r = step.rewards.data_ptr<float>();
+	const int64_t* done = step.dones.data_ptr<int64_t>();
+	for(int64_t e = 0; e < obs.size(0); e++) {
+		Transition t;
+		t.state = obs[e];
+		t.action = a[e];
+		t.reward = r[e];
+		t.next_state = step.final_observations[e];
+		t.done = done[e] == kTrap || done[e] == kGoal;
+		for(auto& ready : n_step_[e].push(t))
+			memory_->add(ready);
+		// a time limit cuts the episode without making it terminal
+		if( done[e] == kTimeLimit )
+			for(auto& ready : n_step_[e].flush())
+				memory_->add(ready);
+	}
+}
+
+torch::Tensor DQNTrainer::update() {
+	ReplayBatch b = memory_->sample(config_.batch_size);
+	auto states = b.states.to(config_.device), next_states = b.next_states.to(config_.device);
+	auto q = online->forward(states).gather(1, b.actions.to(config_.device));
+
+	torch::Tensor y;
+	{
+		torch::NoGradGuard no_grad;
+		auto next_q = target->forward(next_states);
+		torch::Tensor next_v;
+		if( config_.double_dqn )
+			next_v = next_q.gather(1, online->forward(next_states).argmax(1, true));
+		else
+			next_v = std::get<0>(next_q.max(1, true));
+		auto discount = torch::pow(config_.gamma, b.steps) * (1 - b.dones);
+		y = b.rewards.to(config_.device) + discount.to(config_.device) * next_v;
+	}
+
+	auto td_error = y - q;
+	auto loss = (b.weights.to(config_.device) * td_error.square()).mean();
+	optimizer_->zero_grad();
+	loss.backward();
+	if( config_.max_grad_norm > 0.0 )
+		clip_grad_norm_fused(online->parameters(), config_.max_grad_norm);
+	optimizer_->step();
+
+	if( config_.prioritized )
+		static_cast<PrioritizedReplayBuffer&>(*memory_).update_priorities(b.indices, td_error);
+	if( ++updates_ % config_.target_update_every == 0 )
+		update_target();
+	return loss.detach();
+}
+
+void DQNTrainer::update_target() {
+	torch::NoGradGuard no_grad;
+	target_flat_.lerp_(online_flat_, config_.tau);
+}
+
+void DQNTrainer::train(int64_t num_steps) {
+	for(int64_t i = 0; i < num_steps; i++) {
+		auto actions = act(obs_, epsilon());
+		VecStep step = env_.step(actions);
+		store(obs_, actions, step);
+		obs_ = step.observations;
+		steps_ += 1;
+
+		const int64_t* done = step.dones.data_ptr<int64_t>();
+		for(int64_t e = 0; e < env_.num_envs(); e++) {
+			successes_ += done[e] == kGoal;
+			failures_ += done[e] == kTrap;
+		}
+
+		if( config_.prioritized ) {
+			double progress = std::min(1.0, static_cast<double>(steps_) / config_.beta_steps);
+			static_cast<PrioritizedReplayBuffer&>(*memory_).beta = config_.beta_start + (1.0 - config_.beta_start) * progress;
+		}
+
+		if( memory_->size() >= std::max(config_.learning_starts, config_.batch_size) )
+			for(int64_t g = 0; g < config_.gradient_steps; g++)
+				update();
+
+		if( config_.eval_every > 0 && steps_ % config_.eval_every == 0 ) {
+			EvalResult r = evaluate(config_.eval_episodes);
+			std::cout << "Step: " << steps_ << " epsilon: " << epsilon() << " eval return: " << r.mean_return
+					  << " success: " << r.success_rate << " length: " << r.mean_length << '\n';
+		}
+	}
+}
+
+EvalResult DQNTrainer::evaluate(int64_t episodes) {
+	// a (nearly) greedy policy can walk in circles, so evaluation always has a time limit
+	GridWorldSpec spec = env_.spec();
+	if( spec.max_steps <= 0 )
+		spec.max_steps = 4 * spec.rows * spec.cols;
+	VecGridEnv eval_env(episodes, spec);
+
+	std::vector<double> returns(episodes, 0.0);
+	std::vector<int64_t> lengths(episodes, 0);
+	std::vector<bool> finished(episodes, false);
+	int64_t remaining = episodes, successes = 0;
+	auto obs = eval_env.reset();
+	while( remaining > 0 ) {
+		VecStep step = eval_env.step(act(obs, config_.eval_epsilon));
+		const float* r = step.rewards.data_ptr<float>();
+		const int64_t* done = step.dones.data_ptr<int64_t>();
+		for(int64_t e = 0; e < episodes; e++) {
+			if( finished[e] )
+				continue;
+			returns[e] += r[e];
+			lengths[e] += 1;
+			if( done[e] != kRunning ) {
+				finished[e] = true;
+				successes += done[e] == kGoal;
+				remaining -= 1;
+			}
+		}
+		obs = step.observations;
+	}
+
+	EvalResult result;
+	for(int64_t e = 0; e < episodes; e++) {
+		result.mean_return += returns[e] / episodes;
+		result.mean_length += static_cast<double>(lengths[e]) / episodes;
+	}
+	result.success_rate = static_cast<double>(successes) / episodes;
+	return result;
+}
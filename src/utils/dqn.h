@@ -0,0 +1,94 @@
+#include <torch/torch.h>
+#include <memory>
+#include <vector>
+
+#include "ch_19_util.h"
+#include "lr_scheduler.h"
+
+#ifndef SRC_UTILS_DQN_H_
+#define SRC_UTILS_DQN_H_
+
+// The chapter 19 Q network: a conv layer over the observation planes (5 x 5 kernel), 16 hidden units
+// and one output per action. With dueling = true the output layer gives the action advantages A and
+// a second head the state value V, combined as Q = V + A - mean(A) (Wang et al., 2016).
+struct QNetImpl : public torch::nn::Module {
+	QNetImpl(std::vector<int64_t> obs_shape = {3, 5, 5}, int64_t n_actions = 4, bool dueling = false);
+	torch::Tensor forward(torch::Tensor x);
+
+	torch::nn::Conv2d c1{nullptr};
+	torch::nn::Linear f1{nullptr}, f2{nullptr}, value{nullptr};
+	bool dueling;
+};
+TORCH_MODULE(QNet);
+
+struct DQNConfig {
+	bool double_dqn = true;			// online net picks the next action, target net rates it
+	bool dueling = true;
+	bool prioritized = false;
+	int n_step = 1;
+	int64_t memory_capacity = 2000, batch_size = 32;
+	int64_t learning_starts = 500;		// transitions in memory before the first update
+	int64_t gradient_steps = 1;		// updates per vectorised environment step
+	double lr = 0.01, gamma = 0.9;
+	double max_grad_norm = 10.0;		// 0 for no clipping
+	// target <- target + tau * (online - target) every target_update_every updates; tau = 1 is a hard copy
+	double tau = 0.01;
+	int64_t target_update_every = 1;
+	// epsilon = epsilon_end + (epsilon_start - epsilon_end) * schedule(step), step in environment steps;
+	// linear over epsilon_decay_steps when no schedule is given
+	double epsilon_start = 1.0, epsilon_end = 0.05;
+	int64_t epsilon_decay_steps = 1000;
+	LRSchedulePtr epsilon_schedule;
+	// prioritised replay: beta annealed linearly from beta_start to 1 over beta_steps environment steps
+	double beta_start = 0.4;
+	int64_t beta_steps = 2000;
+	// evaluation on eval_episodes fresh episodes every eval_every environment steps (0: never). The grid
+	// world is deterministic, so a purely greedy policy plays the same episode every time; acting with a
+	// small eval_epsilon makes the episodes differ and success_rate a rate rather than 0 or 1
+	int64_t eval_every = 0, eval_episodes = 20;
+	double eval_epsilon = 0.05;
+	torch::Device device = torch::kCPU;
+};
+
+struct EvalResult {
+	double mean_return = 0, success_rate = 0, mean_length = 0;
+};
+
+// DQN on a VecGridEnv: epsilon-greedy acting on the whole batch of environments, replay through
+// ReplayBuffer / PrioritizedReplayBuffer with n-step returns, Double DQN targets and Polyak target
+// updates. The parameters of each net live in one flat buffer, so a soft update is a single lerp_.
+class DQNTrainer {
+public:
+	DQNTrainer(VecGridEnv& env, DQNConfig config = DQNConfig());
+
+	// runs num_steps vectorised environment steps
+	void train(int64_t num_steps);
+	// one gradient step on a replay batch; returns the loss (0-d tensor)
+	torch::Tensor update();
+	void update_target();
+	// epsilon-greedy actions (N) for observations (N, ...)
+	torch::Tensor act(const torch::Tensor& obs, double epsilon);
+	// epsilon-greedy policy (config.eval_epsilon) on `episodes` parallel episodes of the environment layout
+	EvalResult evaluate(int64_t episodes);
+
+	double epsilon() const;
+	int64_t steps() const { return steps_; }
+	int64_t episodes() const { return successes_ + failures_; }
+	int64_t successes() const { return successes_; }
+	int64_t failures() const { return failures_; }
+
+	QNet online{nullptr}, target{nullptr};
+
+private:
+	void store(const torch::Tensor& obs, const torch::Tensor& actions, const VecStep& step);
+
+	VecGridEnv& env_;
+	DQNConfig config_;
+	std::unique_ptr<ReplayBuffer> memory_;
+	std::vector<NStepAccumulator> n_step_;
+	std::unique_ptr<torch::optim::Adam> optimizer_;
+	torch::Tensor online_flat_, target_flat_, obs_;
+	int64_t steps_ = 0, updates_ = 0, successes_ = 0, failures_ = 0;
+};
+
+#endif /* SRC_UTILS_DQN_H_ */
@@ -0,0 +1,258 @@
+#include "large_batch.h"
+
+#include <cmath>
+#include <torch/optim/serialize.h>
+
+
+torch::Tensor clip_grad_norm_fused(const std::vector<torch::Tensor>& params, double max_norm) {
+	std::vector<torch::Tensor> grads;
+	for(const auto& p : params)
+		if( p.grad().defined() )
+			grads.push_back(p.grad());
+	if( grads.empty() )
+		return torch::zeros({});
+
+	torch::NoGradGuard no_grad;
+	auto total_norm = torch::linalg_vector_norm(torch::stack(torch::_foreach_norm(grads)), 2);
+	if( max_norm > 0.0 ) {
+		auto clip_coef = (max_norm / (total_norm + 1e-6)).clamp_max(1.0);
+		torch::_foreach_mul_(grads, clip_coef);
+	}
+	return total_norm;
+}
+
+// -----------------------------------------------------------
+// GradientAccumulator
+// -----------------------------------------------------------
+GradientAccumulator::GradientAccumulator(torch::optim::Optimizer& optimizer, std::vector<torch::Tensor> params,
+										 int64_t accumulation_steps, double max_grad_norm)
+	: optimizer_(optimizer), params_(params), accumulation_steps_(accumulation_steps), max_grad_norm_(max_grad_norm) {
+	TORCH_CHECK(accumulation_steps_ > 0, "GradientAccumulator: accumulation_steps must be positive");
+}
+
+void GradientAccumulator::apply_step() {
+	if( max_grad_norm_ > 0.0 )
+		last_norm_ = clip_grad_norm_fused(params_, max_grad_norm_);
+	optimizer_.step();
+	optimizer_.zero_grad();
+	pending_ = 0;
+}
+
+bool GradientAccumulator::backward(const torch::Tensor& loss) {
+	(loss / static_cast<double>(accumulation_steps_)).backward();
+	if( ++pending_ < accumulation_steps_ )
+		return false;
+	apply_step();
+	return true;
+}
+
+bool GradientAccumulator::flush() {
+	if( pending_ == 0 )
+		return false;
+	if( pending_ < accumulation_steps_ ) {
+		// the gradients were scaled for a full accumulation
+		torch::NoGradGuard no_grad;
+		std::vector<torch::Tensor> grads;
+		for(const auto& p : params_)
+			if( p.grad().defined() )
+				grads.push_back(p.grad());
+		if( ! grads.empty() )
+			torch::_foreach_mul_(grads, static_cast<double>(accumulation_steps_) / pending_);
+	}
+	apply_step();
+	return true;
+}
+
+// Per-tensor trust ratios coefficient * ||p|| / (||u|| + eps), 1 where either norm is zero.
+// One multi-tensor reduction per list, no host sync.
+static torch::Tensor trust_ratios(const std::vector<torch::Tensor>& params, const std::vector<torch::Tensor>& updates,
+								  double coefficient, double eps) {
+	auto p_norm = torch::stack(torch::_foreach_norm(params));
+	auto u_norm = torch::stack(torch::_foreach_norm(updates));
+	auto ratio = coefficient * p_norm / (u_norm + eps);
+	return torch::where((p_norm > 0) & (u_norm > 0), ratio, torch::ones_like(ratio));
+}
+
+// -----------------------------------------------------------
+// LARS
+// -----------------------------------------------------------
+void LARSOptions::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(lr);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(momentum);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(weight_decay);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(trust_coefficient);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(eps);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exclude_1d);
+}
+
+void LARSOptions::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, lr);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, momentum);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, weight_decay);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, trust_coefficient);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, eps);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(bool, exclude_1d);
+}
+
+void LARSParamState::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(momentum_buffer);
+}
+
+void LARSParamState::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, momentum_buffer);
+}
+
+void LARS::save(torch::serialize::OutputArchive& archive) const {
+	torch::optim::serialize(*this, archive);
+}
+
+void LARS::load(torch::serialize::InputArchive& archive) {
+	torch::optim::serialize<LARSParamState, LARSOptions>(*this, archive);
+}
+
+torch::Tensor LARS::step(LossClosure closure) {
+	torch::NoGradGuard no_grad;
+	torch::Tensor loss = {};
+	if( closure != nullptr ) {
+		at::AutoGradMode enable_grad(true);
+		loss = closure();
+	}
+
+	for(auto& group : param_groups_) {
+		auto& options = static_cast<LARSOptions&>(group.options());
+
+		std::vector<torch::Tensor> adapted_params, adapted_updates;
+		std::vector<torch::Tensor> plain_params, plain_updates;
+		for(auto& p : group.params()) {
+			if( ! p.grad().defined() )
+				continue;
+			if( options.exclude_1d() && p.dim() <= 1 ) {
+				plain_params.push_back(p);
+				plain_updates.push_back(p.grad());
+			} else {
+				adapted_params.push_back(p);
+				adapted_updates.push_back(options.weight_decay() != 0.0
+										  ? p.grad().add(p, options.weight_decay()) : p.grad());
+			}
+		}
+
+		if( ! adapted_params.empty() ) {
+			auto ratio = trust_ratios(adapted_params, adapted_updates, options.trust_coefficient(), options.eps());
+			for(size_t i = 0; i < adapted_updates.size(); i++)
+				adapted_updates[i] = adapted_updates[i] * ratio[i];
+		}
+
+		adapted_params.insert(adapted_params.end(), plain_params.begin(), plain_params.end());
+		adapted_updates.insert(adapted_updates.end(), plain_updates.begin(), plain_updates.end());
+
+		for(size_t i = 0; i < adapted_params.size(); i++) {
+			auto& p = adapted_params[i];
+			auto& update = adapted_updates[i];
+			auto& state = state_[p.unsafeGetTensorImpl()];
+			if( ! state ) {
+				auto s = std::make_unique<LARSParamState>();
+				s->momentum_buffer(update.clone());
+				state = std::move(s);
+			} else {
+				static_cast<LARSParamState&>(*state).momentum_buffer().mul_(options.momentum()).add_(update);
+			}
+			p.add_(static_cast<LARSParamState&>(*state).momentum_buffer(), -options.lr());
+		}
+	}
+	return loss;
+}
+
+// -----------------------------------------------------------
+// LAMB
+// -----------------------------------------------------------
+void LAMBOptions::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(lr);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(beta1);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(beta2);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(eps);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(weight_decay);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exclude_1d);
+}
+
+void LAMBOptions::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, lr);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, beta1);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, beta2);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, eps);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, weight_decay);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(bool, exclude_1d);
+}
+
+void LAMBParamState::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(step);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exp_avg);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exp_avg_sq);
+}
+
+void LAMBParamState::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(int64_t, step);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, exp_avg);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, exp_avg_sq);
+}
+
+void LAMB::save(torch::serialize::OutputArchive& archive) const {
+	torch::optim::serialize(*this, archive);
+}
+
+void LAMB::load(torch::serialize::InputArchive& archive) {
+	torch::optim::serialize<LAMBParamState, LAMBOptions>(*this, archive);
+}
+
+torch::Tensor LAMB::step(LossClosure closure) {
+	torch::NoGradGuard no_grad;
+	torch::Tensor loss = {};
+	if( closure != nullptr ) {
+		at::AutoGradMode enable_grad(true);
+		loss = closure();
+	}
+
+	for(auto& group : param_groups_) {
+		auto& options = static_cast<LAMBOptions&>(group.options());
+
+		std::vector<torch::Tensor> adapted_params, adapted_updates;
+		for(auto& p : group.params()) {
+			if( ! p.grad().defined() )
+				continue;
+			const auto& grad = p.grad();
+
+			auto& state_ptr = state_[p.unsafeGetTensorImpl()];
+			if( ! state_ptr ) {
+				auto s = std::make_unique<LAMBParamState>();
+				s->exp_avg(torch::zeros_like(p, torch::MemoryFormat::Preserve));
+				s->exp_avg_sq(torch::zeros_like(p, torch::MemoryFormat::Preserve));
+				state_ptr = std::move(s);
+			}
+			auto& state = static_cast<LAMBParamState&>(*state_ptr);
+			state.step(state.step() + 1);
+
+			state.exp_avg().lerp_(grad, 1.0 - options.beta1());
+			state.exp_avg_sq().mul_(options.beta2()).addcmul_(grad, grad, 1.0 - options.beta2());
+
+			double bias_correction1 = 1.0 - std::pow(options.beta1(), state.step());
+			double bias_correction2 = 1.0 - std::pow(options.beta2(), state.step());
+			auto update = (state.exp_avg() / bias_correction1)
+							.div_((state.exp_avg_sq() / bias_correction2).sqrt_().add_(options.eps()));
+
+			if( options.exclude_1d() && p.dim() <= 1 ) {
+				p.add_(update, -options.lr());
+			} else {
+				if( options.weight_decay() != 0.0 )
+					update.add_(p, options.weight_decay());
+				adapted_params.push_back(p);
+				adapted_updates.push_back(update);
+			}
+		}
+
+		if( ! adapted_params.empty() ) {
+			auto ratio = trust_ratios(adapted_params, adapted_updates, 1.0, 0.0);
+			for(size_t i = 0; i < adapted_params.size(); i++)
+				adapted_params[i].sub_(adapted_updates[i] * (ratio[i] * options.lr()));
+		}
+	}
+	return loss;
+}
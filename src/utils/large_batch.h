@@ -0,0 +1,129 @@
+#include <torch/torch.h>
+#include <vector>
+
+#ifndef SRC_UTILS_LARGE_BATCH_H_
+#define SRC_UTILS_LARGE_BATCH_H_
+
+// Large-batch training on memory-limited nodes: gradient accumulation over micro-batches, global
+// norm clipping in one multi-tensor reduction, and the layer-wise adaptive optimizers LARS and LAMB
+// that keep large effective batches stable. LARS and LAMB are ordinary torch::optim::Optimizers,
+// so they work with LRScheduler (utils/lr_scheduler.h) and torch::save / torch::load.
+
+// Clips the gradients of `params` to a global L2 norm of max_norm. The per-tensor norms come from
+// a single _foreach_norm, and the clip coefficient stays on the device, so there is no host sync.
+// Returns the norm before clipping (a 0-d tensor).
+torch::Tensor clip_grad_norm_fused(const std::vector<torch::Tensor>& params, double max_norm);
+
+// Accumulates the gradients of `accumulation_steps` micro-batches and then steps the optimizer.
+//
+//	GradientAccumulator acc(optimizer, model->parameters(), 8, 1.0);
+//	for(auto& batch : loader)
+//		acc.backward(loss_of(batch));		// loss averaged over the micro-batch
+//	acc.flush();						// steps on a partially filled accumulation
+//
+// Each micro-batch loss is scaled by 1/accumulation_steps, so the accumulated gradient is the mean
+// over the effective batch.
+class GradientAccumulator {
+public:
+	GradientAccumulator(torch::optim::Optimizer& optimizer, std::vector<torch::Tensor> params,
+						int64_t accumulation_steps, double max_grad_norm = 0.0);
+
+	// backpropagates one micro-batch; returns true when this call stepped the optimizer
+	bool backward(const torch::Tensor& loss);
+	// steps on the micro-batches accumulated so far (rescaled to their mean), if any
+	bool flush();
+
+	int64_t accumulation_steps() const { return accumulation_steps_; }
+	// global gradient norm of the last clipped step (0-d tensor; undefined without clipping)
+	torch::Tensor last_grad_norm() const { return last_norm_; }
+
+private:
+	void apply_step();
+
+	torch::optim::Optimizer& optimizer_;
+	std::vector<torch::Tensor> params_;
+	int64_t accumulation_steps_;
+	double max_grad_norm_;
+	int64_t pending_ = 0;
+	torch::Tensor last_norm_;
+};
+
+// -----------------------------------------------------------
+// LARS (You et al., 2017)
+// -----------------------------------------------------------
+struct LARSOptions : public torch::optim::OptimizerCloneableOptions<LARSOptions> {
+	LARSOptions(double lr = 0.1) : lr_(lr) {}
+	TORCH_ARG(double, lr);
+	TORCH_ARG(double, momentum) = 0.9;
+	TORCH_ARG(double, weight_decay) = 0.0;
+	TORCH_ARG(double, trust_coefficient) = 0.001;
+	TORCH_ARG(double, eps) = 1e-8;
+	// 1-D parameters (biases, norm layers) get neither weight decay nor layer-wise scaling
+	TORCH_ARG(bool, exclude_1d) = true;
+
+	double get_lr() const override { return lr(); }
+	void set_lr(const double lr) override { this->lr(lr); }
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+struct LARSParamState : public torch::optim::OptimizerCloneableParamState<LARSParamState> {
+	TORCH_ARG(torch::Tensor, momentum_buffer);
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+// update = g + wd * p, scaled per tensor by trust_coefficient * ||p|| / ||update||, then SGD with
+// momentum.
+class LARS : public torch::optim::Optimizer {
+public:
+	explicit LARS(std::vector<torch::Tensor> params, LARSOptions defaults = LARSOptions())
+		: torch::optim::Optimizer({torch::optim::OptimizerParamGroup(params)},
+								  std::make_unique<LARSOptions>(defaults)) {}
+
+	torch::Tensor step(LossClosure closure = nullptr) override;
+	// options and per-parameter state, so that checkpoints resume the momentum / moments
+	void save(torch::serialize::OutputArchive& archive) const override;
+	void load(torch::serialize::InputArchive& archive) override;
+};
+
+// -----------------------------------------------------------
+// LAMB (You et al., 2019)
+// -----------------------------------------------------------
+struct LAMBOptions : public torch::optim::OptimizerCloneableOptions<LAMBOptions> {
+	LAMBOptions(double lr = 1e-3) : lr_(lr) {}
+	TORCH_ARG(double, lr);
+	TORCH_ARG(double, beta1) = 0.9;
+	TORCH_ARG(double, beta2) = 0.999;
+	TORCH_ARG(double, eps) = 1e-6;
+	TORCH_ARG(double, weight_decay) = 0.01;
+	TORCH_ARG(bool, exclude_1d) = true;
+
+	double get_lr() const override { return lr(); }
+	void set_lr(const double lr) override { this->lr(lr); }
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+struct LAMBParamState : public torch::optim::OptimizerCloneableParamState<LAMBParamState> {
+	TORCH_ARG(int64_t, step) = 0;
+	TORCH_ARG(torch::Tensor, exp_avg);
+	TORCH_ARG(torch::Tensor, exp_avg_sq);
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+// Adam direction r = m_hat / (sqrt(v_hat) + eps) + wd * p, scaled per tensor by ||p|| / ||r||.
+class LAMB : public torch::optim::Optimizer {
+public:
+	explicit LAMB(std::vector<torch::Tensor> params, LAMBOptions defaults = LAMBOptions())
+		: torch::optim::Optimizer({torch::optim::OptimizerParamGroup(params)},
+								  std::make_unique<LAMBOptions>(defaults)) {}
+
+	torch::Tensor step(LossClosure closure = nullptr) override;
+	// options and per-parameter state, so that checkpoints resume the momentum / moments
+	void save(torch::serialize::OutputArchive& archive) const override;
+	void load(torch::serialize::InputArchive& archive) override;
+};
+
+#endif /* SRC_UTILS_LARGE_BATCH_H_ */
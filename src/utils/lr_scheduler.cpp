@@ -0,0 +1,212 @@
+#include "lr_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+double LinearWarmup::multiplier(int64_t step) const {
+	if( step >= warmup_steps_ )
+		return 1.0;
+	return start_factor_ + (1.0 - start_factor_) * static_cast<double>(step) / warmup_steps_;
+}
+
+double StepDecay::multiplier(int64_t step) const {
+	return std::max(min_factor_, std::pow(gamma_, static_cast<double>(step / step_size_)));
+}
+
+double MultiStepDecay::multiplier(int64_t step) const {
+	auto passed = std::count_if(milestones_.begin(), milestones_.end(), [step](int64_t m) { return step >= m; });
+	return std::pow(gamma_, static_cast<double>(passed));
+}
+
+double InverseSqrtDecay::multiplier(int64_t step) const {
+	return std::pow(step + 1.0, -0.5);
+}
+
+double PolynomialDecay::multiplier(int64_t step) const {
+	double progress = std::min(1.0, static_cast<double>(step) / total_steps_);
+	return end_factor_ + (1.0 - end_factor_) * std::pow(1.0 - progress, power_);
+}
+
+double CosineAnnealing::multiplier(int64_t step) const {
+	double progress = std::min(1.0, static_cast<double>(step) / total_steps_);
+	return min_factor_ + (1.0 - min_factor_) * (1.0 + std::cos(M_PI * progress)) / 2.0;
+}
+
+double CosineWithRestarts::multiplier(int64_t step) const {
+	int64_t length = cycle_steps_;
+	while( step >= length ) {
+		step -= length;
+		length *= cycle_mult_;
+	}
+	return min_factor_ + (1.0 - min_factor_) * (1.0 + std::cos(M_PI * step / length)) / 2.0;
+}
+
+double OneCycle::multiplier(int64_t step) const {
+	auto anneal = [](double from, double to, double progress) {
+		return to + (from - to) * (1.0 + std::cos(M_PI * std::min(1.0, progress))) / 2.0;
+	};
+	double initial = 1.0 / div_factor_, final = initial / final_div_factor_;
+	double up = std::max(1.0, pct_start_ * total_steps_ - 1.0);
+	double down = std::max(1.0, total_steps_ - 1.0 - up);
+	if( step <= up )
+		return anneal(initial, 1.0, step / up);
+	return anneal(1.0, final, (step - up) / down);
+}
+
+// -----------------------------------------------------------
+// ReduceOnPlateau
+// -----------------------------------------------------------
+void ReduceOnPlateau::observe(int64_t step, double metric) {
+	bool better = ! has_best_
+			|| (mode_ == Mode::Min ? metric < best_ * (1.0 - threshold_) : metric > best_ * (1.0 + threshold_));
+	if( better ) {
+		best_ = metric;
+		has_best_ = true;
+		num_bad_ = 0;
+	} else {
+		num_bad_++;
+	}
+
+	if( cooldown_left_ > 0 ) {
+		cooldown_left_--;
+		num_bad_ = 0;
+	}
+
+	if( num_bad_ > patience_ ) {
+		current_ = std::max(current_ * factor_, min_factor_);
+		cooldown_left_ = cooldown_;
+		num_bad_ = 0;
+	}
+}
+
+void ReduceOnPlateau::save(torch::serialize::OutputArchive& archive, const std::string& prefix) const {
+	archive.write(prefix + "plateau", torch::tensor({current_, best_, has_best_ ? 1.0 : 0.0,
+													 static_cast<double>(num_bad_), static_cast<double>(cooldown_left_)},
+													torch::kDouble));
+}
+
+void ReduceOnPlateau::load(torch::serialize::InputArchive& archive, const std::string& prefix) {
+	torch::Tensor state;
+	archive.read(prefix + "plateau", state);
+	auto s = state.accessor<double, 1>();
+	current_ = s[0];
+	best_ = s[1];
+	has_best_ = s[2] != 0.0;
+	num_bad_ = static_cast<int64_t>(s[3]);
+	cooldown_left_ = static_cast<int64_t>(s[4]);
+}
+
+// -----------------------------------------------------------
+// Composition
+// -----------------------------------------------------------
+double ChainedSchedule::multiplier(int64_t step) const {
+	double m = 1.0;
+	for(const auto& s : schedules_)
+		m *= s->multiplier(step);
+	return m;
+}
+
+void ChainedSchedule::observe(int64_t step, double metric) {
+	for(auto& s : schedules_)
+		s->observe(step, metric);
+}
+
+void ChainedSchedule::save(torch::serialize::OutputArchive& archive, const std::string& prefix) const {
+	for(size_t i = 0; i < schedules_.size(); i++)
+		schedules_[i]->save(archive, prefix + std::to_string(i) + ".");
+}
+
+void ChainedSchedule::load(torch::serialize::InputArchive& archive, const std::string& prefix) {
+	for(size_t i = 0; i < schedules_.size(); i++)
+		schedules_[i]->load(archive, prefix + std::to_string(i) + ".");
+}
+
+SequentialSchedule::SequentialSchedule(std::vector<LRSchedulePtr> schedules, std::vector<int64_t> milestones)
+	: schedules_(schedules), milestones_(milestones) {
+	TORCH_CHECK(schedules_.size() == milestones_.size() + 1,
+				"SequentialSchedule: expected one milestone less than schedules");
+	TORCH_CHECK(std::is_sorted(milestones_.begin(), milestones_.end()), "SequentialSchedule: unsorted milestones");
+}
+
+std::pair<size_t, int64_t> SequentialSchedule::locate(int64_t step) const {
+	size_t i = std::upper_bound(milestones_.begin(), milestones_.end(), step) - milestones_.begin();
+	return {i, i == 0 ? step : step - milestones_[i - 1]};
+}
+
+double SequentialSchedule::multiplier(int64_t step) const {
+	auto [i, local] = locate(step);
+	return schedules_[i]->multiplier(local);
+}
+
+void SequentialSchedule::observe(int64_t step, double metric) {
+	auto [i, local] = locate(step);
+	schedules_[i]->observe(local, metric);
+}
+
+void SequentialSchedule::save(torch::serialize::OutputArchive& archive, const std::string& prefix) const {
+	for(size_t i = 0; i < schedules_.size(); i++)
+		schedules_[i]->save(archive, prefix + std::to_string(i) + ".");
+}
+
+void SequentialSchedule::load(torch::serialize::InputArchive& archive, const std::string& prefix) {
+	for(size_t i = 0; i < schedules_.size(); i++)
+		schedules_[i]->load(archive, prefix + std::to_string(i) + ".");
+}
+
+// -----------------------------------------------------------
+// LRScheduler
+// -----------------------------------------------------------
+LRScheduler::LRScheduler(torch::optim::Optimizer& optimizer, LRSchedulePtr schedule)
+	: optimizer_(optimizer), schedule_(schedule) {
+	for(auto& group : optimizer_.param_groups())
+		base_lrs_.push_back(group.options().get_lr());
+	apply();
+}
+
+void LRScheduler::apply() {
+	double m = schedule_->multiplier(step_);
+	auto& groups = optimizer_.param_groups();
+	for(size_t i = 0; i < groups.size() && i < base_lrs_.size(); i++)
+		groups[i].options().set_lr(base_lrs_[i] * m);
+}
+
+void LRScheduler::step() {
+	step_++;
+	apply();
+}
+
+void LRScheduler::step(double metric) {
+	schedule_->observe(step_, metric);
+	step();
+}
+
+double LRScheduler::get_lr() const {
+	return optimizer_.param_groups().at(0).options().get_lr();
+}
+
+void LRScheduler::save(torch::serialize::OutputArchive& archive) const {
+	archive.write("step", torch::tensor({step_}, torch::kLong));
+	archive.write("base_lrs", torch::tensor(base_lrs_, torch::kDouble));
+	schedule_->save(archive, "schedule.");
+}
+
+void LRScheduler::load(torch::serialize::InputArchive& archive) {
+	torch::Tensor step, base_lrs;
+	archive.read("step", step);
+	archive.read("base_lrs", base_lrs);
+	step_ = step.item<int64_t>();
+	base_lrs_ = std::vector<double>(base_lrs.data_ptr<double>(), base_lrs.data_ptr<double>() + base_lrs.numel());
+	schedule_->load(archive, "schedule.");
+	apply();
+}
+
+torch::serialize::OutputArchive& operator<<(torch::serialize::OutputArchive& archive, const LRScheduler& scheduler) {
+	scheduler.save(archive);
+	return archive;
+}
+
+torch::serialize::InputArchive& operator>>(torch::serialize::InputArchive& archive, LRScheduler& scheduler) {
+	scheduler.load(archive);
+	return archive;
+}
@@ -0,0 +1,234 @@
+#include <torch/torch.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef SRC_UTILS_LR_SCHEDULER_H_
+#define SRC_UTILS_LR_SCHEDULER_H_
+
+// Learning rate schedules for any torch::optim::Optimizer.
+//
+// A schedule maps the step count to a multiplier of the base learning rate of each param group.
+// Whether a step is an iteration or an epoch is up to the caller: the lengths given to a schedule
+// are in the units of LRScheduler::step() calls. Schedules compose: ChainedSchedule multiplies
+// them (e.g. warmup x plateau reduction), SequentialSchedule switches between them at milestones
+// (e.g. warmup, then cosine). Stateful schedules (ReduceOnPlateau) save their state together with
+// the step count, so a resumed run continues with the same learning rates.
+
+class LRSchedule {
+public:
+	virtual ~LRSchedule() = default;
+
+	virtual double multiplier(int64_t step) const = 0;
+	// metric observed at `step`, for metric-driven schedules; a no-op for the others
+	virtual void observe(int64_t step, double metric) {}
+
+	virtual void save(torch::serialize::OutputArchive& archive, const std::string& prefix) const {}
+	virtual void load(torch::serialize::InputArchive& archive, const std::string& prefix) {}
+};
+
+using LRSchedulePtr = std::shared_ptr<LRSchedule>;
+
+class ConstantSchedule : public LRSchedule {
+public:
+	double multiplier(int64_t step) const override { return 1.0; }
+};
+
+// Ramps linearly from start_factor to 1 over warmup_steps, then stays at 1.
+class LinearWarmup : public LRSchedule {
+public:
+	explicit LinearWarmup(int64_t warmup_steps, double start_factor = 0.0)
+		: warmup_steps_(warmup_steps), start_factor_(start_factor) {}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t warmup_steps_;
+	double start_factor_;
+};
+
+// gamma^(step / step_size); never below min_factor.
+class StepDecay : public LRSchedule {
+public:
+	StepDecay(int64_t step_size, double gamma, double min_factor = 0.0)
+		: step_size_(step_size), gamma_(gamma), min_factor_(min_factor) {
+		TORCH_CHECK(step_size_ > 0, "StepDecay: step_size must be positive");
+	}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t step_size_;
+	double gamma_, min_factor_;
+};
+
+// gamma^(number of milestones passed)
+class MultiStepDecay : public LRSchedule {
+public:
+	MultiStepDecay(std::vector<int64_t> milestones, double gamma) : milestones_(milestones), gamma_(gamma) {}
+	double multiplier(int64_t step) const override;
+
+private:
+	std::vector<int64_t> milestones_;
+	double gamma_;
+};
+
+// 1 / sqrt(step + 1)
+class InverseSqrtDecay : public LRSchedule {
+public:
+	double multiplier(int64_t step) const override;
+};
+
+// (1 - step / total_steps)^power down to end_factor, then held.
+class PolynomialDecay : public LRSchedule {
+public:
+	PolynomialDecay(int64_t total_steps, double power = 1.0, double end_factor = 0.0)
+		: total_steps_(total_steps), power_(power), end_factor_(end_factor) {
+		TORCH_CHECK(total_steps_ > 0, "PolynomialDecay: total_steps must be positive");
+	}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t total_steps_;
+	double power_, end_factor_;
+};
+
+// Half a cosine from 1 to min_factor over total_steps, then held.
+class CosineAnnealing : public LRSchedule {
+public:
+	CosineAnnealing(int64_t total_steps, double min_factor = 0.0)
+		: total_steps_(total_steps), min_factor_(min_factor) {
+		TORCH_CHECK(total_steps_ > 0, "CosineAnnealing: total_steps must be positive");
+	}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t total_steps_;
+	double min_factor_;
+};
+
+// SGDR: cosine annealing restarted after cycle_steps, each cycle cycle_mult times longer.
+class CosineWithRestarts : public LRSchedule {
+public:
+	CosineWithRestarts(int64_t cycle_steps, int64_t cycle_mult = 1, double min_factor = 0.0)
+		: cycle_steps_(cycle_steps), cycle_mult_(cycle_mult), min_factor_(min_factor) {
+		TORCH_CHECK(cycle_steps_ > 0, "CosineWithRestarts: cycle_steps must be positive");
+		TORCH_CHECK(cycle_mult_ >= 1, "CosineWithRestarts: cycle_mult must be at least 1");
+	}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t cycle_steps_, cycle_mult_;
+	double min_factor_;
+};
+
+// One-cycle policy: the base learning rate is the peak. Cosine from 1/div_factor up to 1 over
+// pct_start of total_steps, then down to 1/(div_factor * final_div_factor).
+class OneCycle : public LRSchedule {
+public:
+	OneCycle(int64_t total_steps, double pct_start = 0.3, double div_factor = 25.0, double final_div_factor = 1e4)
+		: total_steps_(total_steps), pct_start_(pct_start), div_factor_(div_factor), final_div_factor_(final_div_factor) {
+		TORCH_CHECK(total_steps_ > 2, "OneCycle: total_steps must be greater than 2");
+		TORCH_CHECK(pct_start_ > 0.0 && pct_start_ < 1.0, "OneCycle: pct_start must be in (0, 1)");
+	}
+	double multiplier(int64_t step) const override;
+
+private:
+	int64_t total_steps_;
+	double pct_start_, div_factor_, final_div_factor_;
+};
+
+// Multiplies the factor by `factor` when the observed metric has not improved by a relative
+// `threshold` for more than `patience` observations, then waits `cooldown` observations.
+class ReduceOnPlateau : public LRSchedule {
+public:
+	enum class Mode { Min, Max };
+
+	ReduceOnPlateau(Mode mode = Mode::Min, double factor = 0.1, int64_t patience = 10,
+					double threshold = 1e-4, int64_t cooldown = 0, double min_factor = 0.0)
+		: mode_(mode), factor_(factor), patience_(patience), threshold_(threshold),
+		  cooldown_(cooldown), min_factor_(min_factor) {}
+
+	double multiplier(int64_t step) const override { return current_; }
+	void observe(int64_t step, double metric) override;
+
+	void save(torch::serialize::OutputArchive& archive, const std::string& prefix) const override;
+	void load(torch::serialize::InputArchive& archive, const std::string& prefix) override;
+
+private:
+	Mode mode_;
+	double factor_;
+	int64_t patience_;
+	double threshold_;
+	int64_t cooldown_;
+	double min_factor_;
+
+	double current_ = 1.0;
+	double best_ = 0.0;
+	bool has_best_ = false;
+	int64_t num_bad_ = 0, cooldown_left_ = 0;
+};
+
+// Product of the multipliers of all schedules.
+class ChainedSchedule : public LRSchedule {
+public:
+	explicit ChainedSchedule(std::vector<LRSchedulePtr> schedules) : schedules_(schedules) {}
+
+	double multiplier(int64_t step) const override;
+	void observe(int64_t step, double metric) override;
+	void save(torch::serialize::OutputArchive& archive, const std::string& prefix) const override;
+	void load(torch::serialize::InputArchive& archive, const std::string& prefix) override;
+
+private:
+	std::vector<LRSchedulePtr> schedules_;
+};
+
+// schedules[i] runs from milestones[i - 1] on, counting its steps from there.
+class SequentialSchedule : public LRSchedule {
+public:
+	SequentialSchedule(std::vector<LRSchedulePtr> schedules, std::vector<int64_t> milestones);
+
+	double multiplier(int64_t step) const override;
+	void observe(int64_t step, double metric) override;
+	void save(torch::serialize::OutputArchive& archive, const std::string& prefix) const override;
+	void load(torch::serialize::InputArchive& archive, const std::string& prefix) override;
+
+private:
+	// index of the active schedule and the step relative to its start
+	std::pair<size_t, int64_t> locate(int64_t step) const;
+
+	std::vector<LRSchedulePtr> schedules_;
+	std::vector<int64_t> milestones_;
+};
+
+// Applies a schedule to the param groups of an optimizer. The base learning rates are taken from
+// the optimizer when the scheduler is created, and the multiplier of step 0 is applied at once.
+class LRScheduler {
+public:
+	LRScheduler(torch::optim::Optimizer& optimizer, LRSchedulePtr schedule);
+
+	// advances one step (iteration or epoch) and updates the learning rates
+	void step();
+	// feeds a metric to metric-driven schedules, then advances
+	void step(double metric);
+
+	int64_t step_count() const { return step_; }
+	// learning rate of the first param group
+	double get_lr() const;
+
+	void save(torch::serialize::OutputArchive& archive) const;
+	void load(torch::serialize::InputArchive& archive);
+
+private:
+	void apply();
+
+	torch::optim::Optimizer& optimizer_;
+	LRSchedulePtr schedule_;
+	std::vector<double> base_lrs_;
+	int64_t step_ = 0;
+};
+
+// so that torch::save(scheduler, path) / torch::load(scheduler, path) work
+torch::serialize::OutputArchive& operator<<(torch::serialize::OutputArchive& archive, const LRScheduler& scheduler);
+torch::serialize::InputArchive& operator>>(torch::serialize::InputArchive& archive, LRScheduler& scheduler);
+
+#endif /* SRC_UTILS_LR_SCHEDULER_H_ */
@@ -0,0 +1,185 @@
+#include "pruning.h"
+
+#include <chrono>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+
+// shrinks a parameter / buffer in place along `dim`; stale gradients of the old shape are dropped
+static void select_(torch::Tensor& t, int64_t dim, const torch::Tensor& indices) {
+	if( ! t.defined() )
+		return;
+	t.set_data(t.index_select(dim, indices.to(t.device())).contiguous());
+	if( t.grad().defined() )
+		t.mutable_grad() = torch::Tensor();
+}
+
+int64_t ChannelGroup::channels() const {
+	return producers.empty() ? 0 : producers[0]->weight.size(0);
+}
+
+torch::Tensor ChannelGroup::scores(ChannelScore score) const {
+	torch::NoGradGuard no_grad;
+	auto s = torch::zeros({channels()}, torch::kFloat);
+
+	if( score == ChannelScore::BNGamma && ! norms.empty() ) {
+		for(const auto& bn : norms)
+			if( bn->options.affine() )
+				s += bn->weight.detach().abs().to(torch::kCPU, torch::kFloat);
+		return s;
+	}
+
+	for(const auto& conv : producers)
+		s += conv->weight.detach().abs().flatten(1).mean(1).to(torch::kCPU, torch::kFloat);
+	return s;
+}
+
+void ChannelGroup::keep(const torch::Tensor& indices) {
+	torch::NoGradGuard no_grad;
+	int64_t k = indices.size(0);
+
+	for(auto& conv : producers) {
+		select_(conv->weight, 0, indices);
+		select_(conv->bias, 0, indices);
+		conv->options.out_channels(k);
+	}
+	for(auto& bn : norms) {
+		select_(bn->weight, 0, indices);
+		select_(bn->bias, 0, indices);
+		select_(bn->running_mean, 0, indices);
+		select_(bn->running_var, 0, indices);
+		bn->options.num_features(k);
+	}
+	for(auto& conv : consumers) {
+		select_(conv->weight, 1, indices);
+		conv->options.in_channels(k);
+	}
+	if( ! linear_consumers.empty() ) {
+		// channel c owns the flattened features [c * n, (c + 1) * n)
+		int64_t n = features_per_channel;
+		auto features = (indices.to(torch::kLong).unsqueeze(1) * n + torch::arange(n, torch::kLong).unsqueeze(0)).flatten();
+		for(auto& linear : linear_consumers) {
+			select_(linear->weight, 1, features);
+			linear->options.in_features(k * n);
+		}
+	}
+}
+
+std::vector<ChannelGroup> sequential_channel_groups(const torch::nn::Sequential& net, const torch::Tensor& sample) {
+	torch::NoGradGuard no_grad;
+	bool training = net->is_training();
+	net->eval();
+
+	std::vector<ChannelGroup> groups;
+	ChannelGroup current;
+	bool open = false;				// `current` has producers whose consumers are still to come
+
+	auto close = [&]() {
+		if( open && (! current.consumers.empty() || ! current.linear_consumers.empty()) )
+			groups.push_back(current);
+		current = ChannelGroup();
+		open = false;
+	};
+
+	torch::Tensor x = sample.to(net->parameters().empty() ? torch::kCPU : net->parameters()[0].device());
+
+	std::function<void(const torch::nn::Sequential&)> walk = [&](const torch::nn::Sequential& seq) {
+		for(auto& m : *seq) {
+			auto module = m.ptr();
+
+			if( auto inner = std::dynamic_pointer_cast<torch::nn::SequentialImpl>(module) ) {
+				walk(torch::nn::Sequential(inner));
+				continue;
+			}
+
+			if( auto conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(module) ) {
+				if( conv->options.groups() != 1 ) {
+					// grouped convolutions tie input and output channels: neither side is pruned
+					current = ChannelGroup();
+					open = false;
+				} else {
+					if( open )
+						current.consumers.push_back(torch::nn::Conv2d(conv));
+					close();
+					current.producers.push_back(torch::nn::Conv2d(conv));
+					open = true;
+				}
+			} else if( auto bn = std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(module) ) {
+				if( open )
+					current.norms.push_back(torch::nn::BatchNorm2d(bn));
+			} else if( auto linear = std::dynamic_pointer_cast<torch::nn::LinearImpl>(module) ) {
+				if( open ) {
+					current.linear_consumers.push_back(torch::nn::Linear(linear));
+					current.features_per_channel = x.size(1) / current.channels();
+				}
+				close();
+			} else if( ! (std::dynamic_pointer_cast<torch::nn::ReLUImpl>(module)
+						|| std::dynamic_pointer_cast<torch::nn::MaxPool2dImpl>(module)
+						|| std::dynamic_pointer_cast<torch::nn::AvgPool2dImpl>(module)
+						|| std::dynamic_pointer_cast<torch::nn::AdaptiveAvgPool2dImpl>(module)
+						|| std::dynamic_pointer_cast<torch::nn::FlattenImpl>(module)
+						|| std::dynamic_pointer_cast<torch::nn::DropoutImpl>(module)) ) {
+				// a module that may mix channels: leave the channels in front of it alone
+				current = ChannelGroup();
+				open = false;
+			}
+
+			x = m.forward(x);
+		}
+	};
+	walk(net);
+	// the last convolution without consumers produces the network output and is not pruned
+
+	net->train(training);
+	return groups;
+}
+
+int64_t prune_channels(std::vector<ChannelGroup>& groups, double ratio, ChannelScore score, int64_t min_channels) {
+	int64_t removed = 0;
+	for(auto& group : groups) {
+		int64_t n = group.channels();
+		int64_t k = std::max<int64_t>(min_channels, n - std::llround(n * ratio));
+		if( k >= 8 )
+			k = (k + 7) / 8 * 8;
+		if( k >= n )
+			continue;
+
+		auto keep = std::get<0>(std::get<1>(group.scores(score).topk(k)).sort());
+		group.keep(keep);
+		removed += n - k;
+	}
+	return removed;
+}
+
+void iterative_prune(const std::function<std::vector<ChannelGroup>()>& groups,
+					 const std::function<void(int)>& finetune,
+					 const PruningSchedule& schedule) {
+	for(int step = 0; step < schedule.steps; step++) {
+		auto g = groups();
+		int64_t removed = prune_channels(g, schedule.ratio_per_step, schedule.score);
+		std::cout << "pruning step " << (step + 1) << "/" << schedule.steps << ": removed "
+				  << removed << " channels\n";
+		finetune(step);
+	}
+}
+
+int64_t count_parameters(const torch::nn::Module& net) {
+	int64_t n = 0;
+	for(const auto& p : net.parameters())
+		n += p.numel();
+	return n;
+}
+
+double measure_latency_ms(const std::function<torch::Tensor(const torch::Tensor&)>& model,
+						  const torch::Tensor& input, int runs) {
+	torch::NoGradGuard no_grad;
+	for(int i = 0; i < 3; i++)
+		model(input);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(int i = 0; i < runs; i++)
+		model(input);
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count() / runs;
+}
@@ -0,0 +1,62 @@
+#include <torch/torch.h>
+#include <functional>
+#include <vector>
+
+#ifndef SRC_UTILS_PRUNING_H_
+#define SRC_UTILS_PRUNING_H_
+
+// Structured channel pruning. Channels are removed physically: the weights, biases and BatchNorm
+// statistics are shrunk in place and the module options are updated, so the pruned network is an
+// ordinary smaller dense model. Parameters change shape, so optimizers have to be created again
+// after every pruning step.
+
+enum class ChannelScore {
+	L1Norm,		// mean absolute weight of the producing convolutions
+	BNGamma		// |gamma| of the BatchNorms behind them (network slimming); L1 when there is none
+};
+
+// Channels that must be pruned together: the output channels of every producer convolution and
+// BatchNorm, and the input channels of every consumer. Convolutions joined by identity shortcuts
+// write into the same channels and belong to one group.
+struct ChannelGroup {
+	std::vector<torch::nn::Conv2d> producers;
+	std::vector<torch::nn::BatchNorm2d> norms;
+	std::vector<torch::nn::Conv2d> consumers;
+	std::vector<torch::nn::Linear> linear_consumers;
+	int64_t features_per_channel = 1;	// inputs of the linear consumers per channel, after a Flatten
+
+	int64_t channels() const;
+	torch::Tensor scores(ChannelScore score) const;
+	// keeps the given (sorted) channels
+	void keep(const torch::Tensor& indices);
+};
+
+// Channel groups of a plain Sequential CNN (VGG, NiN, AlexNet, nested Sequentials included).
+// sample: a (1, C, H, W) input, used to find the spatial size in front of a Flatten + Linear.
+std::vector<ChannelGroup> sequential_channel_groups(const torch::nn::Sequential& net, const torch::Tensor& sample);
+
+// Removes `ratio` of the channels of every group by lowest score. The kept count is rounded up to
+// a multiple of 8 for the vectorised conv kernels and never drops below min_channels.
+// Returns the number of channels removed.
+int64_t prune_channels(std::vector<ChannelGroup>& groups, double ratio,
+					   ChannelScore score = ChannelScore::BNGamma, int64_t min_channels = 8);
+
+struct PruningSchedule {
+	int steps = 3;
+	double ratio_per_step = 0.2;
+	ChannelScore score = ChannelScore::BNGamma;
+};
+
+// Prune-finetune loop: every step rebuilds the groups, prunes ratio_per_step of the remaining
+// channels and calls finetune(step), which creates its own optimizer for the new shapes.
+void iterative_prune(const std::function<std::vector<ChannelGroup>()>& groups,
+					 const std::function<void(int)>& finetune,
+					 const PruningSchedule& schedule = PruningSchedule());
+
+int64_t count_parameters(const torch::nn::Module& net);
+
+// mean latency over `runs` forward passes after a short warm-up
+double measure_latency_ms(const std::function<torch::Tensor(const torch::Tensor&)>& model,
+						  const torch::Tensor& input, int runs = 20);
+
+#endif /* SRC_UTILS_PRUNING_H_ */
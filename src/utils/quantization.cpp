@@ -0,0 +1,297 @@
+#include "quantization.h"
+
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <ATen/core/stack.h>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <variant>
+
+
+// The quantized kernels are registered with the dispatcher but have no C++ API of their own;
+// they are called boxed with the same arguments as torch.ops.quantized.* in Python.
+static c10::IValue call_quantized_op(const char* name, const char* overload, torch::jit::Stack stack) {
+	auto op = c10::Dispatcher::singleton().findSchemaOrThrow(name, overload);
+	op.callBoxed(&stack);
+	return stack.at(0);
+}
+
+// symmetric per output channel qint8 weights, zero point 0 as required by FBGEMM
+static torch::Tensor quantize_weight_per_channel(const torch::Tensor& weight) {
+	auto scales = weight.abs().flatten(1).amax(1).div(127.0).clamp_min(1e-8).to(torch::kDouble);
+	auto zero_points = torch::zeros({weight.size(0)}, torch::kLong);
+	return torch::quantize_per_channel(weight.contiguous(), scales, zero_points, 0, torch::kQInt8);
+}
+
+void select_quantized_engine() {
+	auto engines = at::globalContext().supportedQEngines();
+	for(auto engine : {at::QEngine::X86, at::QEngine::FBGEMM, at::QEngine::ONEDNN, at::QEngine::QNNPACK}) {
+		if( std::find(engines.begin(), engines.end(), engine) != engines.end() ) {
+			at::globalContext().setQEngine(engine);
+			std::cout << "quantized engine: " << toString(engine) << '\n';
+			return;
+		}
+	}
+	throw std::runtime_error("select_quantized_engine: this libtorch build has no quantized engine");
+}
+
+// --------------------------------
+// Observer
+// --------------------------------
+void MinMaxObserver::observe(const torch::Tensor& x) {
+	auto mm = torch::aminmax(x.detach());
+	min_ = std::min(min_, std::get<0>(mm).item<double>());
+	max_ = std::max(max_, std::get<1>(mm).item<double>());
+}
+
+std::pair<double, int64_t> MinMaxObserver::qparams() const {
+	TORCH_CHECK(min_ <= max_, "MinMaxObserver: no data observed, calibrate before convert()");
+
+	// the range must contain 0 so that zero padding is exact
+	double lo = std::min(min_, 0.0), hi = std::max(max_, 0.0);
+	double qmax = reduce_range_ ? 127.0 : 255.0;
+	double scale = std::max((hi - lo) / qmax, 1e-8);
+	int64_t zero_point = std::lround(-lo / scale);
+	zero_point = std::max<int64_t>(0, std::min<int64_t>(static_cast<int64_t>(qmax), zero_point));
+	return std::make_pair(scale, zero_point);
+}
+
+void MinMaxObserver::reset() {
+	min_ = std::numeric_limits<double>::max();
+	max_ = std::numeric_limits<double>::lowest();
+}
+
+// --------------------------------
+// Quantized units
+// --------------------------------
+torch::Tensor QuantStub::forward(const torch::Tensor& x) {
+	if( converted_ )
+		return torch::quantize_per_tensor(x.contiguous(), scale_, zero_point_, torch::kQUInt8);
+	observer_.observe(x);
+	return x;
+}
+
+void QuantStub::convert() {
+	std::tie(scale_, zero_point_) = observer_.qparams();
+	converted_ = true;
+}
+
+QuantizedConv2d::QuantizedConv2d(const torch::nn::Conv2d& conv, const torch::nn::BatchNorm2d& bn, bool relu) :
+		relu_(relu) {
+	torch::NoGradGuard no_grad;
+	const auto& o = conv->options;
+	TORCH_CHECK(std::get_if<torch::enumtype::kZeros>(&o.padding_mode()), "QuantizedConv2d: only zero padding is supported");
+	auto padding = std::get_if<torch::ExpandingArray<2>>(&o.padding());
+	TORCH_CHECK(padding, "QuantizedConv2d: 'same' / 'valid' padding is not supported");
+
+	stride_ = std::vector<int64_t>(o.stride()->begin(), o.stride()->end());
+	padding_ = std::vector<int64_t>((*padding)->begin(), (*padding)->end());
+	dilation_ = std::vector<int64_t>(o.dilation()->begin(), o.dilation()->end());
+	groups_ = o.groups();
+
+	weight_ = conv->weight.detach().to(torch::kCPU, torch::kFloat).clone();
+	bias_ = conv->bias.defined() ? conv->bias.detach().to(torch::kCPU, torch::kFloat).clone()
+								 : torch::zeros({weight_.size(0)}, torch::kFloat);
+
+	// fold the BatchNorm: w' = w * gamma / sqrt(var + eps), b' = (b - mean) * gamma / sqrt(var + eps) + beta
+	if( ! bn.is_empty() ) {
+		auto mean = bn->running_mean.detach().to(torch::kCPU, torch::kFloat);
+		auto var = bn->running_var.detach().to(torch::kCPU, torch::kFloat);
+		auto gamma = bn->options.affine() ? bn->weight.detach().to(torch::kCPU, torch::kFloat) : torch::ones_like(mean);
+		auto beta = bn->options.affine() ? bn->bias.detach().to(torch::kCPU, torch::kFloat) : torch::zeros_like(mean);
+
+		auto factor = gamma / torch::sqrt(var + bn->options.eps());
+		weight_.mul_(factor.view({-1, 1, 1, 1}));
+		bias_ = (bias_ - mean) * factor + beta;
+	}
+}
+
+torch::Tensor QuantizedConv2d::forward(const torch::Tensor& x) {
+	if( converted_ )
+		return call_quantized_op(relu_ ? "quantized::conv2d_relu" : "quantized::conv2d", "new",
+								 {x, packed_, scale_, zero_point_}).toTensor();
+
+	auto y = torch::conv2d(x, weight_, bias_, stride_, padding_, dilation_, groups_);
+	if( relu_ )
+		y.relu_();
+	observer_.observe(y);
+	return y;
+}
+
+void QuantizedConv2d::convert() {
+	std::tie(scale_, zero_point_) = observer_.qparams();
+	packed_ = call_quantized_op("quantized::conv2d_prepack", "",
+								{quantize_weight_per_channel(weight_), bias_, stride_, padding_, dilation_, groups_});
+	converted_ = true;
+}
+
+QuantizedLinear::QuantizedLinear(const torch::nn::Linear& linear, bool relu) : relu_(relu) {
+	weight_ = linear->weight.detach().to(torch::kCPU, torch::kFloat).clone();
+	bias_ = linear->bias.defined() ? linear->bias.detach().to(torch::kCPU, torch::kFloat).clone()
+								   : torch::zeros({weight_.size(0)}, torch::kFloat);
+}
+
+torch::Tensor QuantizedLinear::forward(const torch::Tensor& x) {
+	if( converted_ )
+		return call_quantized_op(relu_ ? "quantized::linear_relu" : "quantized::linear", "",
+								 {x, packed_, scale_, zero_point_}).toTensor();
+
+	auto y = torch::linear(x, weight_, bias_);
+	if( relu_ )
+		y.relu_();
+	observer_.observe(y);
+	return y;
+}
+
+void QuantizedLinear::convert() {
+	std::tie(scale_, zero_point_) = observer_.qparams();
+	packed_ = call_quantized_op("quantized::linear_prepack", "", {quantize_weight_per_channel(weight_), bias_});
+	converted_ = true;
+}
+
+torch::Tensor QuantizedAdd::forward(const torch::Tensor& a, const torch::Tensor& b) {
+	if( converted_ )
+		return call_quantized_op(relu_ ? "quantized::add_relu" : "quantized::add", "",
+								 {a, b, scale_, zero_point_}).toTensor();
+
+	auto y = a + b;
+	if( relu_ )
+		y.relu_();
+	observer_.observe(y);
+	return y;
+}
+
+void QuantizedAdd::convert() {
+	std::tie(scale_, zero_point_) = observer_.qparams();
+	converted_ = true;
+}
+
+// --------------------------------
+// Sequential networks
+// --------------------------------
+QuantizedSequential::QuantizedSequential(const torch::nn::Sequential& net) {
+	append(net);
+}
+
+void QuantizedSequential::append(const torch::nn::Sequential& net) {
+	auto children = net->children();
+	for(size_t i = 0; i < children.size(); i++) {
+		auto module = children[i];
+		auto next_is = [&](size_t j, auto* type) {
+			using T = std::remove_pointer_t<decltype(type)>;
+			return j < children.size() && std::dynamic_pointer_cast<T>(children[j]) != nullptr;
+		};
+
+		if( auto conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(module) ) {
+			torch::nn::BatchNorm2d bn{nullptr};
+			if( next_is(i + 1, (torch::nn::BatchNorm2dImpl*)nullptr) )
+				bn = torch::nn::BatchNorm2d(std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(children[++i]));
+			bool relu = next_is(i + 1, (torch::nn::ReLUImpl*)nullptr);
+			if( relu ) i++;
+
+			auto q = std::make_shared<QuantizedConv2d>(torch::nn::Conv2d(conv), bn, relu);
+			steps_.push_back([q](const torch::Tensor& x) { return q->forward(x); });
+			converters_.push_back([q]() { q->convert(); });
+
+		} else if( auto linear = std::dynamic_pointer_cast<torch::nn::LinearImpl>(module) ) {
+			bool relu = next_is(i + 1, (torch::nn::ReLUImpl*)nullptr);
+			if( relu ) i++;
+
+			auto q = std::make_shared<QuantizedLinear>(torch::nn::Linear(linear), relu);
+			steps_.push_back([q](const torch::Tensor& x) { return q->forward(x); });
+			converters_.push_back([q]() { q->convert(); });
+
+		} else if( auto seq = std::dynamic_pointer_cast<torch::nn::SequentialImpl>(module) ) {
+			append(torch::nn::Sequential(seq));
+
+		} else if( std::dynamic_pointer_cast<torch::nn::DropoutImpl>(module) ) {
+			continue;
+
+		} else if( std::dynamic_pointer_cast<torch::nn::ReLUImpl>(module) ) {
+			steps_.push_back([](const torch::Tensor& x) { return torch::relu(x); });
+
+		} else if( auto pool = std::dynamic_pointer_cast<torch::nn::MaxPool2dImpl>(module) ) {
+			steps_.push_back([pool](const torch::Tensor& x) { return pool->forward(x); });
+
+		} else if( auto pool = std::dynamic_pointer_cast<torch::nn::AvgPool2dImpl>(module) ) {
+			steps_.push_back([pool](const torch::Tensor& x) { return pool->forward(x); });
+
+		} else if( auto pool = std::dynamic_pointer_cast<torch::nn::AdaptiveAvgPool2dImpl>(module) ) {
+			steps_.push_back([pool](const torch::Tensor& x) { return pool->forward(x); });
+
+		} else if( auto flatten = std::dynamic_pointer_cast<torch::nn::FlattenImpl>(module) ) {
+			steps_.push_back([flatten](const torch::Tensor& x) { return flatten->forward(x); });
+
+		} else {
+			throw std::runtime_error("QuantizedSequential: unsupported module " + module->name());
+		}
+	}
+}
+
+torch::Tensor QuantizedSequential::forward(torch::Tensor x) {
+	torch::NoGradGuard no_grad;
+	x = quant_.forward(x);
+	for(auto& step : steps_)
+		x = step(x);
+	return x.is_quantized() ? x.dequantize() : x;
+}
+
+void QuantizedSequential::calibrate(const torch::Tensor& x) {
+	forward(x);
+}
+
+void QuantizedSequential::convert() {
+	quant_.convert();
+	for(auto& convert : converters_)
+		convert();
+}
+
+// --------------------------------
+// Report
+// --------------------------------
+void PTQReport::print(std::ostream& os) const {
+	os << "PTQ report on " << samples << " samples\n"
+	   << "  fp32 accuracy: " << fp32_accuracy << ", " << fp32_ms << " ms/sample\n"
+	   << "  int8 accuracy: " << int8_accuracy << ", " << int8_ms << " ms/sample\n"
+	   << "  agreement: " << agreement << ", speed-up: " << (int8_ms > 0 ? fp32_ms / int8_ms : 0.0) << "x\n";
+}
+
+PTQReport compare_fp32_int8(const std::function<torch::Tensor(const torch::Tensor&)>& fp32_model,
+							const std::function<torch::Tensor(const torch::Tensor&)>& int8_model,
+							const std::function<bool(torch::Tensor&, torch::Tensor&)>& next_batch) {
+	torch::NoGradGuard no_grad;
+	PTQReport report;
+	int64_t fp32_match = 0, int8_match = 0, agree = 0;
+	double fp32_ms = 0, int8_ms = 0;
+
+	torch::Tensor images, labels;
+	while( next_batch(images, labels) ) {
+		images = images.to(torch::kCPU);
+		labels = labels.to(torch::kCPU);
+
+		auto t0 = std::chrono::high_resolution_clock::now();
+		auto p32 = fp32_model(images).argmax(1);
+		auto t1 = std::chrono::high_resolution_clock::now();
+		auto p8 = int8_model(images).argmax(1);
+		auto t2 = std::chrono::high_resolution_clock::now();
+
+		fp32_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+		int8_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+		fp32_match += p32.eq(labels).sum().item<int64_t>();
+		int8_match += p8.eq(labels).sum().item<int64_t>();
+		agree += p32.eq(p8).sum().item<int64_t>();
+		report.samples += images.size(0);
+	}
+
+	if( report.samples > 0 ) {
+		double n = static_cast<double>(report.samples);
+		report.fp32_accuracy = fp32_match / n;
+		report.int8_accuracy = int8_match / n;
+		report.agreement = agree / n;
+		report.fp32_ms = fp32_ms / n;
+		report.int8_ms = int8_ms / n;
+	}
+	return report;
+}
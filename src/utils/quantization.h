@@ -0,0 +1,142 @@
+#include <torch/torch.h>
+#include <ATen/core/ivalue.h>
+#include <iostream>
+#include <functional>
+#include <limits>
+#include <vector>
+#include <utility>
+
+#ifndef SRC_UTILS_QUANTIZATION_H_
+#define SRC_UTILS_QUANTIZATION_H_
+
+// Post-training static int8 quantization (PTQ) for CPU inference.
+//
+// A quantized copy is built from a trained fp32 model (in eval mode, on the CPU). Until convert()
+// is called it runs in fp32 with BatchNorm folded into the convolutions, and observers record the
+// range of every activation, so a few calibrate() calls over sample batches are enough. convert()
+// then quantizes weights per output channel (symmetric qint8), activations per tensor (affine
+// quint8) and runs conv / linear / residual add through the quantized FBGEMM / oneDNN kernels.
+
+// Picks the best quantized engine of this libtorch build (x86 / FBGEMM, oneDNN, then QNNPACK).
+void select_quantized_engine();
+
+// Running min / max of a tensor, turned into quint8 affine parameters. reduce_range uses 7 bits,
+// which avoids accumulator saturation in the FBGEMM kernels on CPUs without VNNI.
+class MinMaxObserver {
+public:
+	explicit MinMaxObserver(bool reduce_range = true) : reduce_range_(reduce_range) {}
+
+	void observe(const torch::Tensor& x);
+	// (scale, zero_point)
+	std::pair<double, int64_t> qparams() const;
+	void reset();
+
+private:
+	bool reduce_range_;
+	double min_ = std::numeric_limits<double>::max();
+	double max_ = std::numeric_limits<double>::lowest();
+};
+
+// Quantizes the fp32 input of a network after convert().
+class QuantStub {
+public:
+	torch::Tensor forward(const torch::Tensor& x);
+	void convert();
+
+private:
+	MinMaxObserver observer_;
+	double scale_ = 1.0;
+	int64_t zero_point_ = 0;
+	bool converted_ = false;
+};
+
+// Conv2d with an optional BatchNorm2d folded in and an optional fused ReLU.
+class QuantizedConv2d {
+public:
+	QuantizedConv2d(const torch::nn::Conv2d& conv, const torch::nn::BatchNorm2d& bn = nullptr, bool relu = false);
+
+	torch::Tensor forward(const torch::Tensor& x);
+	void convert();
+
+private:
+	torch::Tensor weight_, bias_;
+	std::vector<int64_t> stride_, padding_, dilation_;
+	int64_t groups_;
+	bool relu_;
+	MinMaxObserver observer_;
+	c10::IValue packed_;
+	double scale_ = 1.0;
+	int64_t zero_point_ = 0;
+	bool converted_ = false;
+};
+
+// Linear with an optional fused ReLU.
+class QuantizedLinear {
+public:
+	QuantizedLinear(const torch::nn::Linear& linear, bool relu = false);
+
+	torch::Tensor forward(const torch::Tensor& x);
+	void convert();
+
+private:
+	torch::Tensor weight_, bias_;
+	bool relu_;
+	MinMaxObserver observer_;
+	c10::IValue packed_;
+	double scale_ = 1.0;
+	int64_t zero_point_ = 0;
+	bool converted_ = false;
+};
+
+// Residual addition (with optional ReLU) of two activations.
+class QuantizedAdd {
+public:
+	explicit QuantizedAdd(bool relu = false) : relu_(relu) {}
+
+	torch::Tensor forward(const torch::Tensor& a, const torch::Tensor& b);
+	void convert();
+
+private:
+	bool relu_;
+	MinMaxObserver observer_;
+	double scale_ = 1.0;
+	int64_t zero_point_ = 0;
+	bool converted_ = false;
+};
+
+// Quantized copy of a plain Sequential network such as AlexNet / VGG / NiN. Supports Conv2d
+// (followed by an optional BatchNorm2d and ReLU), Linear (+ ReLU), ReLU, MaxPool2d, AvgPool2d,
+// AdaptiveAvgPool2d, Flatten and Dropout (an identity at inference), and nested Sequentials.
+class QuantizedSequential {
+public:
+	explicit QuantizedSequential(const torch::nn::Sequential& net);
+
+	// fp32 in, fp32 out
+	torch::Tensor forward(torch::Tensor x);
+	void calibrate(const torch::Tensor& x);
+	void convert();
+
+private:
+	void append(const torch::nn::Sequential& net);
+
+	QuantStub quant_;
+	std::vector<std::function<torch::Tensor(const torch::Tensor&)>> steps_;
+	std::vector<std::function<void()>> converters_;
+};
+
+// Accuracy and latency of an fp32 model against its int8 copy on the same batches.
+struct PTQReport {
+	int64_t samples = 0;
+	double fp32_accuracy = 0, int8_accuracy = 0;
+	double agreement = 0;				// share of samples where both predict the same class
+	double fp32_ms = 0, int8_ms = 0;	// per sample
+
+	void print(std::ostream& os) const;
+};
+
+// next_batch fills (B, C, H, W) images and (B) labels, returning false at the end of the data.
+PTQReport compare_fp32_int8(const std::function<torch::Tensor(const torch::Tensor&)>& fp32_model,
+							const std::function<torch::Tensor(const torch::Tensor&)>& int8_model,
+							const std::function<bool(torch::Tensor&, torch::Tensor&)>& next_batch);
+
+#endif /* SRC_UTILS_QUANTIZATION_H_ */
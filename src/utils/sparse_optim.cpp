@@ -0,0 +1,223 @@
+#include "sparse_optim.h"
+
+#include <cmath>
+#include <torch/optim/serialize.h>
+
+
+std::pair<torch::Tensor, torch::Tensor> gradient_rows(const torch::Tensor& param, const torch::Tensor& grad) {
+	int64_t row_size = param.dim() > 1 ? param.numel() / param.size(0) : 1;
+	if( grad.is_sparse() ) {
+		auto g = grad.coalesce();		// merges duplicate rows
+		return {g.indices()[0].contiguous(), g.values().reshape({-1, row_size}).contiguous()};
+	}
+	return {torch::arange(param.size(0), torch::TensorOptions(torch::kLong).device(param.device())),
+			grad.reshape({param.size(0), row_size}).contiguous()};
+}
+
+static bool cpu_float(const torch::Tensor& p) {
+	return p.device().is_cpu() && p.scalar_type() == torch::kFloat && p.is_contiguous();
+}
+
+// -----------------------------------------------------------
+// SparseAdam
+// -----------------------------------------------------------
+void SparseAdamOptions::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(lr);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(beta1);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(beta2);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(eps);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(weight_decay);
+}
+
+void SparseAdamOptions::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, lr);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, beta1);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, beta2);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, eps);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, weight_decay);
+}
+
+void SparseAdamParamState::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(step);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exp_avg);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(exp_avg_sq);
+}
+
+void SparseAdamParamState::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(int64_t, step);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, exp_avg);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, exp_avg_sq);
+}
+
+void SparseAdam::save(torch::serialize::OutputArchive& archive) const {
+	torch::optim::serialize(*this, archive);
+}
+
+void SparseAdam::load(torch::serialize::InputArchive& archive) {
+	torch::optim::serialize<SparseAdamParamState, SparseAdamOptions>(*this, archive);
+}
+
+torch::Tensor SparseAdam::step(LossClosure closure) {
+	torch::NoGradGuard no_grad;
+	torch::Tensor loss = {};
+	if( closure != nullptr ) {
+		at::AutoGradMode enable_grad(true);
+		loss = closure();
+	}
+
+	for(auto& group : param_groups_) {
+		auto& options = static_cast<SparseAdamOptions&>(group.options());
+		for(auto& p : group.params()) {
+			if( ! p.grad().defined() )
+				continue;
+
+			auto& state_ptr = state_[p.unsafeGetTensorImpl()];
+			if( ! state_ptr ) {
+				auto s = std::make_unique<SparseAdamParamState>();
+				s->exp_avg(torch::zeros_like(p, torch::MemoryFormat::Contiguous));
+				s->exp_avg_sq(torch::zeros_like(p, torch::MemoryFormat::Contiguous));
+				state_ptr = std::move(s);
+			}
+			auto& state = static_cast<SparseAdamParamState&>(*state_ptr);
+			state.step(state.step() + 1);
+
+			torch::Tensor rows, values;
+			std::tie(rows, values) = gradient_rows(p, p.grad());
+			const double bias_correction1 = 1.0 - std::pow(options.beta1(), state.step());
+			const double bias_correction2 = 1.0 - std::pow(options.beta2(), state.step());
+			const double step_size = options.lr() / bias_correction1;
+			const double wd = options.weight_decay();
+
+			if( cpu_float(p) ) {
+				const int64_t n = rows.numel(), d = values.size(1);
+				const int64_t* row = rows.data_ptr<int64_t>();
+				const float* g = values.data_ptr<float>();
+				float* w = p.data_ptr<float>();
+				float* m = state.exp_avg().data_ptr<float>();
+				float* v = state.exp_avg_sq().data_ptr<float>();
+				const float beta1 = options.beta1(), beta2 = options.beta2(), eps = options.eps();
+				const float sqrt_bc2 = std::sqrt(bias_correction2);
+
+				#pragma omp parallel for schedule(static)
+				for(int64_t r = 0; r < n; r++) {
+					const int64_t off = row[r] * d;
+					for(int64_t j = 0; j < d; j++) {
+						float gj = g[r * d + j];
+						if( wd != 0.0 )
+							gj += static_cast<float>(wd) * w[off + j];
+						m[off + j] = beta1 * m[off + j] + (1.0f - beta1) * gj;
+						v[off + j] = beta2 * v[off + j] + (1.0f - beta2) * gj * gj;
+						w[off + j] -= static_cast<float>(step_size) * m[off + j] / (std::sqrt(v[off + j]) / sqrt_bc2 + eps);
+					}
+				}
+				continue;
+			}
+
+			// other devices / dtypes: gather, update and scatter the touched rows
+			auto P = p.view({p.size(0), -1});
+			auto M = state.exp_avg().view({p.size(0), -1});
+			auto V = state.exp_avg_sq().view({p.size(0), -1});
+			auto w = P.index_select(0, rows);
+			auto g = wd != 0.0 ? values + wd * w : values;
+			auto m = M.index_select(0, rows).mul_(options.beta1()).add_(g, 1.0 - options.beta1());
+			auto v = V.index_select(0, rows).mul_(options.beta2()).addcmul_(g, g, 1.0 - options.beta2());
+			auto denom = (v.sqrt() / std::sqrt(bias_correction2)).add_(options.eps());
+			M.index_copy_(0, rows, m);
+			V.index_copy_(0, rows, v);
+			P.index_copy_(0, rows, w.addcdiv_(m, denom, -step_size));
+		}
+	}
+	return loss;
+}
+
+// -----------------------------------------------------------
+// Row-wise Adagrad
+// -----------------------------------------------------------
+void RowWiseAdagradOptions::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(lr);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(eps);
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(weight_decay);
+}
+
+void RowWiseAdagradOptions::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, lr);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, eps);
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(double, weight_decay);
+}
+
+void RowWiseAdagradParamState::serialize(torch::serialize::OutputArchive& archive) const {
+	_TORCH_OPTIM_SERIALIZE_TORCH_ARG(sum);
+}
+
+void RowWiseAdagradParamState::serialize(torch::serialize::InputArchive& archive) {
+	_TORCH_OPTIM_DESERIALIZE_TORCH_ARG(torch::Tensor, sum);
+}
+
+void RowWiseAdagrad::save(torch::serialize::OutputArchive& archive) const {
+	torch::optim::serialize(*this, archive);
+}
+
+void RowWiseAdagrad::load(torch::serialize::InputArchive& archive) {
+	torch::optim::serialize<RowWiseAdagradParamState, RowWiseAdagradOptions>(*this, archive);
+}
+
+torch::Tensor RowWiseAdagrad::step(LossClosure closure) {
+	torch::NoGradGuard no_grad;
+	torch::Tensor loss = {};
+	if( closure != nullptr ) {
+		at::AutoGradMode enable_grad(true);
+		loss = closure();
+	}
+
+	for(auto& group : param_groups_) {
+		auto& options = static_cast<RowWiseAdagradOptions&>(group.options());
+		for(auto& p : group.params()) {
+			if( ! p.grad().defined() )
+				continue;
+
+			auto& state_ptr = state_[p.unsafeGetTensorImpl()];
+			if( ! state_ptr ) {
+				auto s = std::make_unique<RowWiseAdagradParamState>();
+				s->sum(torch::zeros({p.size(0)}, p.options()));
+				state_ptr = std::move(s);
+			}
+			auto& state = static_cast<RowWiseAdagradParamState&>(*state_ptr);
+
+			torch::Tensor rows, values;
+			std::tie(rows, values) = gradient_rows(p, p.grad());
+			const double wd = options.weight_decay();
+
+			if( cpu_float(p) ) {
+				const int64_t n = rows.numel(), d = values.size(1);
+				const int64_t* row = rows.data_ptr<int64_t>();
+				const float* g = values.data_ptr<float>();
+				float* w = p.data_ptr<float>();
+				float* sum = state.sum().data_ptr<float>();
+				const float lr = options.lr(), eps = options.eps();
+
+				#pragma omp parallel for schedule(static)
+				for(int64_t r = 0; r < n; r++) {
+					const int64_t off = row[r] * d;
+					float sq = 0.0f;
+					for(int64_t j = 0; j < d; j++) {
+						float gj = g[r * d + j] + static_cast<float>(wd) * w[off + j];
+						sq += gj * gj;
+					}
+					sum[row[r]] += sq / d;
+					const float scale = lr / (std::sqrt(sum[row[r]]) + eps);
+					for(int64_t j = 0; j < d; j++)
+						w[off + j] -= scale * (g[r * d + j] + static_cast<float>(wd) * w[off + j]);
+				}
+				continue;
+			}
+
+			auto P = p.view({p.size(0), -1});
+			auto w = P.index_select(0, rows);
+			auto g = wd != 0.0 ? values + wd * w : values;
+			auto s = state.sum().index_select(0, rows).add_(g.square().mean(1));
+			state.sum().index_copy_(0, rows, s);
+			P.index_copy_(0, rows, w.sub_(g * (options.lr() / (s.sqrt() + options.eps())).unsqueeze(1)));
+		}
+	}
+	return loss;
+}
@@ -0,0 +1,93 @@
+#include <torch/torch.h>
+#include <utility>
+#include <vector>
+
+#ifndef SRC_UTILS_SPARSE_OPTIM_H_
+#define SRC_UTILS_SPARSE_OPTIM_H_
+
+// Optimizers for embedding tables trained with sparse gradients (torch::nn::EmbeddingOptions::sparse).
+// Only the rows present in the batch are read and written. Duplicate rows are merged once by
+// coalesce(), and the unique rows are updated in parallel with OpenMP, so the cost of a step scales
+// with the batch, not with the catalogue. Weight decay is lazy: a row decays only when it is
+// touched. Dense gradients are accepted too and update every row. Options and state are saved with
+// torch::save / torch::load like those of the built-in optimizers.
+
+// (unique row ids, (rows, row_size) gradient values) of a sparse or dense gradient
+std::pair<torch::Tensor, torch::Tensor> gradient_rows(const torch::Tensor& param, const torch::Tensor& grad);
+
+// -----------------------------------------------------------
+// SparseAdam
+// -----------------------------------------------------------
+struct SparseAdamOptions : public torch::optim::OptimizerCloneableOptions<SparseAdamOptions> {
+	SparseAdamOptions(double lr = 1e-3) : lr_(lr) {}
+	TORCH_ARG(double, lr);
+	TORCH_ARG(double, beta1) = 0.9;
+	TORCH_ARG(double, beta2) = 0.999;
+	TORCH_ARG(double, eps) = 1e-8;
+	// lazy L2 penalty, added to the gradient of the touched rows
+	TORCH_ARG(double, weight_decay) = 0.0;
+
+	double get_lr() const override { return lr(); }
+	void set_lr(const double lr) override { this->lr(lr); }
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+struct SparseAdamParamState : public torch::optim::OptimizerCloneableParamState<SparseAdamParamState> {
+	TORCH_ARG(int64_t, step) = 0;
+	TORCH_ARG(torch::Tensor, exp_avg);
+	TORCH_ARG(torch::Tensor, exp_avg_sq);
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+// Adam on the touched rows only; the moments of the other rows are left as they are (lazy Adam, as
+// torch.optim.SparseAdam).
+class SparseAdam : public torch::optim::Optimizer {
+public:
+	explicit SparseAdam(std::vector<torch::Tensor> params, SparseAdamOptions defaults = SparseAdamOptions())
+		: torch::optim::Optimizer({torch::optim::OptimizerParamGroup(params)},
+								  std::make_unique<SparseAdamOptions>(defaults)) {}
+
+	torch::Tensor step(LossClosure closure = nullptr) override;
+	// options and per-parameter state, so that resumed runs keep their moments / accumulators
+	void save(torch::serialize::OutputArchive& archive) const override;
+	void load(torch::serialize::InputArchive& archive) override;
+};
+
+// -----------------------------------------------------------
+// Row-wise Adagrad
+// -----------------------------------------------------------
+struct RowWiseAdagradOptions : public torch::optim::OptimizerCloneableOptions<RowWiseAdagradOptions> {
+	RowWiseAdagradOptions(double lr = 0.01) : lr_(lr) {}
+	TORCH_ARG(double, lr);
+	TORCH_ARG(double, eps) = 1e-8;
+	TORCH_ARG(double, weight_decay) = 0.0;
+
+	double get_lr() const override { return lr(); }
+	void set_lr(const double lr) override { this->lr(lr); }
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+struct RowWiseAdagradParamState : public torch::optim::OptimizerCloneableParamState<RowWiseAdagradParamState> {
+	TORCH_ARG(torch::Tensor, sum);		// one accumulator per row
+	void serialize(torch::serialize::InputArchive& archive) override;
+	void serialize(torch::serialize::OutputArchive& archive) const override;
+};
+
+// Adagrad with a single accumulator per row (the mean squared gradient of the row), which needs
+// one float per row instead of a copy of the table.
+class RowWiseAdagrad : public torch::optim::Optimizer {
+public:
+	explicit RowWiseAdagrad(std::vector<torch::Tensor> params, RowWiseAdagradOptions defaults = RowWiseAdagradOptions())
+		: torch::optim::Optimizer({torch::optim::OptimizerParamGroup(params)},
+								  std::make_unique<RowWiseAdagradOptions>(defaults)) {}
+
+	torch::Tensor step(LossClosure closure = nullptr) override;
+	// options and per-parameter state, so that resumed runs keep their moments / accumulators
+	void save(torch::serialize::OutputArchive& archive) const override;
+	void load(torch::serialize::InputArchive& archive) override;
+};
+
+#endif /* SRC_UTILS_SPARSE_OPTIM_H_ */